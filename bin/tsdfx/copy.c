@@ -34,6 +34,7 @@
 #include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pwd.h>
 #include <stdint.h>
@@ -49,16 +50,35 @@
 
 #include <tsd/assert.h>
 #include <tsd/log.h>
+#include <tsd/ratelimit.h>
 #include <tsd/sha1.h>
+#include <tsd/stat.h>
 #include <tsd/strutil.h>
 #include <tsd/task.h>
 
 #include "tsdfx.h"
 #include "tsdfx_copy.h"
-
-#define TSDFX_COPY_UMASK 007
+#include "tsdfx_map.h"
+#include "tsdfx_worker.h"
 
 int tsdfx_dryrun = 0;
+int tsdfx_check = 0;
+int tsdfx_direct = 0;
+int tsdfx_kcopy = 0;
+unsigned int tsdfx_qdepth = 0;
+unsigned int tsdfx_nthreads = 0;
+const char *tsdfx_digest = NULL;
+const char *tsdfx_cache = NULL;
+const char *tsdfx_blocksize = NULL;
+const char *tsdfx_statedir = NULL;
+
+/*
+ * Regular files larger than this are copied in ranges of this size by
+ * several copier processes in parallel, provided they have not been
+ * modified for a while.  Zero disables splitting.
+ */
+off_t tsdfx_rangesize = 0;
+#define TSDFX_COPY_SPLIT_AGE 60
 
 /*
  * When source files are unmodified for this long, and already present
@@ -74,6 +94,39 @@ struct tsdfx_copy_task_data {
 	char src[PATH_MAX];
 	char dst[PATH_MAX];
 	const char *maxsize;
+	unsigned int queue;
+
+	/* in dry-run mode, the map it belongs to and what the copier found */
+	char map[NAME_MAX];
+	int planned;
+	struct tsdfx_copy_plan plan;
+
+	/* for one range of a file copied in parallel */
+	off_t offset, length;
+	char parent[64];
+
+	/* for the task which completes a file copied in parallel */
+	int split;
+	unsigned int pending;
+	int failed;
+
+	/* for a task copied by another task's copier */
+	char leader[64];
+
+	/* for a task copied by a worker thread */
+	struct tsdfx_worker_job *job;
+
+	/* for a task whose copier also copies other tasks' files */
+	char (*members)[64];
+	unsigned int nmembers;
+	unsigned int nresults;
+	int result;
+	char *batch;
+	size_t batchlen;
+
+	/* partial line of output from the copier */
+	char out[128];
+	size_t outlen;
 };
 
 /*
@@ -85,26 +138,56 @@ static struct tsd_tset *tsdfx_copy_tasks;
  * Size-differentiated task queues for copy tasks
  */
 #define TSDFX_COPY_NQUEUES 2
+#define TSDFX_COPY_BATCH_QUEUE 0
+#define TSDFX_COPY_MAX_BATCH 256
 static struct tsdfx_copy_queueinfo {
+	const char	*name;
 	size_t		 max_size;
 	unsigned int	 max_tasks;
 	char		 max_size_str[sizeof(size_t) * 4]; /* ~log10(SIZE_MAX) */
+	struct tsd_ratelimit ratelimit;
+	char		 ratelimit_str[2][256];
 } tsdfx_queueinfo[TSDFX_COPY_NQUEUES] = {
 	{
+		.name = "small",
 		.max_size = 1024*1024,
 		.max_tasks = 8,
 	},
 	{
+		.name = "large",
 		.max_size = SIZE_MAX,
 		.max_tasks = 4,
 	},
 };
+
+/*
+ * Byte rate limit for all copy tasks together.  This and the limits for
+ * each queue are divided evenly between the tasks which may run at once
+ * and passed on to each copier, so that the sum never exceeds them.
+ */
+static struct tsd_ratelimit tsdfx_copy_ratelimit_all;
 static struct tsd_tqueue *tsdfx_copy_queues[TSDFX_COPY_NQUEUES];
 
 /* full path to copier binary */
 const char *tsdfx_copier;
 
 static void tsdfx_copy_name(char *, const char *, const char *);
+static struct tsd_task *tsdfx_copy_task(const char *, tsd_task_func *,
+    struct tsdfx_copy_task_data *, const struct stat *);
+static void tsdfx_copy_split(struct tsd_task *, const struct stat *);
+static int tsdfx_copy_enqueue(struct tsd_task *, off_t);
+static void tsdfx_copy_range_done(struct tsd_task *);
+static int tsdfx_copy_samecred(const struct tsd_task *,
+    const struct tsd_task *);
+static int tsdfx_copy_batch_add(struct tsd_task *,
+    const struct tsdfx_copy_task_data *);
+static void tsdfx_copy_batch_free(struct tsdfx_copy_task_data *);
+static void tsdfx_copy_batch(struct tsd_tqueue *);
+static void tsdfx_copy_batch_result(struct tsd_task *, int,
+    const struct tsdfx_copy_plan *);
+static void tsdfx_copy_batch_done(struct tsd_task *);
+static int tsdfx_copy_result_poll(struct tsd_task *);
+static int tsdfx_copy_thread_poll(struct tsd_task *);
 static struct tsd_task *tsdfx_copy_find(const char *, const char *);
 static int tsdfx_copy_poll(struct tsd_task *);
 static void tsdfx_copy_child(void *);
@@ -192,24 +275,299 @@ tsdfx_copy_remove(struct tsd_task *t)
 	return (0);
 }
 
+/*
+ * Create a task which runs with the credentials of the owner of the
+ * source file.
+ */
+static struct tsd_task *
+tsdfx_copy_task(const char *name, tsd_task_func *task,
+    struct tsdfx_copy_task_data *ctd, const struct stat *st)
+{
+	struct tsd_task *t;
+	struct passwd *pw;
+	gid_t gid;
+
+	if ((t = tsd_task_create(name, task, ctd)) == NULL)
+		return (NULL);
+	if ((pw = getpwuid(st->st_uid)) != NULL) {
+		VERBOSE("setuser(\"%s\") for %s", pw->pw_name, ctd->src);
+		if (tsd_task_setuser(t, pw->pw_name) != 0)
+			goto fail;
+		if (tsd_task_setegid(t, st->st_gid) != 0) {
+			WARNING("%s: owner %lu (%s) is not in group %lu",
+			    ctd->src, (unsigned long)st->st_uid, pw->pw_name,
+			    (unsigned long)st->st_gid);
+		}
+	} else {
+		VERBOSE("getpwuid(%lu) failed; setcred(%lu, %lu) for %s",
+		    (unsigned long)st->st_uid, (unsigned long)st->st_uid,
+		    (unsigned long)st->st_gid, ctd->src);
+		gid = st->st_gid;
+		if (tsd_task_setcred(t, st->st_uid, &gid, 1) != 0)
+			goto fail;
+	}
+	return (t);
+fail:
+	tsd_task_destroy(t);
+	return (NULL);
+}
+
+/*
+ * Create and queue a task for each range of a file which is to be
+ * copied in parallel.  The given task completes the copy once all of
+ * them are done.  If we fail to create some of them, the copy will
+ * fail once the others are done, and be retried later.
+ */
+static void
+tsdfx_copy_split(struct tsd_task *t, const struct stat *st)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud, *rctd;
+	struct tsd_tqueue *tq;
+	struct tsd_task *rt;
+	char name[NAME_MAX];
+	off_t off;
+
+	ctd->split = 1;
+	ctd->queue = TSDFX_COPY_NQUEUES - 1;
+	tq = tsdfx_copy_queues[TSDFX_COPY_NQUEUES - 1];
+	for (off = 0; off < st->st_size; off += tsdfx_rangesize) {
+		if ((rctd = calloc(1, sizeof *rctd)) == NULL) {
+			ctd->failed = 1;
+			break;
+		}
+		strlcpy(rctd->src, ctd->src, sizeof rctd->src);
+		strlcpy(rctd->dst, ctd->dst, sizeof rctd->dst);
+		strlcpy(rctd->parent, t->name, sizeof rctd->parent);
+		rctd->queue = TSDFX_COPY_NQUEUES - 1;
+		rctd->offset = off;
+		rctd->length = st->st_size - off;
+		if (rctd->length > tsdfx_rangesize)
+			rctd->length = tsdfx_rangesize;
+		snprintf(name, sizeof name, "%s.%jx", t->name, (intmax_t)off);
+		if ((rt = tsdfx_copy_task(name, tsdfx_copy_child, rctd,
+		    st)) == NULL) {
+			free(rctd);
+			ctd->failed = 1;
+			break;
+		}
+		if (tsdfx_copy_add(rt) != 0 || tsd_tqueue_insert(tq, rt) != 0) {
+			if (rt->set != NULL)
+				tsdfx_copy_remove(rt);
+			tsd_task_destroy(rt);
+			free(rctd);
+			ctd->failed = 1;
+			break;
+		}
+		ctd->pending++;
+	}
+	VERBOSE("copying %s in %u ranges", ctd->src, ctd->pending);
+}
+
+/*
+ * A range task is going away; let the task which completes the copy
+ * know how it went.
+ */
+static void
+tsdfx_copy_range_done(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud, *pctd;
+	struct tsd_task *pt;
+
+	if (ctd->parent[0] == '\0' ||
+	    (pt = tsd_tset_find(tsdfx_copy_tasks, ctd->parent)) == NULL)
+		return;
+	pctd = pt->ud;
+	ASSERT(pctd->pending > 0);
+	pctd->pending--;
+	if (t->state != TASK_FINISHED)
+		pctd->failed = 1;
+	ctd->parent[0] = '\0';
+}
+
+/*
+ * Check whether two tasks run with the same credentials.
+ */
+static int
+tsdfx_copy_samecred(const struct tsd_task *a, const struct tsd_task *b)
+{
+
+	return (a->uid == b->uid && a->ngids == b->ngids &&
+	    memcmp(a->gids, b->gids, a->ngids * sizeof a->gids[0]) == 0);
+}
+
+/*
+ * Append a source and destination pair to a batch task's list.
+ */
+static int
+tsdfx_copy_batch_add(struct tsd_task *t,
+    const struct tsdfx_copy_task_data *mctd)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	size_t srclen, dstlen;
+	char *p;
+
+	srclen = strlen(mctd->src) + 1;
+	dstlen = strlen(mctd->dst) + 1;
+	if ((p = realloc(ctd->batch, ctd->batchlen + srclen + dstlen)) == NULL)
+		return (-1);
+	ctd->batch = p;
+	memcpy(ctd->batch + ctd->batchlen, mctd->src, srclen);
+	ctd->batchlen += srclen;
+	memcpy(ctd->batch + ctd->batchlen, mctd->dst, dstlen);
+	ctd->batchlen += dstlen;
+	return (0);
+}
+
+/*
+ * Turn a batch task back into an ordinary one.
+ */
+static void
+tsdfx_copy_batch_free(struct tsdfx_copy_task_data *ctd)
+{
+
+	free(ctd->members);
+	ctd->members = NULL;
+	ctd->nmembers = 0;
+	free(ctd->batch);
+	ctd->batch = NULL;
+	ctd->batchlen = 0;
+}
+
+/*
+ * If there are more idle tasks in a queue than it can run at once,
+ * group them so that each copier process copies several files owned by
+ * the same user, and we do not have to start one for each of them.
+ * The first task of each group becomes its leader and stays in the
+ * queue; the others are taken off the queue and wait for the leader's
+ * copier to report on them.
+ */
+static void
+tsdfx_copy_batch(struct tsd_tqueue *tq)
+{
+	struct tsdfx_copy_task_data *ctd, *mctd;
+	struct tsd_task *t, *mt, *mtn;
+	unsigned int nidle, size;
+
+	/* count the tasks which are neither running nor batched */
+	nidle = 0;
+	for (t = tq->first; t != NULL; t = t->qnext) {
+		ctd = t->ud;
+		if (t->state == TASK_IDLE && ctd->dst[0] != '\0' &&
+		    ctd->members == NULL)
+			++nidle;
+	}
+	if (nidle <= tq->max_running)
+		return;
+	size = (nidle + tq->max_running - 1) / tq->max_running;
+	if (size > TSDFX_COPY_MAX_BATCH)
+		size = TSDFX_COPY_MAX_BATCH;
+
+	for (t = tq->first; t != NULL; t = t->qnext) {
+		ctd = t->ud;
+		if (t->state != TASK_IDLE || ctd->dst[0] == '\0' ||
+		    ctd->members != NULL)
+			continue;
+		if ((ctd->members = calloc(size - 1,
+		    sizeof *ctd->members)) == NULL ||
+		    tsdfx_copy_batch_add(t, ctd) != 0) {
+			tsdfx_copy_batch_free(ctd);
+			break;
+		}
+		for (mt = t->qnext; mt != NULL && ctd->nmembers < size - 1;
+		     mt = mtn) {
+			mtn = mt->qnext;
+			mctd = mt->ud;
+			if (mt->state != TASK_IDLE || mctd->dst[0] == '\0' ||
+			    mctd->members != NULL || !tsdfx_copy_samecred(t, mt))
+				continue;
+			if (tsdfx_copy_batch_add(t, mctd) != 0)
+				break;
+			strlcpy(ctd->members[ctd->nmembers++], mt->name,
+			    sizeof ctd->members[0]);
+			strlcpy(mctd->leader, t->name, sizeof mctd->leader);
+			tsd_tqueue_remove(tq, mt);
+		}
+		if (ctd->nmembers == 0) {
+			/* nobody to share with; copy this one on its own */
+			tsdfx_copy_batch_free(ctd);
+			continue;
+		}
+		VERBOSE("batch of %u files for %s", ctd->nmembers + 1,
+		    ctd->src);
+		t->flags |= TASK_STDOUT_PIPE;
+	}
+}
+
+/*
+ * Record the outcome of the next file in a batch: first the leader's
+ * own, then each of the others in turn.  A copier which is not copying
+ * a batch only reports on the leader's own file.
+ */
+static void
+tsdfx_copy_batch_result(struct tsd_task *t, int ok,
+    const struct tsdfx_copy_plan *plan)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud, *mctd;
+	struct tsd_task *mt;
+	unsigned int i;
+
+	if ((i = ctd->nresults++) == 0) {
+		ctd->result = ok;
+		if (plan != NULL) {
+			ctd->plan = *plan;
+			ctd->planned = 1;
+		}
+		return;
+	}
+	if (i > ctd->nmembers) {
+		WARNING("too many results from copier for %s", ctd->src);
+		return;
+	}
+	mt = tsd_tset_find(tsdfx_copy_tasks, ctd->members[i - 1]);
+	if (mt == NULL)
+		return;
+	mctd = mt->ud;
+	if (strcmp(mctd->leader, t->name) != 0)
+		return;
+	mctd->leader[0] = '\0';
+	if (plan != NULL) {
+		mctd->plan = *plan;
+		mctd->planned = 1;
+	}
+	mt->state = ok ? TASK_FINISHED : TASK_FAILED;
+}
+
+/*
+ * A batch task is going away; fail any files its copier did not get
+ * around to.  They will be picked up again the next time the source
+ * directory is scanned.
+ */
+static void
+tsdfx_copy_batch_done(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+
+	if (ctd->members == NULL)
+		return;
+	if (ctd->nresults == 0)
+		ctd->nresults = 1;
+	while (ctd->nresults <= ctd->nmembers)
+		tsdfx_copy_batch_result(t, 0, NULL);
+}
+
 /*
  * Prepare a copy or purge task.
  * Purge src if dst is NULL.
+ * The caller provides the source's type, owner, size and mtime.
  */
 struct tsd_task *
-tsdfx_copy_new(const char *src, const char *dst)
+tsdfx_copy_new(const char *src, const char *dst, const struct stat *st)
 {
 	char name[NAME_MAX];
 	struct tsdfx_copy_task_data *ctd = NULL;
 	struct tsd_task *t = NULL;
-	struct stat st;
-	struct passwd *pw;
 	tsd_task_func *task;
-	int i, serrno;
-
-	/* check that the source exists */
-	if (lstat(src, &st) != 0)
-		return (NULL);
+	int serrno;
 
 	/* check for existing task */
 	if (tsdfx_copy_find(src, dst) != NULL) {
@@ -233,39 +591,43 @@ tsdfx_copy_new(const char *src, const char *dst)
 		task = tsdfx_copy_child;
 	else
 		task = tsdfx_copy_purgesource_child;
-	if ((t = tsd_task_create(name, task, ctd)) == NULL)
+	if ((t = tsdfx_copy_task(name, task, ctd, st)) == NULL)
 		goto fail;
-	if ((pw = getpwuid(st.st_uid)) != NULL) {
-		VERBOSE("setuser(\"%s\") for %s", pw->pw_name, src);
-		if (tsd_task_setuser(t, pw->pw_name) != 0)
-			goto fail;
-		if (tsd_task_setegid(t, st.st_gid) != 0) {
-			WARNING("%s: owner %lu (%s) is not in group %lu", src,
-			    (unsigned long)st.st_uid, pw->pw_name,
-			    (unsigned long)st.st_gid);
-		}
-	} else {
-		VERBOSE("getpwuid(%lu) failed; setcred(%lu, %lu) for %s",
-		    (unsigned long)st.st_uid, (unsigned long)st.st_uid,
-		    (unsigned long)st.st_gid, src);
-		if (tsd_task_setcred(t, st.st_uid, &st.st_gid, 1) != 0)
-			goto fail;
-	}
 	if (tsdfx_copy_add(t) != 0)
 		goto fail;
 
-	/* Select queue based on current size */
-	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
-		if ((size_t)st.st_size <= tsdfx_queueinfo[i].max_size) {
-			VERBOSE("Assigning %s to copier for files size <= %zu",
-			    src, tsdfx_queueinfo[i].max_size);
-			ctd->maxsize = tsdfx_queueinfo[i].max_size_str;
-			if (tsd_tqueue_insert(tsdfx_copy_queues[i], t) != 0)
-				goto fail;
-			break;
-		}
+	/* a dry-run copier tells us what it found */
+	if (dst != NULL && tsdfx_dryrun)
+		t->flags |= TASK_STDOUT_PIPE;
+
+	/*
+	 * Split large files which have stopped changing.  This task will
+	 * not be queued until the ranges have been copied.  There is no
+	 * point in doing so for a dry run.
+	 */
+	if (dst != NULL && !tsdfx_dryrun && tsdfx_rangesize > 0 &&
+	    S_ISREG(st->st_mode) &&
+	    st->st_size > tsdfx_rangesize &&
+	    time(NULL) - st->st_mtime >= TSDFX_COPY_SPLIT_AGE) {
+		tsdfx_copy_split(t, st);
+		return (t);
 	}
 
+	/*
+	 * Small files can be copied by a worker thread instead of a
+	 * copier process.  If that fails, fall back to the latter.
+	 */
+	if (dst != NULL && tsdfx_nthreads > 0 && !tsdfx_dryrun &&
+	    S_ISREG(st->st_mode) && st->st_size <= TSDFX_WORKER_MAX_SIZE) {
+		ctd->job = tsdfx_worker_submit(src, dst, t->uid, t->gids,
+		    t->ngids);
+		if (ctd->job != NULL)
+			return (t);
+		VERBOSE("%s: %s", src, strerror(errno));
+	}
+
+	if (tsdfx_copy_enqueue(t, st->st_size) != 0)
+		goto fail;
 	return (t);
 fail:
 	serrno = errno;
@@ -291,8 +653,16 @@ tsdfx_copy_delete(struct tsd_task *t)
 	ctd = t->ud;
 
 	VERBOSE("stopping %s -> %s", ctd->src, ctd->dst);
+	tsdfx_copy_range_done(t);
+	tsdfx_copy_batch_done(t);
+	if (ctd->map[0] != '\0')
+		tsdfx_map_plan_done(ctd->map,
+		    ctd->planned && t->state == TASK_FINISHED ?
+		    &ctd->plan : NULL);
+	tsdfx_worker_release(ctd->job);
 	tsdfx_copy_remove(t);
 	tsd_task_destroy(t);
+	tsdfx_copy_batch_free(ctd);
 	free(ctd);
 }
 
@@ -323,8 +693,11 @@ static void
 tsdfx_copy_child(void *ud)
 {
 	struct tsdfx_copy_task_data *ctd = ud;
-	const char *argv[12];
-	int argc;
+	const struct tsdfx_copy_queueinfo *qi;
+	const char *argv[32];
+	char qdepth[16], range[64];
+	FILE *f;
+	int argc, i;
 
 	/* check credentials */
 	if (geteuid() == 0 || getegid() == 0)
@@ -334,11 +707,57 @@ tsdfx_copy_child(void *ud)
 	/* set safe umask */
 	umask(TSDFX_COPY_UMASK);
 
+	/* feed the list of files in a batch to the copier */
+	if (ctd->batch != NULL) {
+		if ((f = tmpfile()) == NULL ||
+		    fwrite(ctd->batch, 1, ctd->batchlen, f) != ctd->batchlen ||
+		    fflush(f) != 0 || lseek(fileno(f), 0, SEEK_SET) != 0 ||
+		    dup2(fileno(f), STDIN_FILENO) != STDIN_FILENO) {
+			ERROR("failed to pass file list to copier");
+			_exit(1);
+		}
+		fclose(f);
+	}
+
 	/* run the copy task */
 	argc = 0;
 	argv[argc++] = tsdfx_copier;
 	if (tsdfx_dryrun)
 		argv[argc++] = "-n";
+	if (tsdfx_check)
+		argv[argc++] = "-c";
+	if (tsdfx_direct)
+		argv[argc++] = "-D";
+	if (tsdfx_kcopy)
+		argv[argc++] = "-k";
+	if (tsdfx_digest != NULL) {
+		argv[argc++] = "-H";
+		argv[argc++] = tsdfx_digest;
+	}
+	if (tsdfx_cache != NULL) {
+		argv[argc++] = "-P";
+		argv[argc++] = tsdfx_cache;
+	}
+	if (tsdfx_qdepth > 0) {
+		snprintf(qdepth, sizeof qdepth, "%u", tsdfx_qdepth);
+		argv[argc++] = "-u";
+		argv[argc++] = qdepth;
+	}
+	if (tsdfx_blocksize != NULL) {
+		argv[argc++] = "-b";
+		argv[argc++] = tsdfx_blocksize;
+	}
+	if (tsdfx_statedir != NULL) {
+		argv[argc++] = "-s";
+		argv[argc++] = tsdfx_statedir;
+	}
+	qi = &tsdfx_queueinfo[ctd->queue];
+	for (i = 0; i < 2; ++i) {
+		if (qi->ratelimit_str[i][0] != '\0') {
+			argv[argc++] = "-L";
+			argv[argc++] = qi->ratelimit_str[i];
+		}
+	}
 	if (tsdfx_verbose)
 		argv[argc++] = "-v";
 	argv[argc++] = "-l";
@@ -349,12 +768,26 @@ tsdfx_copy_child(void *ud)
 	 */
 	argv[argc++] = "-l";
 	argv[argc++] = ":user=:stderr";
-	if (ctd->maxsize != NULL) {
+	if (ctd->length > 0) {
+		snprintf(range, sizeof range, "%jd:%jd",
+		    (intmax_t)ctd->offset, (intmax_t)ctd->length);
+		argv[argc++] = "-r";
+		argv[argc++] = range;
+	} else if (ctd->split) {
+		snprintf(range, sizeof range, "%jd", (intmax_t)tsdfx_rangesize);
+		argv[argc++] = "-R";
+		argv[argc++] = range;
+	} else if (ctd->maxsize != NULL) {
 		argv[argc++] = "-m";
 		argv[argc++] = ctd->maxsize;
 	}
-	argv[argc++] = ctd->src;
-	argv[argc++] = ctd->dst;
+	if (ctd->batch != NULL) {
+		argv[argc++] = "-B";
+		argv[argc++] = "-";
+	} else {
+		argv[argc++] = ctd->src;
+		argv[argc++] = ctd->dst;
+	}
 	argv[argc] = NULL;
 	ASSERTF((size_t)argc < sizeof argv / sizeof argv[0],
 	    "argv overflowed: %d > %z", argc, sizeof argv / sizeof argv[0]);
@@ -364,29 +797,176 @@ tsdfx_copy_child(void *ud)
 	_exit(1);
 }
 
+/*
+ * Read the results reported so far by a task's copier, one line per
+ * file: 0 or 1 for success or failure, followed in dry-run mode by what
+ * the copier found.  Returns 1 once the copier has closed its end of
+ * the pipe, 0 if it has not, and -1 on error.
+ */
+static int
+tsdfx_copy_result_poll(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	struct tsdfx_copy_plan plan;
+	char buf[512];
+	ssize_t i, rlen;
+	int n, status;
+
+	while ((rlen = read(t->pout, buf, sizeof buf)) > 0) {
+		for (i = 0; i < rlen; ++i) {
+			if (buf[i] != '\n') {
+				if (ctd->outlen < sizeof ctd->out - 1)
+					ctd->out[ctd->outlen++] = buf[i];
+				continue;
+			}
+			ctd->out[ctd->outlen] = '\0';
+			ctd->outlen = 0;
+			n = sscanf(ctd->out, "%d %ju %ju %ju", &status,
+			    &plan.len, &plan.size, &plan.usec);
+			if (n < 1) {
+				WARNING("invalid output from copier for %s",
+				    ctd->src);
+				continue;
+			}
+			tsdfx_copy_batch_result(t, status == 0,
+			    n == 4 ? &plan : NULL);
+		}
+	}
+	if (rlen < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return (0);
+		return (-1);
+	}
+	return (1);
+}
+
+/*
+ * Queue a task for a copier process, selecting the queue based on the
+ * current size of the source.
+ */
+static int
+tsdfx_copy_enqueue(struct tsd_task *t, off_t size)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	int i;
+
+	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
+		if ((size_t)size <= tsdfx_queueinfo[i].max_size) {
+			VERBOSE("Assigning %s to copier for files size <= %zu",
+			    ctd->src, tsdfx_queueinfo[i].max_size);
+			ctd->maxsize = tsdfx_queueinfo[i].max_size_str;
+			ctd->queue = i;
+			return (tsd_tqueue_insert(tsdfx_copy_queues[i], t));
+		}
+	}
+	return (0);
+}
+
+/*
+ * Check on a task which was handed to a worker thread.  Returns 1 if
+ * the thread is not done with it yet, and 0 otherwise.  If the thread
+ * left it for a copier process, it is queued for one.
+ */
+static int
+tsdfx_copy_thread_poll(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	struct stat st;
+
+	switch (tsdfx_worker_poll(ctd->job)) {
+	case WORKER_QUEUED:
+	case WORKER_RUNNING:
+		return (1);
+	case WORKER_DONE:
+		t->state = TASK_FINISHED;
+		break;
+	case WORKER_DEFERRED:
+		/* it may have grown past the small file queue's limit */
+		if (lstat(ctd->src, &st) != 0 ||
+		    tsdfx_copy_enqueue(t, st.st_size) != 0)
+			t->state = TASK_FAILED;
+		break;
+	default:
+		t->state = TASK_FAILED;
+		break;
+	}
+	tsdfx_worker_release(ctd->job);
+	ctd->job = NULL;
+	return (0);
+}
+
 /*
  * Poll the state of a child process.
  */
 static int
 tsdfx_copy_poll(struct tsd_task *t)
 {
+	struct tsdfx_copy_task_data *ctd = t->ud;
 
+	/* collect everything the copier has to say before it goes */
+	if (t->pout >= 0 && tsdfx_copy_result_poll(t) == 0)
+		return (0);
 	if (tsd_task_poll(t) != 0)
 		return (-1);
+	/* the copier exited successfully */
+	if (t->state == TASK_STOPPED)
+		t->state = TASK_FINISHED;
+	/* the copier failed, but perhaps not on the leader's own file */
+	if (ctd->batch != NULL && t->state == TASK_FAILED &&
+	    ctd->nresults > 0 && ctd->result)
+		t->state = TASK_FINISHED;
 	VERBOSE("%d jobs, %d running", t->set->ntasks, t->set->nrunning);
 	return (0);
 }
 
 /*
- * Given source and destination directories and a list of files to copy,
- * start copy tasks for each file.
+ * Look up the owner of a source file ourselves before starting a task
+ * for it with that owner's credentials, rather than take the scanner's
+ * word for it.
+ */
+static int
+tsdfx_copy_owner(const char *srcpath, struct stat *srcst)
+{
+	struct stat st;
+
+	if (tsd_stat(AT_FDCWD, srcpath, TSD_STAT_NOFOLLOW, TSD_STAT_TYPE |
+	    TSD_STAT_OWNER, &st) != 0) {
+		WARNING("%s: %s", srcpath, strerror(errno));
+		return (-1);
+	}
+	if ((st.st_mode & S_IFMT) != (srcst->st_mode & S_IFMT)) {
+		WARNING("%s: type changed since scan", srcpath);
+		errno = EAGAIN;
+		return (-1);
+	}
+	if (st.st_uid != srcst->st_uid || st.st_gid != srcst->st_gid) {
+		WARNING("%s: scanner reported owner %lu:%lu, not %lu:%lu",
+		    srcpath, (unsigned long)srcst->st_uid,
+		    (unsigned long)srcst->st_gid, (unsigned long)st.st_uid,
+		    (unsigned long)st.st_gid);
+		srcst->st_uid = st.st_uid;
+		srcst->st_gid = st.st_gid;
+	}
+	return (0);
+}
+
+/*
+ * Given source and destination directories and a file to copy, start a
+ * copy task for it unless the destination is already up to date.  If
+ * the scanner told us the source's metadata, we trust it instead of
+ * looking it up again, and only have to look at the destination, except
+ * for the owner, which we check before starting a task.
  */
 int
-tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
+tsdfx_copy_wrap(const char *map, const char *srcdir, const char *dstdir,
+    const char *path, const struct stat *st)
 {
 	char srcpath[PATH_MAX], dstpath[PATH_MAX];
+	struct tsdfx_copy_task_data *ctd;
 	struct stat srcst, dstst;
+	struct tsd_task *t;
 	mode_t mode;
+	int flags;
 
 	/* create full paths */
 	if (snprintf(srcpath, PATH_MAX, "%s%s", srcdir, path) >= PATH_MAX ||
@@ -400,8 +980,20 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 		return (0);
 	VERBOSE("%s -> %s", srcpath, dstpath);
 
+	/*
+	 * Only retrieve what we need below, and let the user decide
+	 * whether cached attributes will do.
+	 */
+	flags = TSD_STAT_NOFOLLOW;
+	if (tsdfx_scan_cached)
+		flags |= TSD_STAT_CACHED;
+
 	/* source must exist */
-	if (lstat(srcpath, &srcst) != 0) {
+	if (st != NULL) {
+		srcst = *st;
+	} else if (tsd_stat(AT_FDCWD, srcpath, flags, TSD_STAT_TYPE |
+	    TSD_STAT_MODE | TSD_STAT_OWNER | TSD_STAT_SIZE | TSD_STAT_ATIME |
+	    TSD_STAT_MTIME, &srcst) != 0) {
 		WARNING("%s: %s", srcpath, strerror(errno));
 		return (-1);
 	}
@@ -421,9 +1013,10 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 		mode |= 0110;
 	/* apply changes */
 	if (mode != srcst.st_mode) {
-		NOTICE("%s: changing permissions from %o to %o",
-		    srcpath, srcst.st_mode & 07777, mode & 07777);
-		if (chmod(srcpath, mode & 07777) != 0) {
+		NOTICE("%s: %s permissions from %o to %o", srcpath,
+		    tsdfx_dryrun ? "would change" : "changing",
+		    srcst.st_mode & 07777, mode & 07777);
+		if (!tsdfx_dryrun && chmod(srcpath, mode & 07777) != 0) {
 			ERROR("%s: %s", srcpath, strerror(errno));
 			return (-1);
 		}
@@ -431,7 +1024,8 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 	}
 
 	/* check destination */
-	if (lstat(dstpath, &dstst) == 0) {
+	if (tsd_stat(AT_FDCWD, dstpath, flags, TSD_STAT_TYPE | TSD_STAT_MODE |
+	    TSD_STAT_SIZE | TSD_STAT_MTIME, &dstst) == 0) {
 		if ((srcst.st_mode & S_IFMT) != (dstst.st_mode & S_IFMT)) {
 			ERROR("%s and %s both exist with different types",
 			    srcpath, dstpath);
@@ -455,8 +1049,11 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 				/*
 				 * Request removal.
 				 */
-				NOTICE("purging source file %s", srcpath);
-				tsdfx_copy_new(srcpath, NULL);
+				NOTICE("%s source file %s", tsdfx_dryrun ?
+				    "would purge" : "purging", srcpath);
+				if (!tsdfx_dryrun && (st == NULL ||
+				    tsdfx_copy_owner(srcpath, &srcst) == 0))
+					tsdfx_copy_new(srcpath, NULL, &srcst);
 			}
 			return (0);
 		}
@@ -467,8 +1064,11 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 			 */
 			if (tsdfx_copy_purgeperiod &&
 			    srcst.st_atime + tsdfx_copy_purgeperiod <= time(0)) {
-				NOTICE("purging source directory %s", srcpath);
-				tsdfx_copy_new(srcpath, NULL);
+				NOTICE("%s source directory %s", tsdfx_dryrun ?
+				    "would purge" : "purging", srcpath);
+				if (!tsdfx_dryrun && (st == NULL ||
+				    tsdfx_copy_owner(srcpath, &srcst) == 0))
+					tsdfx_copy_new(srcpath, NULL, &srcst);
 			}
 			return (0);
 		}
@@ -477,7 +1077,14 @@ tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
 	}
 
 	/* create task */
-	tsdfx_copy_new(srcpath, dstpath);
+	if (st != NULL && tsdfx_copy_owner(srcpath, &srcst) != 0)
+		return (-1);
+	t = tsdfx_copy_new(srcpath, dstpath, &srcst);
+	if (t != NULL && tsdfx_dryrun) {
+		ctd = t->ud;
+		strlcpy(ctd->map, map, sizeof ctd->map);
+		tsdfx_map_plan_start(map);
+	}
 	return (0);
 }
 
@@ -489,7 +1096,10 @@ tsdfx_copy_sched(void)
 {
 	struct tsdfx_copy_task_data *ctd;
 	struct tsd_task *t, *tn;
+	int waiting;
 
+	waiting = 0;
+	tsdfx_copy_batch(tsdfx_copy_queues[TSDFX_COPY_BATCH_QUEUE]);
 	t = tsd_tset_first(tsdfx_copy_tasks);
 	while (t != NULL) {
 		/* look ahead so we can safely delete dead tasks */
@@ -497,6 +1107,35 @@ tsdfx_copy_sched(void)
 		ctd = t->ud;
 		switch (t->state) {
 		case TASK_IDLE: {
+			if (ctd->leader[0] != '\0') {
+				/* being copied as part of a batch */
+				++waiting;
+				break;
+			}
+			if (ctd->job != NULL) {
+				/* being copied by a worker thread */
+				if (tsdfx_copy_thread_poll(t) != 0) {
+					++waiting;
+					break;
+				}
+				if (t->queue == NULL)
+					break;
+			}
+			if (ctd->split && t->queue == NULL) {
+				/* wait for the ranges, then complete */
+				if (ctd->pending > 0) {
+					++waiting;
+					break;
+				}
+				if (ctd->failed || tsd_tqueue_insert(
+				    tsdfx_copy_queues[TSDFX_COPY_NQUEUES - 1],
+				    t) != 0) {
+					WARNING("copy task failed for %s",
+					    ctd->src);
+					tsdfx_copy_delete(t);
+					break;
+				}
+			}
 			VERBOSE("%s -> %s (%d jobs, %d running)",
 				ctd->src, ctd->dst,
 				t->queue->ntasks, t->queue->nrunning);
@@ -528,7 +1167,51 @@ tsdfx_copy_sched(void)
 		}
 		t = tn;
 	}
-	return (tsdfx_copy_tasks->nrunning);
+	return (tsdfx_copy_tasks->nrunning + waiting);
+}
+
+/*
+ * Set a byte rate limit, either for all copy tasks or, if prefixed with
+ * the name of a queue and an equal sign, for that queue.
+ */
+int
+tsdfx_copy_ratelimit(const char *spec)
+{
+	struct tsd_ratelimit *rl;
+	size_t len;
+	int i;
+
+	rl = &tsdfx_copy_ratelimit_all;
+	len = strcspn(spec, "=");
+	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
+		if (spec[len] == '=' && strlen(tsdfx_queueinfo[i].name) == len &&
+		    strncmp(spec, tsdfx_queueinfo[i].name, len) == 0) {
+			rl = &tsdfx_queueinfo[i].ratelimit;
+			spec += len + 1;
+			break;
+		}
+	}
+	return (tsd_ratelimit_parse(rl, spec));
+}
+
+/*
+ * Divide a rate limit between n tasks and format the result for the
+ * copier, or leave the string empty if there is no limit.
+ */
+static void
+tsdfx_copy_ratelimit_share(const struct tsd_ratelimit *rl, unsigned int n,
+    char *buf, size_t size, struct tsd_ratelimit *share)
+{
+
+	*share = *rl;
+	buf[0] = '\0';
+	if (rl->rate == 0 && rl->nwin == 0)
+		return;
+	tsd_ratelimit_scale(share, n);
+	if (tsd_ratelimit_format(share, buf, size) != 0) {
+		WARNING("failed to format rate limit");
+		buf[0] = '\0';
+	}
 }
 
 /*
@@ -537,7 +1220,10 @@ tsdfx_copy_sched(void)
 int
 tsdfx_copy_init(void)
 {
+	struct tsd_ratelimit limits[2], wlimits[2];
+	struct tsdfx_copy_queueinfo *qi;
 	char str[64];
+	unsigned int n;
 	int i;
 
 	if (tsdfx_copier == NULL &&
@@ -571,6 +1257,37 @@ tsdfx_copy_init(void)
 			return (-1);
 		}
 	}
+	/*
+	 * Share the rate limits out.  The worker threads, if any, count as
+	 * one more task in the small file queue.
+	 */
+	for (i = 0, n = 0; i < TSDFX_COPY_NQUEUES; ++i)
+		n += tsdfx_queueinfo[i].max_tasks;
+	if (tsdfx_nthreads > 0)
+		n++;
+	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
+		qi = &tsdfx_queueinfo[i];
+		tsdfx_copy_ratelimit_share(&tsdfx_copy_ratelimit_all, n,
+		    qi->ratelimit_str[0], sizeof qi->ratelimit_str[0],
+		    &limits[0]);
+		tsdfx_copy_ratelimit_share(&qi->ratelimit, qi->max_tasks +
+		    (i == TSDFX_COPY_BATCH_QUEUE && tsdfx_nthreads > 0),
+		    qi->ratelimit_str[1], sizeof qi->ratelimit_str[1],
+		    &limits[1]);
+		if (qi->ratelimit_str[0][0] != '\0' ||
+		    qi->ratelimit_str[1][0] != '\0')
+			VERBOSE("rate limit for each %s file copier: %s %s",
+			    qi->name, qi->ratelimit_str[0], qi->ratelimit_str[1]);
+		if (i == TSDFX_COPY_BATCH_QUEUE)
+			memcpy(wlimits, limits, sizeof wlimits);
+	}
+
+	/* start worker threads for small files if requested */
+	if (tsdfx_nthreads > 0 &&
+	    tsdfx_worker_init(tsdfx_nthreads, wlimits, 2) != 0) {
+		WARNING("failed to start worker threads: %s", strerror(errno));
+		tsdfx_nthreads = 0;
+	}
 	return (0);
 }
 
@@ -580,6 +1297,8 @@ tsdfx_copy_exit(void)
 	struct tsd_task *t;
 	int i;
 
+	/* let the worker threads finish what they are doing */
+	tsdfx_worker_exit();
 	/* destroy queues, which also stops all tasks */
 	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
 		if (tsdfx_copy_queues[i] != NULL) {
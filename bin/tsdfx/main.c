@@ -31,9 +31,13 @@
 # include "config.h"
 #endif
 
+#include <sys/types.h>
+
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,9 +47,11 @@
 #include <bsd/unistd.h>
 #endif
 
+#include "tsd/digest.h"
 #include "tsd/pidfile.h"
 
 #include "tsdfx.h"
+#include "tsdfx_copy.h"
 
 #ifndef PIDFILENAME
 #define PIDFILENAME "/var/run/tsdfx.pid"
@@ -55,12 +61,98 @@
 extern char **environ;
 #endif
 
+/*
+ * Check that a page cache policy is one the copier will accept.
+ */
+static int
+valid_cache_policy(const char *str)
+{
+	static const char *words[] = {
+		"none", "sequential", "dontneed", "readahead", NULL
+	};
+	const char **w;
+	size_t len;
+
+	for (;; str += len + 1) {
+		len = strcspn(str, ",");
+		for (w = words; *w != NULL; ++w)
+			if (strlen(*w) == len && strncmp(*w, str, len) == 0)
+				break;
+		if (*w == NULL)
+			return (0);
+		if (str[len] == '\0')
+			return (1);
+	}
+}
+
+/*
+ * Check that a block size looks like something the copier will accept:
+ * a number of bytes, optionally suffixed with k or m.  The copier
+ * performs the range check.
+ */
+static int
+valid_block_size(const char *str)
+{
+	char *end;
+
+	if (strtoul(str, &end, 10) == 0 || end == str)
+		return (0);
+	if (*end == 'k' || *end == 'K' || *end == 'm' || *end == 'M')
+		++end;
+	return (*end == '\0');
+}
+
+/*
+ * Parse a range size: a number of bytes, optionally suffixed with k, m,
+ * g or t, which must be a multiple of 4 kB.  Returns 0 if invalid.
+ */
+static off_t
+range_size(const char *str)
+{
+	uintmax_t size;
+	char *end;
+	int shift;
+
+	size = strtoumax(str, &end, 10);
+	if (end == str)
+		return (0);
+	shift = 0;
+	switch (*end) {
+	case 't':
+	case 'T':
+		shift += 10;
+		/* fall through */
+	case 'g':
+	case 'G':
+		shift += 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		shift += 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		shift += 10;
+		++end;
+		break;
+	}
+	if (*end != '\0' || size > (uintmax_t)INT64_MAX >> shift)
+		return (0);
+	size <<= shift;
+	if (size % 4096 != 0)
+		return (0);
+	return ((off_t)size);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx [-1nv] "
-	    "[-l logname] [-C copier] [-M maxfiles] [-p pidfile] [-S scanner] -m mapfile\n");
+	fprintf(stderr, "usage: tsdfx [-1AcDknv] [-b blocksize] "
+	    "[-l logname] [-C copier] [-H digest]\n"
+	    "    [-L ratelimit] [-M maxfiles] [-p pidfile] [-P policy] "
+	    "[-r rangesize]\n    [-s statedir] [-S scanner] [-T nthreads] "
+	    "[-t nthreads] [-U qdepth] [-u qdepth]\n    -m mapfile\n");
 	exit(1);
 }
 
@@ -92,27 +184,59 @@ main(int argc, char *argv[])
 	pidfilename = PIDFILENAME;
 	pidfh = NULL;
 	nodaemon = 0;
-	while ((opt = getopt(argc, argv, "1C:d:fhi:l:m:M:np:S:vV")) != -1)
+	while ((opt = getopt(argc, argv, "1Ab:cC:d:DfH:hi:kL:l:m:M:np:P:r:s:S:T:t:U:u:vV")) != -1)
 		switch (opt) {
 		case '1':
 			++tsdfx_oneshot;
 			++nodaemon;
 			break;
+		case 'A':
+			++tsdfx_scan_cached;
+			break;
+		case 'b':
+			if (!valid_block_size(optarg)) {
+				fprintf(stderr, "unable to parse block size");
+				usage();
+			}
+			tsdfx_blocksize = optarg;
+			break;
+		case 'c':
+			++tsdfx_check;
+			break;
 		case 'C':
 			tsdfx_copier = optarg;
 			break;
 		case 'd':
 			tsdfx_copy_purgeperiod = atoi(optarg);
 			break;
+		case 'D':
+			++tsdfx_direct;
+			break;
 		case 'f':
 			++nodaemon;
 			break;
+		case 'H':
+			if (tsd_digest_lookup(optarg) == NULL) {
+				fprintf(stderr, "unknown digest algorithm");
+				usage();
+			}
+			tsdfx_digest = optarg;
+			break;
 		case 'i':
 			tsdfx_scan_interval = atoi(optarg);
 			break;
 		case 'I':
 			tsdfx_reset_interval = atoi(optarg);
 			break;
+		case 'k':
+			++tsdfx_kcopy;
+			break;
+		case 'L':
+			if (tsdfx_copy_ratelimit(optarg) != 0) {
+				fprintf(stderr, "unable to parse rate limit");
+				usage();
+			}
+			break;
 		case 'l':
 			logfile = optarg;
 			break;
@@ -132,9 +256,60 @@ main(int argc, char *argv[])
 		case 'p':
 			pidfilename = optarg;
 			break;
+		case 'P':
+			if (!valid_cache_policy(optarg)) {
+				fprintf(stderr, "unknown cache policy");
+				usage();
+			}
+			tsdfx_cache = optarg;
+			break;
+		case 'r':
+			if ((tsdfx_rangesize = range_size(optarg)) == 0) {
+				fprintf(stderr, "unable to parse range size");
+				usage();
+			}
+			break;
+		case 's':
+			/* must be absolute, since we chdir() below */
+			if (*optarg != '/') {
+				fprintf(stderr, "state directory must be absolute");
+				usage();
+			}
+			tsdfx_statedir = optarg;
+			break;
 		case 'S':
 			tsdfx_scanner = optarg;
 			break;
+		case 'T':
+			tsdfx_scan_nthreads = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' ||
+			    tsdfx_scan_nthreads > 64) {
+				fprintf(stderr, "unable to parse thread count");
+				usage();
+			}
+			break;
+		case 't':
+			tsdfx_nthreads = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || tsdfx_nthreads > 64) {
+				fprintf(stderr, "unable to parse thread count");
+				usage();
+			}
+			break;
+		case 'U':
+			tsdfx_scan_qdepth = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' ||
+			    tsdfx_scan_qdepth > 64) {
+				fprintf(stderr, "unable to parse queue depth");
+				usage();
+			}
+			break;
+		case 'u':
+			tsdfx_qdepth = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || tsdfx_qdepth > 64) {
+				fprintf(stderr, "unable to parse queue depth");
+				usage();
+			}
+			break;
 		case 'v':
 			++tsdfx_verbose;
 			break;
@@ -35,6 +35,7 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +61,11 @@ struct tsdfx_map {
 	char dstpath[PATH_MAX];
 	struct tsd_task *task;
 	struct tsdfx_recentlog *errlog;
+
+	/* dry-run totals since the last report */
+	unsigned int pending;
+	unsigned long nfiles, nfailed;
+	struct tsdfx_copy_plan plan;
 };
 
 static struct tsdfx_map **tsdfx_map;
@@ -133,6 +139,30 @@ map_new(const char *fn, int n, const char *name, const char *src, const char *ds
 	return (m);
 }
 
+/*
+ * Log what a dry run found for a map and clear the totals.  The time
+ * estimate assumes a single copier reading at the average rate measured
+ * while comparing, so it is an upper bound when several run at once.
+ */
+static void
+map_plan_report(struct tsdfx_map *m)
+{
+	uintmax_t rate;
+
+	if (m->nfiles == 0 && m->nfailed == 0)
+		return;
+	rate = 0;
+	if (m->plan.usec > 0)
+		rate = (uintmax_t)((double)m->plan.size * 1000000 /
+		    m->plan.usec);
+	NOTICE("%s: dry run checked %lu files, %lu failed, would copy %ju "
+	    "of %ju bytes, read at %ju bytes/s, estimated %.1f s",
+	    m->name, m->nfiles, m->nfailed, m->plan.len, m->plan.size, rate,
+	    rate > 0 ? (double)m->plan.len / rate : 0.0);
+	m->nfiles = m->nfailed = 0;
+	memset(&m->plan, 0, sizeof m->plan);
+}
+
 /*
  * Delete a struct tsdfx_map
  */
@@ -141,6 +171,7 @@ map_delete(struct tsdfx_map *m)
 {
 
 	if (m != NULL) {
+		map_plan_report(m);
 		tsdfx_scan_delete(m->task);
 		tsdfx_recentlog_destroy(m->errlog);
 		m->errlog = NULL;
@@ -148,6 +179,20 @@ map_delete(struct tsdfx_map *m)
 	}
 }
 
+/*
+ * Find a map by name
+ */
+static struct tsdfx_map *
+map_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < tsdfx_map_len; ++i)
+		if (strcmp(tsdfx_map[i]->name, name) == 0)
+			return (tsdfx_map[i]);
+	return (NULL);
+}
+
 /*
  * Compare two maps
  */
@@ -339,27 +384,70 @@ fail:
 }
 
 /*
- * Process a file reported by the scanner.
+ * Process a file reported by the scanner, along with its metadata if the
+ * scanner provided it.
  */
 int
-tsdfx_map_process(struct tsdfx_map *map, const char *path)
+tsdfx_map_process(struct tsdfx_map *map, const char *path,
+    const struct stat *st)
 {
 
-	return (tsdfx_copy_wrap(map->srcpath, map->dstpath, path));
+	return (tsdfx_copy_wrap(map->name, map->srcpath, map->dstpath, path,
+	    st));
+}
+
+/*
+ * A dry-run copy task has been created for a file in the named map.
+ */
+void
+tsdfx_map_plan_start(const char *name)
+{
+	struct tsdfx_map *m;
+
+	if ((m = map_find(name)) != NULL)
+		m->pending++;
+}
+
+/*
+ * A dry-run copy task for a file in the named map is done.  The plan is
+ * NULL if it failed.
+ */
+void
+tsdfx_map_plan_done(const char *name, const struct tsdfx_copy_plan *plan)
+{
+	struct tsdfx_map *m;
+
+	if ((m = map_find(name)) == NULL)
+		return;
+	if (m->pending > 0)
+		m->pending--;
+	if (plan == NULL) {
+		m->nfailed++;
+		return;
+	}
+	m->nfiles++;
+	m->plan.len += plan->len;
+	m->plan.size += plan->size;
+	m->plan.usec += plan->usec;
 }
 
 /*
  * Check all our map entries to see if a scan task recently completed.  If
  * so, set up and kick off compare / copy tasks.  Reschedule the completed
- * scan tasks.
+ * scan tasks.  In dry-run mode, report on each map once its scan and all
+ * the copy tasks it gave rise to are done.
  */
 int
 tsdfx_map_sched(void)
 {
+	struct tsdfx_map *m;
 	int i;
 
 	for (i = 0; i < tsdfx_map_len; ++i) {
-		/* nothing to do */
+		m = tsdfx_map[i];
+		if (m->pending == 0 && m->task != NULL &&
+		    m->task->state != TASK_RUNNING)
+			map_plan_report(m);
 	}
 	return (tsdfx_map_len);
 }
@@ -381,6 +469,9 @@ tsdfx_map_exit(void)
 		tsdfx_map[i] = NULL;
 	}
 	free(tsdfx_map);
+	tsdfx_map = NULL;
+	tsdfx_map_sz = 0;
+	tsdfx_map_len = 0;
 	tsdfx_recentlog_exit();
 	return (0);
 }
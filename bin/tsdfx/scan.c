@@ -113,6 +113,15 @@ const char *tsdfx_scanner;
 /* maximum files to scan, or 0 to use the default in the scanner */
 unsigned long tsdfx_maxfiles = 0;
 
+/* threads for each scanner, or 0 to use the default in the scanner */
+unsigned int tsdfx_scan_nthreads = 0;
+
+/* io_uring queue depth for each scanner, or 0 to not use io_uring */
+unsigned int tsdfx_scan_qdepth = 0;
+
+/* trust cached attributes while scanning */
+int tsdfx_scan_cached = 0;
+
 static void tsdfx_scan_name(char *, const char *);
 static int tsdfx_scan_slurp(struct tsd_task *);
 static void tsdfx_scan_child(void *);
@@ -129,12 +138,20 @@ static int tsdfx_scan_stop(struct tsd_task *);
  * from the POSIX Portable Filename Character Set, the first of which is
  * not a period.  If the path is a directory, it ends with a slash.
  *
+ * The path may be preceded by metadata; see tsdfx-scanner(8) and
+ * tsdfx_scan_metadata() below.
+ *
  * XXX allow spaces as well for now
  */
 #define SCAN_REGEX \
-	"^(/[0-9A-Za-z_-]([ 0-9A-Za-z._-]*[0-9A-Za-z._-])?)+/?$"
+	"^([0-7]+ [0-9]+ [0-9]+ [0-9]+ [0-9]+ " \
+	"-?[0-9]+\\.[0-9]{9} -?[0-9]+\\.[0-9]{9} )?" \
+	"(/[0-9A-Za-z_-]([ 0-9A-Za-z._-]*[0-9A-Za-z._-])?)+/?$"
 static regex_t scan_regex;
 
+/* upper limit on the length of the metadata preceding a path */
+#define SCAN_METADATA_MAX	192
+
 /*
  * Generate a unique name for a scan task.
  */
@@ -312,8 +329,9 @@ static void
 tsdfx_scan_child(void *ud)
 {
 	struct tsdfx_scan_task_data *std = ud;
-	const char *argv[10];
+	const char *argv[20];
 	char maxfiles_str[sizeof(long) * 4];/* ~log10(tsdfx_maxfiles) */
+	char nthreads_str[16], qdepth_str[16];
 	int argc;
 
 	/* check credentials */
@@ -331,14 +349,29 @@ tsdfx_scan_child(void *ud)
 	/* run the scan task */
 	argc = 0;
 	argv[argc++] = tsdfx_scanner;
+	argv[argc++] = "-m";
 	if (tsdfx_verbose)
 		argv[argc++] = "-v";
+	if (tsdfx_scan_cached)
+		argv[argc++] = "-A";
 	if (tsdfx_maxfiles > 0) {
 		argv[argc++] = "-M";
 		snprintf(maxfiles_str, sizeof maxfiles_str,
 		    "%ld", tsdfx_maxfiles);
 		argv[argc++] = maxfiles_str;
 	}
+	if (tsdfx_scan_nthreads > 0) {
+		argv[argc++] = "-t";
+		snprintf(nthreads_str, sizeof nthreads_str,
+		    "%u", tsdfx_scan_nthreads);
+		argv[argc++] = nthreads_str;
+	}
+	if (tsdfx_scan_qdepth > 0) {
+		argv[argc++] = "-u";
+		snprintf(qdepth_str, sizeof qdepth_str,
+		    "%u", tsdfx_scan_qdepth);
+		argv[argc++] = qdepth_str;
+	}
 	argv[argc++] = "-l";
 	argv[argc++] = tsd_log_getname();
 	/*
@@ -493,6 +526,52 @@ tsdfx_scan_rush(struct tsd_task *t)
 	}
 }
 
+/*
+ * Parse the metadata preceding a path in a line of output which has
+ * already been validated by scan_regex, and check that it agrees with
+ * the path: only regular files and directories are reported, and only
+ * directories end with a slash.  Returns a pointer to the path, or NULL
+ * if the metadata makes no sense.
+ */
+static const char *
+tsdfx_scan_metadata(const char *line, struct stat *st)
+{
+	uintmax_t ino;
+	intmax_t size, asec, msec;
+	unsigned long uid, gid;
+	unsigned int mode;
+	long ansec, mnsec;
+	const char *path;
+	size_t len;
+	int n;
+
+	n = 0;
+	if (sscanf(line, "%o %lu %lu %ju %jd %jd.%ld %jd.%ld %n",
+	    &mode, &uid, &gid, &ino, &size, &asec, &ansec, &msec, &mnsec,
+	    &n) != 9 || n == 0)
+		return (NULL);
+	memset(st, 0, sizeof *st);
+	st->st_mode = mode;
+	st->st_uid = uid;
+	st->st_gid = gid;
+	st->st_ino = ino;
+	st->st_size = size;
+	st->st_atim.tv_sec = asec;
+	st->st_atim.tv_nsec = ansec;
+	st->st_mtim.tv_sec = msec;
+	st->st_mtim.tv_nsec = mnsec;
+	if (st->st_mode != mode || st->st_uid != uid || st->st_gid != gid ||
+	    st->st_ino != ino || st->st_size != size ||
+	    st->st_atim.tv_sec != asec || st->st_mtim.tv_sec != msec)
+		return (NULL);
+	path = line + n;
+	len = strlen(path);
+	if (S_ISDIR(st->st_mode) ? path[len - 1] != '/' :
+	    !S_ISREG(st->st_mode) || path[len - 1] == '/')
+		return (NULL);
+	return (path);
+}
+
 /*
  * Read available data from a single task, validate it and start copiers.
  * Returns < 0 on error, > 0 if any data was read and / or is pending, and
@@ -505,6 +584,8 @@ tsdfx_scan_slurp(struct tsd_task *t)
 	size_t bufsz, len;
 	ssize_t rlen;
 	char *buf, *end, *p, *q;
+	const char *path;
+	struct stat st;
 
 	/* read as much as we can in the space we have left */
 	len = 0;
@@ -539,20 +620,28 @@ tsdfx_scan_slurp(struct tsd_task *t)
 			    (long)t->pid, std->path);
 			continue;
 		}
+		if (*p == '/') {
+			path = p;
+		} else if ((path = tsdfx_scan_metadata(p, &st)) == NULL) {
+			WARNING("invalid metadata from child %ld for %s",
+			    (long)t->pid, std->path);
+			continue;
+		}
 		VERBOSE("[%s]", p);
 		std->processed++;
-		tsdfx_map_process(std->map, p);
+		tsdfx_map_process(std->map, path, path == p ? NULL : &st);
 	}
 
 	/*
 	 * After the above loop, p points to the first character of the
 	 * first incomplete line, or the beginning of the buffer if it is
 	 * empty or does not contain at least one line.  If the amount of
-	 * data remaining exceeds the maximum length of a path name (not
-	 * including the newline, which is still missing), something is
-	 * wrong.  Otherwise, move what's left to the start of the buffer.
+	 * data remaining exceeds the maximum length of a path name and
+	 * its metadata (not including the newline, which is still
+	 * missing), something is wrong.  Otherwise, move what's left to
+	 * the start of the buffer.
 	 */
-	if ((len = end - p) > PATH_MAX) {
+	if ((len = end - p) > PATH_MAX + SCAN_METADATA_MAX) {
 		errno = ENAMETOOLONG;
 		return (-1);
 	}
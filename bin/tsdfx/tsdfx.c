@@ -32,6 +32,7 @@
 #endif
 
 #include <signal.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <tsd/log.h>
@@ -111,9 +112,10 @@ tsdfx_init(const char *mapfile)
 int
 tsdfx_exit(void)
 {
+	/* copy tasks report to their maps as they go away */
+	tsdfx_copy_exit();
 	tsdfx_map_exit();
 	tsdfx_scan_exit();
-	tsdfx_copy_exit();
 	NOTICE("tsdfx stopping");
 	return (0);
 }
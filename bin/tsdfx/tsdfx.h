@@ -40,6 +40,16 @@ int tsdfx_run(const char *);
 int tsdfx_exit(void);
 
 extern int tsdfx_dryrun;
+extern int tsdfx_check;
+extern int tsdfx_direct;
+extern int tsdfx_kcopy;
+extern unsigned int tsdfx_qdepth;
+extern unsigned int tsdfx_nthreads;
+extern const char *tsdfx_digest;
+extern const char *tsdfx_cache;
+extern const char *tsdfx_blocksize;
+extern const char *tsdfx_statedir;
+extern off_t tsdfx_rangesize;
 extern int tsdfx_oneshot;
 
 extern const char *tsdfx_scanner;
@@ -51,5 +61,8 @@ extern unsigned int tsdfx_reset_interval;
 extern time_t tsdfx_copy_purgeperiod;
 
 extern unsigned long tsdfx_maxfiles;
+extern unsigned int tsdfx_scan_nthreads;
+extern unsigned int tsdfx_scan_qdepth;
+extern int tsdfx_scan_cached;
 
 #endif
@@ -30,14 +30,27 @@
 #ifndef TSDFX_COPY_H_INCLUDED
 #define TSDFX_COPY_H_INCLUDED
 
+#define TSDFX_COPY_UMASK 007
+
+struct stat;
 struct tsd_task;
 
-struct tsd_task *tsdfx_copy_new(const char *, const char *);
+/* what a dry run found for a file; see tsdfx-copier(8) */
+struct tsdfx_copy_plan {
+	uintmax_t	 len;		/* bytes which would be copied */
+	uintmax_t	 size;		/* bytes compared */
+	uintmax_t	 usec;		/* time spent reading the source */
+};
+
+struct tsd_task *tsdfx_copy_new(const char *, const char *,
+    const struct stat *);
 
+int tsdfx_copy_ratelimit(const char *);
 int tsdfx_copy_sched(void);
 int tsdfx_copy_init(void);
 int tsdfx_copy_exit(void);
 
-int tsdfx_copy_wrap(const char *, const char *, const char *);
+int tsdfx_copy_wrap(const char *, const char *, const char *, const char *,
+    const struct stat *);
 
 #endif
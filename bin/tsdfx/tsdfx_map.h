@@ -30,10 +30,14 @@
 #ifndef TSDFX_MAP_H_INCLUDED
 #define TSDFX_MAP_H_INCLUDED
 
+struct stat;
 struct tsdfx_map;
+struct tsdfx_copy_plan;
 
 int tsdfx_map_reload(const char *);
-int tsdfx_map_process(struct tsdfx_map *, const char *);
+int tsdfx_map_process(struct tsdfx_map *, const char *, const struct stat *);
+void tsdfx_map_plan_start(const char *);
+void tsdfx_map_plan_done(const char *, const struct tsdfx_copy_plan *);
 int tsdfx_map_sched(void);
 int tsdfx_map_init(void);
 int tsdfx_map_exit(void);
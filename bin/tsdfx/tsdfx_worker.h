@@ -0,0 +1,58 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSDFX_WORKER_H_INCLUDED
+#define TSDFX_WORKER_H_INCLUDED
+
+/*
+ * Largest file the worker threads will copy; anything larger is left to
+ * a copier process.
+ */
+#define TSDFX_WORKER_MAX_SIZE (64 * 1024)
+
+enum tsdfx_worker_state {
+	WORKER_QUEUED,		/* waiting for a thread */
+	WORKER_RUNNING,		/* being copied */
+	WORKER_DONE,		/* copied successfully */
+	WORKER_FAILED,		/* something went wrong */
+	WORKER_DEFERRED,	/* left for a copier process */
+};
+
+struct tsd_ratelimit;
+struct tsdfx_worker_job;
+
+struct tsdfx_worker_job *tsdfx_worker_submit(const char *, const char *,
+    uid_t, const gid_t *, int);
+enum tsdfx_worker_state tsdfx_worker_poll(struct tsdfx_worker_job *);
+void tsdfx_worker_release(struct tsdfx_worker_job *);
+int tsdfx_worker_init(unsigned int, const struct tsd_ratelimit *,
+    unsigned int);
+void tsdfx_worker_exit(void);
+
+#endif
@@ -0,0 +1,618 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#if HAVE_SYS_FSUID_H
+#include <sys/fsuid.h>
+#endif
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#undef HAVE_PTHREAD_CREATE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tsd/digest.h>
+#include <tsd/log.h>
+#include <tsd/ratelimit.h>
+#include <tsd/strutil.h>
+
+#include "tsdfx.h"
+#include "tsdfx_copy.h"
+#include "tsdfx_worker.h"
+
+/*
+ * The setgroups() wrapper in the C library applies the change to every
+ * thread in the process, so we need to make the system call ourselves.
+ */
+#if defined(SYS_setgroups32)
+#define TSDFX_SYS_SETGROUPS SYS_setgroups32
+#elif defined(SYS_setgroups)
+#define TSDFX_SYS_SETGROUPS SYS_setgroups
+#endif
+
+#if HAVE_PTHREAD_CREATE && HAVE_SETFSUID && HAVE_SETFSGID && \
+    defined(TSDFX_SYS_SETGROUPS)
+#define TSDFX_WORKER 1
+#endif
+
+/*
+ * Files modified more recently than this may still be growing; leave
+ * them to the copier, which knows how to wait for them.
+ */
+#define TSDFX_WORKER_MIN_AGE 6
+
+#if TSDFX_WORKER
+
+struct tsdfx_worker_job {
+	/* what to copy */
+	char			 src[PATH_MAX];
+	char			 dst[PATH_MAX];
+
+	/* whose credentials to use */
+	uid_t			 uid;
+	gid_t			 gids[32];
+	int			 ngids;
+
+	/* progress */
+	enum tsdfx_worker_state	 state;
+	int			 released;
+	struct tsdfx_worker_job	*next;
+};
+
+static pthread_mutex_t tsdfx_worker_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tsdfx_worker_cv = PTHREAD_COND_INITIALIZER;
+static struct tsdfx_worker_job *tsdfx_worker_first;
+static struct tsdfx_worker_job **tsdfx_worker_last = &tsdfx_worker_first;
+static int tsdfx_worker_stop;
+
+static pthread_t *tsdfx_worker_threads;
+static unsigned int tsdfx_worker_nthreads;
+
+/* byte rate limits shared by all the threads */
+#define TSDFX_WORKER_MAX_RATELIMITS 2
+static pthread_mutex_t tsdfx_worker_ratelimit_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct tsd_ratelimit tsdfx_worker_ratelimit[TSDFX_WORKER_MAX_RATELIMITS];
+static unsigned int tsdfx_worker_nratelimits;
+
+/* our own credentials, to return to after each job */
+static uid_t tsdfx_worker_uid;
+static gid_t tsdfx_worker_gid;
+static gid_t *tsdfx_worker_gids;
+static int tsdfx_worker_ngids;
+
+/*
+ * Switch the calling thread's file system credentials and groups.  Changing the
+ * file system uid from 0 to anything else also drops the capabilities
+ * which would allow the thread to bypass file permissions, and
+ * changing it back restores them.  Only the calling thread is affected.
+ */
+static int
+tsdfx_worker_setcred(uid_t uid, gid_t gid, const gid_t *gids, int ngids)
+{
+
+	if (syscall(TSDFX_SYS_SETGROUPS, ngids, gids) != 0)
+		return (-1);
+	setfsgid(gid);
+	setfsuid(uid);
+	/* setfsuid() and setfsgid() return the previous value */
+	if ((uid_t)setfsuid(uid) != uid || (gid_t)setfsgid(gid) != gid) {
+		errno = EPERM;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Account for data read from a source under each rate limit, and wait
+ * until all of them allow us to continue.  The threads wait their turn,
+ * since they share the limits.
+ */
+static void
+tsdfx_worker_throttle(size_t len)
+{
+	unsigned int i;
+
+	if (tsdfx_worker_nratelimits == 0)
+		return;
+	pthread_mutex_lock(&tsdfx_worker_ratelimit_mtx);
+	for (i = 0; i < tsdfx_worker_nratelimits; ++i)
+		tsd_ratelimit_consume(&tsdfx_worker_ratelimit[i], len);
+	pthread_mutex_unlock(&tsdfx_worker_ratelimit_mtx);
+}
+
+/*
+ * Read up to len bytes starting at the given offset.
+ */
+static ssize_t
+tsdfx_worker_pread(int fd, char *buf, size_t len, off_t off)
+{
+	ssize_t rlen;
+	size_t total;
+
+	for (total = 0; total < len; total += rlen) {
+		rlen = pread(fd, buf + total, len - total, off + total);
+		if (rlen < 0 && errno == EINTR) {
+			rlen = 0;
+			continue;
+		}
+		if (rlen < 0)
+			return (-1);
+		if (rlen == 0)
+			break;
+	}
+	return (total);
+}
+
+/*
+ * Write len bytes starting at the given offset.
+ */
+static int
+tsdfx_worker_pwrite(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t wlen;
+	size_t total;
+
+	for (total = 0; total < len; total += wlen) {
+		wlen = pwrite(fd, buf + total, len - total, off + total);
+		if (wlen < 0 && errno == EINTR) {
+			wlen = 0;
+			continue;
+		}
+		if (wlen < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Copy a small file the same way tsdfx-copier would, with the
+ * credentials of its owner.  Anything out of the ordinary is left for
+ * the copier to deal with.
+ */
+static enum tsdfx_worker_state
+tsdfx_worker_copy(const struct tsdfx_worker_job *job)
+{
+	const struct tsd_digest_alg *alg;
+	uint8_t digest[TSD_DIGEST_MAX_LEN], rdigest[TSD_DIGEST_MAX_LEN];
+	char hex[TSD_DIGEST_MAX_LEN * 2 + 1];
+	struct timeval tvo, tvf, tve;
+	struct timespec times[2];
+	struct stat sst, dst;
+	tsd_digest_ctx ctx;
+	char *sbuf, *dbuf;
+	ssize_t slen, dlen;
+	size_t i, len;
+	mode_t mode;
+	int sfd, dfd, serrno;
+
+	VERBOSE("%s to %s", job->src, job->dst);
+	gettimeofday(&tvo, NULL);
+	sbuf = dbuf = NULL;
+	sfd = dfd = -1;
+	alg = tsd_digest_lookup(tsdfx_digest != NULL ? tsdfx_digest : "sha1");
+	len = TSDFX_WORKER_MAX_SIZE + 1;
+	if ((sbuf = malloc(len)) == NULL || (dbuf = malloc(len)) == NULL)
+		goto fail;
+
+	/* open and read the source */
+	if ((sfd = open(job->src, O_RDONLY|O_NOFOLLOW)) < 0 ||
+	    fstat(sfd, &sst) != 0)
+		goto fail;
+	if (!S_ISREG(sst.st_mode) || sst.st_size > TSDFX_WORKER_MAX_SIZE ||
+	    time(NULL) - sst.st_mtime < TSDFX_WORKER_MIN_AGE)
+		goto defer;
+	if ((slen = tsdfx_worker_pread(sfd, sbuf, len, 0)) < 0)
+		goto fail;
+	if (slen != sst.st_size)
+		goto defer;
+	tsdfx_worker_throttle(slen);
+
+	/* open or create the destination */
+	if ((dfd = open(job->dst, O_RDWR|O_NOFOLLOW)) < 0) {
+		if (errno != ENOENT || (dfd = open(job->dst,
+		    O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW, 0600)) < 0)
+			goto fail;
+		NOTICE("created file %s (owner uid=%lu)", job->dst,
+		    (unsigned long)job->uid);
+	}
+	if (fstat(dfd, &dst) != 0)
+		goto fail;
+	if (!S_ISREG(dst.st_mode)) {
+		errno = S_ISDIR(dst.st_mode) ? EISDIR : EINVAL;
+		goto fail;
+	}
+
+	/* compare size and times */
+	if ((sst.st_mode & ~TSDFX_COPY_UMASK) == dst.st_mode &&
+	    sst.st_size == dst.st_size && sst.st_mtime == dst.st_mtime) {
+		VERBOSE("mode, size and mtime match");
+		goto done;
+	}
+
+	/* compare the contents and write only if they differ */
+	if ((dlen = tsdfx_worker_pread(dfd, dbuf, len, 0)) < 0)
+		goto fail;
+	if (dlen != slen || memcmp(sbuf, dbuf, slen) != 0) {
+		if (tsdfx_worker_pwrite(dfd, sbuf, slen, 0) != 0)
+			goto fail;
+	}
+	tsd_digest_init(&ctx, alg);
+	tsd_digest_update(&ctx, sbuf, slen);
+	tsd_digest_final(&ctx, digest);
+
+	/* set size, mode and times */
+	mode = ((sst.st_mode & 07777) | 0600) & ~TSDFX_COPY_UMASK;
+	times[0] = sst.st_atim;
+	times[1] = sst.st_mtim;
+	if (ftruncate(dfd, slen) != 0 || fchmod(dfd, mode) != 0 ||
+	    futimens(dfd, times) != 0)
+		goto fail;
+
+	/* read it back if requested */
+	if (tsdfx_check) {
+		if (fdatasync(dfd) != 0 ||
+		    (dlen = tsdfx_worker_pread(dfd, dbuf, len, 0)) < 0)
+			goto fail;
+		tsd_digest_init(&ctx, alg);
+		tsd_digest_update(&ctx, dbuf, dlen);
+		tsd_digest_final(&ctx, rdigest);
+		if (memcmp(digest, rdigest, tsd_digest_len(alg)) != 0) {
+			ERROR("digest differs after copy");
+			errno = EIO;
+			goto fail;
+		}
+	}
+
+	/* log it like the copier would */
+	for (i = 0; i < tsd_digest_len(alg); ++i) {
+		hex[i * 2] = "0123456789abcdef"[digest[i] >> 4];
+		hex[i * 2 + 1] = "0123456789abcdef"[digest[i] & 0xf];
+	}
+	hex[i * 2] = '\0';
+	gettimeofday(&tvf, NULL);
+	timersub(&tvf, &tvo, &tve);
+	NOTICE("copied %s to %s len %zu bytes %s %s in %lu.%03lu s",
+	    job->src, job->dst, (size_t)slen, tsd_digest_name(alg), hex,
+	    (unsigned long)tve.tv_sec, (unsigned long)tve.tv_usec / 1000);
+done:
+	close(sfd);
+	close(dfd);
+	free(sbuf);
+	free(dbuf);
+	return (WORKER_DONE);
+defer:
+	VERBOSE("leaving %s to the copier", job->src);
+	close(sfd);
+	free(sbuf);
+	free(dbuf);
+	return (WORKER_DEFERRED);
+fail:
+	serrno = errno;
+	USERERROR("failed to copy %s to %s: %s", job->src, job->dst,
+	    strerror(serrno));
+	if (sfd >= 0)
+		close(sfd);
+	if (dfd >= 0)
+		close(dfd);
+	free(sbuf);
+	free(dbuf);
+	errno = serrno;
+	return (WORKER_FAILED);
+}
+
+/*
+ * Run a job with the credentials it asks for.
+ */
+static enum tsdfx_worker_state
+tsdfx_worker_run(const struct tsdfx_worker_job *job)
+{
+	enum tsdfx_worker_state state;
+	int drop;
+
+	/* same rules as tsd_task_start() */
+	drop = (tsdfx_worker_uid == 0 && job->gids[0] > 0 &&
+	    job->uid != (uid_t)-1);
+	if (drop && tsdfx_worker_setcred(job->uid, job->gids[0], job->gids,
+	    job->ngids) != 0) {
+		WARNING("failed to switch to uid %lu: %s",
+		    (unsigned long)job->uid, strerror(errno));
+		state = WORKER_DEFERRED;
+	} else {
+		state = tsdfx_worker_copy(job);
+	}
+	if (drop && tsdfx_worker_setcred(tsdfx_worker_uid, tsdfx_worker_gid,
+	    tsdfx_worker_gids, tsdfx_worker_ngids) != 0) {
+		/* we can't trust this thread with anything else */
+		ERROR("failed to restore credentials: %s", strerror(errno));
+		abort();
+	}
+	return (state);
+}
+
+/*
+ * Worker thread: take jobs off the queue and run them until told to
+ * stop.
+ */
+static void *
+tsdfx_worker_main(void *arg)
+{
+	struct tsdfx_worker_job *job;
+	enum tsdfx_worker_state state;
+
+	(void)arg;
+	pthread_mutex_lock(&tsdfx_worker_mtx);
+	for (;;) {
+		while (!tsdfx_worker_stop && tsdfx_worker_first == NULL)
+			pthread_cond_wait(&tsdfx_worker_cv, &tsdfx_worker_mtx);
+		if (tsdfx_worker_stop)
+			break;
+		job = tsdfx_worker_first;
+		if ((tsdfx_worker_first = job->next) == NULL)
+			tsdfx_worker_last = &tsdfx_worker_first;
+		job->next = NULL;
+		job->state = WORKER_RUNNING;
+		pthread_mutex_unlock(&tsdfx_worker_mtx);
+		state = tsdfx_worker_run(job);
+		pthread_mutex_lock(&tsdfx_worker_mtx);
+		if (job->released)
+			free(job);
+		else
+			job->state = state;
+	}
+	pthread_mutex_unlock(&tsdfx_worker_mtx);
+	return (NULL);
+}
+
+/*
+ * Hand a copy over to the worker threads.
+ */
+struct tsdfx_worker_job *
+tsdfx_worker_submit(const char *src, const char *dst, uid_t uid,
+    const gid_t *gids, int ngids)
+{
+	struct tsdfx_worker_job *job;
+
+	if (tsdfx_worker_nthreads == 0) {
+		errno = ENXIO;
+		return (NULL);
+	}
+	if (ngids < 1 || ngids > (int)(sizeof job->gids / sizeof job->gids[0])) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((job = calloc(1, sizeof *job)) == NULL)
+		return (NULL);
+	if (strlcpy(job->src, src, sizeof job->src) >= sizeof job->src ||
+	    strlcpy(job->dst, dst, sizeof job->dst) >= sizeof job->dst) {
+		free(job);
+		errno = ENAMETOOLONG;
+		return (NULL);
+	}
+	job->uid = uid;
+	memcpy(job->gids, gids, ngids * sizeof job->gids[0]);
+	job->ngids = ngids;
+	job->state = WORKER_QUEUED;
+	pthread_mutex_lock(&tsdfx_worker_mtx);
+	*tsdfx_worker_last = job;
+	tsdfx_worker_last = &job->next;
+	pthread_cond_signal(&tsdfx_worker_cv);
+	pthread_mutex_unlock(&tsdfx_worker_mtx);
+	return (job);
+}
+
+/*
+ * Check on a job.
+ */
+enum tsdfx_worker_state
+tsdfx_worker_poll(struct tsdfx_worker_job *job)
+{
+	enum tsdfx_worker_state state;
+
+	pthread_mutex_lock(&tsdfx_worker_mtx);
+	state = job->state;
+	pthread_mutex_unlock(&tsdfx_worker_mtx);
+	return (state);
+}
+
+/*
+ * Forget about a job.  If it is still queued, it is cancelled; if it is
+ * running, the thread running it frees it when done.
+ */
+void
+tsdfx_worker_release(struct tsdfx_worker_job *job)
+{
+	struct tsdfx_worker_job **jp;
+
+	if (job == NULL)
+		return;
+	pthread_mutex_lock(&tsdfx_worker_mtx);
+	if (job->state == WORKER_RUNNING) {
+		job->released = 1;
+		job = NULL;
+	} else if (job->state == WORKER_QUEUED) {
+		for (jp = &tsdfx_worker_first; *jp != job; jp = &(*jp)->next)
+			/* nothing */ ;
+		if ((*jp = job->next) == NULL)
+			tsdfx_worker_last = jp;
+	}
+	pthread_mutex_unlock(&tsdfx_worker_mtx);
+	free(job);
+}
+
+/*
+ * Start the worker threads.
+ */
+int
+tsdfx_worker_init(unsigned int nthreads, const struct tsd_ratelimit *rl,
+    unsigned int nrl)
+{
+	sigset_t mask, omask;
+	unsigned int i;
+	int n, serrno;
+
+	/* keep the rate limits which actually limit anything */
+	tsdfx_worker_nratelimits = 0;
+	for (i = 0; i < nrl; ++i) {
+		if ((rl[i].rate > 0 || rl[i].nwin > 0) &&
+		    tsdfx_worker_nratelimits < TSDFX_WORKER_MAX_RATELIMITS)
+			tsdfx_worker_ratelimit[tsdfx_worker_nratelimits++] =
+			    rl[i];
+	}
+
+	/* remember who we are */
+	tsdfx_worker_uid = geteuid();
+	tsdfx_worker_gid = getegid();
+	if ((n = getgroups(0, NULL)) < 0)
+		return (-1);
+	if ((tsdfx_worker_gids = calloc(n + 1, sizeof *tsdfx_worker_gids)) == NULL)
+		return (-1);
+	if ((n = getgroups(n, tsdfx_worker_gids)) < 0)
+		goto fail;
+	tsdfx_worker_ngids = n;
+
+	/* the threads should leave signals to the main thread */
+	if ((tsdfx_worker_threads = calloc(nthreads,
+	    sizeof *tsdfx_worker_threads)) == NULL)
+		goto fail;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+	tsdfx_worker_stop = 0;
+	while (tsdfx_worker_nthreads < nthreads) {
+		if ((errno = pthread_create(
+		    &tsdfx_worker_threads[tsdfx_worker_nthreads], NULL,
+		    tsdfx_worker_main, NULL)) != 0)
+			break;
+		tsdfx_worker_nthreads++;
+	}
+	serrno = errno;
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	if (tsdfx_worker_nthreads < nthreads) {
+		tsdfx_worker_exit();
+		errno = serrno;
+		return (-1);
+	}
+	VERBOSE("started %u worker threads", tsdfx_worker_nthreads);
+	return (0);
+fail:
+	serrno = errno;
+	free(tsdfx_worker_gids);
+	tsdfx_worker_gids = NULL;
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Stop the worker threads once they are done with what they are doing.
+ * Jobs which have not been started yet stay in the queue until they are
+ * released.
+ */
+void
+tsdfx_worker_exit(void)
+{
+
+	pthread_mutex_lock(&tsdfx_worker_mtx);
+	tsdfx_worker_stop = 1;
+	pthread_cond_broadcast(&tsdfx_worker_cv);
+	pthread_mutex_unlock(&tsdfx_worker_mtx);
+	while (tsdfx_worker_nthreads > 0)
+		pthread_join(tsdfx_worker_threads[--tsdfx_worker_nthreads], NULL);
+	free(tsdfx_worker_threads);
+	tsdfx_worker_threads = NULL;
+	free(tsdfx_worker_gids);
+	tsdfx_worker_gids = NULL;
+}
+
+#else
+
+struct tsdfx_worker_job *
+tsdfx_worker_submit(const char *src, const char *dst, uid_t uid,
+    const gid_t *gids, int ngids)
+{
+
+	(void)src;
+	(void)dst;
+	(void)uid;
+	(void)gids;
+	(void)ngids;
+	errno = ENOSYS;
+	return (NULL);
+}
+
+enum tsdfx_worker_state
+tsdfx_worker_poll(struct tsdfx_worker_job *job)
+{
+
+	(void)job;
+	return (WORKER_FAILED);
+}
+
+void
+tsdfx_worker_release(struct tsdfx_worker_job *job)
+{
+
+	(void)job;
+}
+
+int
+tsdfx_worker_init(unsigned int nthreads, const struct tsd_ratelimit *rl,
+    unsigned int nrl)
+{
+
+	(void)nthreads;
+	(void)rl;
+	(void)nrl;
+	errno = ENOSYS;
+	return (-1);
+}
+
+void
+tsdfx_worker_exit(void)
+{
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSD_BLAKE3_H_INCLUDED
+#define TSD_BLAKE3_H_INCLUDED
+
+#define BLAKE3_BLOCK_LEN		64
+#define BLAKE3_CHUNK_LEN		1024
+#define BLAKE3_DIGEST_LEN		32
+#define BLAKE3_MAX_DEPTH		54
+
+#define blake3_ctx			tsd_blake3_ctx
+#define blake3_init			tsd_blake3_init
+#define blake3_update			tsd_blake3_update
+#define blake3_final			tsd_blake3_final
+#define blake3_complete			tsd_blake3_complete
+#define blake3_select			tsd_blake3_select
+#define blake3_implementation		tsd_blake3_implementation
+
+typedef struct {
+	/* current chunk */
+	uint32_t cv[8];
+	uint64_t chunk;
+	uint8_t block[64];
+	uint32_t blocklen;
+	uint32_t nblocks;
+	/* chaining values of completed subtrees */
+	uint32_t stack[BLAKE3_MAX_DEPTH][8];
+	uint32_t depth;
+} blake3_ctx;
+
+void blake3_init(blake3_ctx *);
+void blake3_update(blake3_ctx *, const void *, size_t);
+void blake3_final(blake3_ctx *, uint8_t *);
+void blake3_complete(const void *, size_t, uint8_t *);
+int blake3_select(const char *);
+const char *blake3_implementation(void);
+
+#endif
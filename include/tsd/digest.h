@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSD_DIGEST_H_INCLUDED
+#define TSD_DIGEST_H_INCLUDED
+
+#include <tsd/blake3.h>
+#include <tsd/sha1.h>
+#include <tsd/sha256.h>
+
+#define TSD_DIGEST_MAX_LEN		32
+#define TSD_DIGEST_MAX_STATE_LEN	2048
+
+struct tsd_digest_alg;
+
+typedef struct {
+	const struct tsd_digest_alg *alg;
+	union {
+		sha1_ctx sha1;
+		sha256_ctx sha256;
+		blake3_ctx blake3;
+	} u;
+} tsd_digest_ctx;
+
+const struct tsd_digest_alg *tsd_digest_lookup(const char *);
+const char *tsd_digest_name(const struct tsd_digest_alg *);
+size_t tsd_digest_len(const struct tsd_digest_alg *);
+void tsd_digest_init(tsd_digest_ctx *, const struct tsd_digest_alg *);
+void tsd_digest_update(tsd_digest_ctx *, const void *, size_t);
+void tsd_digest_final(tsd_digest_ctx *, uint8_t *);
+size_t tsd_digest_save(const tsd_digest_ctx *, void *, size_t);
+int tsd_digest_restore(tsd_digest_ctx *, const struct tsd_digest_alg *,
+    const void *, size_t);
+
+#endif
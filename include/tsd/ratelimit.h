@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSD_RATELIMIT_H_INCLUDED
+#define TSD_RATELIMIT_H_INCLUDED
+
+#define TSD_RATELIMIT_MAX_WINDOWS 8
+
+/*
+ * A byte rate limit, optionally varying with the time of day, and a
+ * token bucket to enforce it.  A rate of 0 means no limit.
+ */
+struct tsd_ratelimit {
+	/* limits during specific times of day */
+	struct {
+		unsigned int	 start, end;	/* minutes past midnight */
+		uint64_t	 rate;		/* bytes per second */
+	} win[TSD_RATELIMIT_MAX_WINDOWS];
+	unsigned int		 nwin;
+
+	/* limit at all other times */
+	uint64_t		 rate;
+
+	/* token bucket */
+	double			 tokens;
+	struct timespec		 last;
+};
+
+int tsd_ratelimit_parse(struct tsd_ratelimit *, const char *);
+int tsd_ratelimit_format(const struct tsd_ratelimit *, char *, size_t);
+void tsd_ratelimit_scale(struct tsd_ratelimit *, unsigned int);
+uint64_t tsd_ratelimit_rate(const struct tsd_ratelimit *, time_t);
+void tsd_ratelimit_consume(struct tsd_ratelimit *, size_t);
+
+#endif
@@ -39,6 +39,8 @@
 #define sha1_update			tsd_sha1_update
 #define sha1_final			tsd_sha1_final
 #define sha1_complete			tsd_sha1_complete
+#define sha1_select			tsd_sha1_select
+#define sha1_implementation		tsd_sha1_implementation
 
 typedef struct {
 	uint8_t block[64];
@@ -51,5 +53,7 @@ void sha1_init(sha1_ctx *);
 void sha1_update(sha1_ctx *, const void *, size_t);
 void sha1_final(sha1_ctx *, uint8_t *);
 void sha1_complete(const void *, size_t, uint8_t *);
+int sha1_select(const char *);
+const char *sha1_implementation(void);
 
 #endif
@@ -0,0 +1,56 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSD_STAT_H_INCLUDED
+#define TSD_STAT_H_INCLUDED
+
+/* fields to retrieve */
+#define TSD_STAT_TYPE		0x0001	/* file type bits of st_mode */
+#define TSD_STAT_MODE		0x0002	/* permission bits of st_mode */
+#define TSD_STAT_OWNER		0x0004	/* st_uid and st_gid */
+#define TSD_STAT_SIZE		0x0008	/* st_size */
+#define TSD_STAT_ATIME		0x0010	/* st_atim */
+#define TSD_STAT_MTIME		0x0020	/* st_mtim */
+#define TSD_STAT_INO		0x0040	/* st_dev and st_ino */
+
+/* flags */
+#define TSD_STAT_NOFOLLOW	0x0001	/* do not follow symbolic links */
+#define TSD_STAT_CACHED		0x0002	/* cached attributes will do */
+
+struct stat;
+struct statx;
+
+int tsd_stat(int, const char *, int, unsigned int, struct stat *);
+
+/* only where statx() is available */
+int tsd_statx_flags(int);
+unsigned int tsd_statx_mask(unsigned int);
+void tsd_statx_to_stat(const struct statx *, struct stat *);
+
+#endif
@@ -0,0 +1,58 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSD_URING_H_INCLUDED
+#define TSD_URING_H_INCLUDED
+
+/* operations which may or may not be supported by the running kernel */
+enum tsd_uring_op {
+	TSD_URING_READ,
+	TSD_URING_WRITE,
+	TSD_URING_STATX,
+	TSD_URING_OPENAT,
+};
+
+struct statx;
+struct tsd_uring;
+
+struct tsd_uring *tsd_uring_create(unsigned int);
+void tsd_uring_destroy(struct tsd_uring *);
+int tsd_uring_supported(const struct tsd_uring *, enum tsd_uring_op);
+int tsd_uring_read(struct tsd_uring *, int, void *, size_t, off_t, uint64_t);
+int tsd_uring_write(struct tsd_uring *, int, const void *, size_t, off_t,
+    uint64_t);
+int tsd_uring_statx(struct tsd_uring *, int, const char *, int, unsigned int,
+    struct statx *, uint64_t);
+int tsd_uring_openat(struct tsd_uring *, int, const char *, int, mode_t,
+    uint64_t);
+int tsd_uring_submit(struct tsd_uring *, unsigned int);
+int tsd_uring_reap(struct tsd_uring *, uint64_t *, int *);
+int tsd_uring_drain(struct tsd_uring *);
+
+#endif
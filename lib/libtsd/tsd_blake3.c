@@ -0,0 +1,486 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if HAVE_SYS_ENDIAN_H
+#include <sys/endian.h>
+#endif
+
+#if HAVE_ENDIAN_H
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#include <endian.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && HAVE_CPUID_H
+#define BLAKE3_X86 1
+#include <immintrin.h>
+#endif
+
+#include <tsd/bitwise.h>
+#include <tsd/blake3.h>
+#include <tsd/cpu.h>
+
+/*
+ * BLAKE3 in its default hashing mode, with a 256-bit output.  The
+ * input is split into 1024-byte chunks, each of which is hashed
+ * separately; the chaining values of the chunks then form the leaves
+ * of a binary tree.  Completed subtrees are kept on a stack and merged
+ * as soon as they have a sibling of the same size.  Keyed hashing, key
+ * derivation and extended output are not implemented.
+ */
+
+#define BLAKE3_CHUNK_START		0x01
+#define BLAKE3_CHUNK_END		0x02
+#define BLAKE3_PARENT			0x04
+#define BLAKE3_ROOT			0x08
+
+/*
+ * Whole chunks can be hashed several at a time, depending on the
+ * platform; as with SHA-1, the best implementation supported by the
+ * CPU we are running on is selected the first time a context is
+ * initialized.  The generic implementation has no such function and
+ * hashes everything one block at a time.
+ */
+typedef void (*blake3_hash8_func)(const uint8_t *, uint64_t, uint32_t[8][8]);
+
+struct blake3_impl {
+	const char		*name;
+	blake3_hash8_func	 hash8;
+	int			(*usable)(void);
+};
+
+static const struct blake3_impl *blake3_impl;
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+	0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U,
+};
+
+/* message word permutation for each round */
+static const uint8_t blake3_sigma[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+#define blake3_g(v, a, b, c, d, x, y)					\
+	do {								\
+		v[a] = v[a] + v[b] + x;					\
+		v[d] = ror32(v[d] ^ v[a], 16);				\
+		v[c] = v[c] + v[d];					\
+		v[b] = ror32(v[b] ^ v[c], 12);				\
+		v[a] = v[a] + v[b] + y;					\
+		v[d] = ror32(v[d] ^ v[a], 8);				\
+		v[c] = v[c] + v[d];					\
+		v[b] = ror32(v[b] ^ v[c], 7);				\
+	} while (0)
+
+/*
+ * The compression function.  Only the first half of the output is
+ * ever needed, either as a chaining value or as the final digest.
+ */
+static void
+blake3_compress(const uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+    uint32_t blocklen, uint32_t flags, uint32_t out[8])
+{
+	const uint8_t *s;
+	uint32_t v[16];
+
+	memcpy(v, cv, 8 * sizeof *v);
+	memcpy(v + 8, blake3_iv, 4 * sizeof *v);
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = blocklen;
+	v[15] = flags;
+	for (int r = 0; r < 7; ++r) {
+		s = blake3_sigma[r];
+		blake3_g(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		blake3_g(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		blake3_g(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		blake3_g(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		blake3_g(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		blake3_g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		blake3_g(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		blake3_g(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+	for (int i = 0; i < 8; ++i)
+		out[i] = v[i] ^ v[i + 8];
+}
+
+/* compress a block of input into the current chunk */
+static void
+blake3_compress_block(blake3_ctx *ctx, const uint8_t *block, uint32_t flags)
+{
+	uint32_t m[16];
+
+	memcpy(m, block, sizeof m);
+	for (int i = 0; i < 16; ++i)
+		m[i] = le32toh(m[i]);
+	if (ctx->nblocks == 0)
+		flags |= BLAKE3_CHUNK_START;
+	blake3_compress(ctx->cv, m, ctx->chunk, BLAKE3_BLOCK_LEN, flags,
+	    ctx->cv);
+	ctx->nblocks++;
+}
+
+/* compute the chaining value of a parent node */
+static void
+blake3_parent(const uint32_t left[8], const uint32_t right[8], uint32_t flags,
+    uint32_t out[8])
+{
+	uint32_t m[16];
+
+	memcpy(m, left, 8 * sizeof *m);
+	memcpy(m + 8, right, 8 * sizeof *m);
+	blake3_compress(blake3_iv, m, 0, BLAKE3_BLOCK_LEN,
+	    BLAKE3_PARENT | flags, out);
+}
+
+#if BLAKE3_X86
+/*
+ * Hash eight consecutive whole chunks at once, one in each 32-bit lane
+ * of the AVX2 registers.  This is where BLAKE3 gets most of its speed:
+ * the chunks are independent, so the only limit on parallelism is the
+ * width of the vectors.
+ */
+#define blake3_g8(v, a, b, c, d, x, y)					\
+	do {								\
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x); \
+		v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), \
+		    ror16);						\
+		v[c] = _mm256_add_epi32(v[c], v[d]);			\
+		v[b] = _mm256_xor_si256(v[b], v[c]);			\
+		v[b] = _mm256_or_si256(_mm256_srli_epi32(v[b], 12),	\
+		    _mm256_slli_epi32(v[b], 20));			\
+		v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y); \
+		v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), \
+		    ror8);						\
+		v[c] = _mm256_add_epi32(v[c], v[d]);			\
+		v[b] = _mm256_xor_si256(v[b], v[c]);			\
+		v[b] = _mm256_or_si256(_mm256_srli_epi32(v[b], 7),	\
+		    _mm256_slli_epi32(v[b], 25));			\
+	} while (0)
+
+/* load eight words from each of eight chunks and transpose them */
+__attribute__((target("avx2")))
+static inline void
+blake3_load8(const uint8_t *p, __m256i *m)
+{
+	__m256i r[8], t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; ++i)
+		r[i] = _mm256_loadu_si256(
+		    (const __m256i *)(p + i * BLAKE3_CHUNK_LEN));
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; ++i) {
+		m[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		m[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+blake3_hash8_avx2(const uint8_t *p, uint64_t chunk, uint32_t cvs[8][8])
+{
+	const __m256i ror16 = _mm256_set_epi8(
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i ror8 = _mm256_set_epi8(
+	    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+	    12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+	__m256i cv[8], v[16], m[16], lo, hi;
+	uint32_t out[8][8], flags;
+	const uint8_t *s;
+	int b, i, r;
+
+	lo = _mm256_setr_epi32(
+	    (int)(uint32_t)(chunk + 0), (int)(uint32_t)(chunk + 1),
+	    (int)(uint32_t)(chunk + 2), (int)(uint32_t)(chunk + 3),
+	    (int)(uint32_t)(chunk + 4), (int)(uint32_t)(chunk + 5),
+	    (int)(uint32_t)(chunk + 6), (int)(uint32_t)(chunk + 7));
+	hi = _mm256_setr_epi32(
+	    (int)((chunk + 0) >> 32), (int)((chunk + 1) >> 32),
+	    (int)((chunk + 2) >> 32), (int)((chunk + 3) >> 32),
+	    (int)((chunk + 4) >> 32), (int)((chunk + 5) >> 32),
+	    (int)((chunk + 6) >> 32), (int)((chunk + 7) >> 32));
+	for (i = 0; i < 8; ++i)
+		cv[i] = _mm256_set1_epi32((int)blake3_iv[i]);
+	for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; ++b) {
+		blake3_load8(p + b * BLAKE3_BLOCK_LEN, m);
+		blake3_load8(p + b * BLAKE3_BLOCK_LEN + 32, m + 8);
+		flags = 0;
+		if (b == 0)
+			flags |= BLAKE3_CHUNK_START;
+		if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+			flags |= BLAKE3_CHUNK_END;
+		for (i = 0; i < 8; ++i)
+			v[i] = cv[i];
+		for (i = 0; i < 4; ++i)
+			v[i + 8] = _mm256_set1_epi32((int)blake3_iv[i]);
+		v[12] = lo;
+		v[13] = hi;
+		v[14] = _mm256_set1_epi32(BLAKE3_BLOCK_LEN);
+		v[15] = _mm256_set1_epi32((int)flags);
+		for (r = 0; r < 7; ++r) {
+			s = blake3_sigma[r];
+			blake3_g8(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+			blake3_g8(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+			blake3_g8(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+			blake3_g8(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+			blake3_g8(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+			blake3_g8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			blake3_g8(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+			blake3_g8(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+		}
+		for (i = 0; i < 8; ++i)
+			cv[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+	for (i = 0; i < 8; ++i)
+		_mm256_storeu_si256((__m256i *)out[i], cv[i]);
+	for (i = 0; i < 8; ++i)
+		for (b = 0; b < 8; ++b)
+			cvs[i][b] = out[b][i];
+}
+
+static int
+blake3_usable_avx2(void)
+{
+
+	return ((tsd_cpu_features() & TSD_CPU_AVX2) != 0);
+}
+#endif
+
+static int
+blake3_usable_generic(void)
+{
+
+	return (1);
+}
+
+/* in order of preference */
+static const struct blake3_impl blake3_impls[] = {
+#if BLAKE3_X86
+	{ "avx2",	blake3_hash8_avx2,	blake3_usable_avx2 },
+#endif
+	{ "generic",	NULL,			blake3_usable_generic },
+};
+
+/*
+ * Select an implementation by name, or the best one available if name
+ * is NULL.
+ */
+int
+blake3_select(const char *name)
+{
+	const struct blake3_impl *impl;
+	unsigned int i;
+
+	for (i = 0; i < sizeof blake3_impls / sizeof blake3_impls[0]; ++i) {
+		impl = &blake3_impls[i];
+		if (name != NULL && strcmp(name, impl->name) != 0)
+			continue;
+		if (!impl->usable()) {
+			if (name == NULL)
+				continue;
+			errno = ENOTSUP;
+			return (-1);
+		}
+		__atomic_store_n(&blake3_impl, impl, __ATOMIC_RELAXED);
+		return (0);
+	}
+	errno = ENOENT;
+	return (-1);
+}
+
+const char *
+blake3_implementation(void)
+{
+	const struct blake3_impl *impl;
+
+	if ((impl = __atomic_load_n(&blake3_impl, __ATOMIC_RELAXED)) == NULL) {
+		blake3_select(NULL);
+		impl = __atomic_load_n(&blake3_impl, __ATOMIC_RELAXED);
+	}
+	return (impl->name);
+}
+
+/*
+ * Add the chaining value of a completed chunk to the stack, merging it
+ * with its siblings: after n chunks, there is one subtree on the stack
+ * for every bit set in n.
+ */
+static void
+blake3_push(blake3_ctx *ctx, uint32_t cv[8], uint64_t nchunks)
+{
+
+	while ((nchunks & 1) == 0) {
+		blake3_parent(ctx->stack[--ctx->depth], cv, 0, cv);
+		nchunks >>= 1;
+	}
+	memcpy(ctx->stack[ctx->depth++], cv, 8 * sizeof *cv);
+}
+
+void
+blake3_init(blake3_ctx *ctx)
+{
+
+	if (__atomic_load_n(&blake3_impl, __ATOMIC_RELAXED) == NULL)
+		blake3_select(NULL);
+	memset(ctx, 0, sizeof *ctx);
+	memcpy(ctx->cv, blake3_iv, sizeof ctx->cv);
+}
+
+void
+blake3_update(blake3_ctx *ctx, const void *buf, size_t len)
+{
+	const struct blake3_impl *impl;
+	const uint8_t *p = buf;
+	size_t copylen;
+
+	/*
+	 * The last block of a chunk, and the last chunk of the input, are
+	 * not compressed until we know there is more input, since they
+	 * need different flags depending on whether or not they are the
+	 * last.
+	 */
+	impl = __atomic_load_n(&blake3_impl, __ATOMIC_RELAXED);
+	while (len > 0) {
+		if (ctx->blocklen == BLAKE3_BLOCK_LEN) {
+			if (ctx->nblocks == BLAKE3_CHUNK_LEN /
+			    BLAKE3_BLOCK_LEN - 1) {
+				blake3_compress_block(ctx, ctx->block,
+				    BLAKE3_CHUNK_END);
+				blake3_push(ctx, ctx->cv, ++ctx->chunk);
+				memcpy(ctx->cv, blake3_iv, sizeof ctx->cv);
+				ctx->nblocks = 0;
+			} else {
+				blake3_compress_block(ctx, ctx->block, 0);
+			}
+			ctx->blocklen = 0;
+			memset(ctx->block, 0, sizeof ctx->block);
+		}
+		if (impl->hash8 != NULL && ctx->blocklen == 0 &&
+		    ctx->nblocks == 0 && len > 8 * BLAKE3_CHUNK_LEN) {
+			/* hash eight whole chunks at a time */
+			uint32_t cvs[8][8];
+
+			while (len > 8 * BLAKE3_CHUNK_LEN) {
+				impl->hash8(p, ctx->chunk, cvs);
+				for (int i = 0; i < 8; ++i)
+					blake3_push(ctx, cvs[i], ++ctx->chunk);
+				p += 8 * BLAKE3_CHUNK_LEN;
+				len -= 8 * BLAKE3_CHUNK_LEN;
+			}
+			continue;
+		}
+		if (ctx->blocklen == 0 && len > BLAKE3_BLOCK_LEN &&
+		    ctx->nblocks < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1) {
+			/* compress directly from the caller's buffer */
+			blake3_compress_block(ctx, p, 0);
+			p += BLAKE3_BLOCK_LEN;
+			len -= BLAKE3_BLOCK_LEN;
+			continue;
+		}
+		copylen = BLAKE3_BLOCK_LEN - ctx->blocklen;
+		if (copylen > len)
+			copylen = len;
+		memcpy(ctx->block + ctx->blocklen, p, copylen);
+		ctx->blocklen += copylen;
+		p += copylen;
+		len -= copylen;
+	}
+}
+
+void
+blake3_final(blake3_ctx *ctx, uint8_t *digest)
+{
+	uint32_t cv[8], m[16], flags;
+	const uint32_t *in;
+	uint64_t counter;
+	uint32_t blocklen;
+
+	/* the last chunk, which may also be the root */
+	memcpy(m, ctx->block, sizeof m);
+	for (int i = 0; i < 16; ++i)
+		m[i] = le32toh(m[i]);
+	in = ctx->cv;
+	counter = ctx->chunk;
+	blocklen = ctx->blocklen;
+	flags = BLAKE3_CHUNK_END;
+	if (ctx->nblocks == 0)
+		flags |= BLAKE3_CHUNK_START;
+
+	/* walk up the stack, turning each node into a parent */
+	while (ctx->depth > 0) {
+		blake3_compress(in, m, counter, blocklen, flags, cv);
+		memcpy(m, ctx->stack[--ctx->depth], 8 * sizeof *m);
+		memcpy(m + 8, cv, 8 * sizeof *m);
+		in = blake3_iv;
+		counter = 0;
+		blocklen = BLAKE3_BLOCK_LEN;
+		flags = BLAKE3_PARENT;
+	}
+	blake3_compress(in, m, counter, blocklen, flags | BLAKE3_ROOT, cv);
+	for (int i = 0; i < 8; ++i)
+		cv[i] = htole32(cv[i]);
+	memcpy(digest, cv, BLAKE3_DIGEST_LEN);
+	memset(ctx, 0, sizeof *ctx);
+}
+
+void
+blake3_complete(const void *buf, size_t len, uint8_t *digest)
+{
+	blake3_ctx ctx;
+
+	blake3_init(&ctx);
+	blake3_update(&ctx, buf, len);
+	blake3_final(&ctx, digest);
+}
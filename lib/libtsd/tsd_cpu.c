@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && HAVE_CPUID_H
+#define CPU_X86 1
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && HAVE_SYS_AUXV_H && HAVE_GETAUXVAL
+#define CPU_ARM 1
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+
+#include <stddef.h>
+
+#include <tsd/cpu.h>
+
+/*
+ * CPU feature detection for the digest implementations which select
+ * the best code for the CPU they run on.  The features are probed once
+ * and cached; the probe has no side effects, so it does not matter if
+ * several threads race to do it.
+ */
+
+#define CPU_PROBED	0x80000000U
+
+static unsigned int cpu_features;
+
+#if CPU_X86
+/*
+ * AVX2 additionally requires the OS to save and restore the YMM
+ * registers.
+ */
+static unsigned int
+cpu_probe(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0, features;
+
+	features = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return (0);
+	if (ecx & bit_SSSE3)
+		features |= TSD_CPU_SSSE3;
+	if (ecx & bit_SSE4_1)
+		features |= TSD_CPU_SSE41;
+	xcr0 = 0;
+	if (ecx & bit_OSXSAVE)
+		__asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+	if (__get_cpuid_max(0, NULL) < 7)
+		return (features);
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if ((ebx & (1U << 5)) && (xcr0 & 0x06) == 0x06)
+		features |= TSD_CPU_AVX2;
+	if (ebx & (1U << 29))
+		features |= TSD_CPU_SHA;
+	return (features);
+}
+#elif CPU_ARM
+static unsigned int
+cpu_probe(void)
+{
+	unsigned int features;
+
+	features = 0;
+	if (getauxval(AT_HWCAP) & HWCAP_SHA1)
+		features |= TSD_CPU_ARMV8_SHA1;
+	return (features);
+}
+#else
+static unsigned int
+cpu_probe(void)
+{
+
+	return (0);
+}
+#endif
+
+/*
+ * Return the set of features supported by the CPU we are running on.
+ */
+unsigned int
+tsd_cpu_features(void)
+{
+	unsigned int features;
+
+	features = __atomic_load_n(&cpu_features, __ATOMIC_RELAXED);
+	if (features == 0) {
+		features = cpu_probe() | CPU_PROBED;
+		__atomic_store_n(&cpu_features, features, __ATOMIC_RELAXED);
+	}
+	return (features & ~CPU_PROBED);
+}
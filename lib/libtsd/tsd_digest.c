@@ -0,0 +1,298 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <tsd/digest.h>
+
+/*
+ * Generic interface to the message digest algorithms we support, so
+ * that callers can select one by name at run time.
+ */
+
+typedef void (*tsd_digest_init_func)(void *);
+typedef void (*tsd_digest_update_func)(void *, const void *, size_t);
+typedef void (*tsd_digest_final_func)(void *, uint8_t *);
+typedef void (*tsd_digest_save_func)(const void *, uint8_t *);
+typedef int (*tsd_digest_restore_func)(void *, const uint8_t *);
+
+struct tsd_digest_alg {
+	const char		*name;
+	size_t			 len;
+	size_t			 statelen;
+	tsd_digest_init_func	 init;
+	tsd_digest_update_func	 update;
+	tsd_digest_final_func	 final;
+	tsd_digest_save_func	 save;
+	tsd_digest_restore_func	 restore;
+};
+
+/*
+ * The intermediate state of a computation is serialized one field at
+ * a time, with integers in big-endian order, so that it does not
+ * depend on the layout of the context structures or on the platform.
+ * The lengths below must match what the save functions write.
+ */
+#define SHA1_STATE_LEN		(64 + 4 + 5 * 4 + 8)
+#define SHA256_STATE_LEN	(64 + 4 + 8 * 4 + 8)
+#define BLAKE3_STATE_LEN	(8 * 4 + 8 + 64 + 4 + 4 + \
+				    BLAKE3_MAX_DEPTH * 8 * 4 + 4)
+
+static uint8_t *
+state_put32(uint8_t *p, const uint32_t *w, unsigned int n)
+{
+
+	while (n--) {
+		*p++ = (uint8_t)(*w >> 24);
+		*p++ = (uint8_t)(*w >> 16);
+		*p++ = (uint8_t)(*w >> 8);
+		*p++ = (uint8_t)*w++;
+	}
+	return (p);
+}
+
+static uint8_t *
+state_put64(uint8_t *p, uint64_t v)
+{
+	uint32_t w[2];
+
+	w[0] = (uint32_t)(v >> 32);
+	w[1] = (uint32_t)v;
+	return (state_put32(p, w, 2));
+}
+
+static const uint8_t *
+state_get32(const uint8_t *p, uint32_t *w, unsigned int n)
+{
+
+	while (n--) {
+		*w++ = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		    (uint32_t)p[2] << 8 | (uint32_t)p[3];
+		p += 4;
+	}
+	return (p);
+}
+
+static const uint8_t *
+state_get64(const uint8_t *p, uint64_t *v)
+{
+	uint32_t w[2];
+
+	p = state_get32(p, w, 2);
+	*v = (uint64_t)w[0] << 32 | w[1];
+	return (p);
+}
+
+static void
+sha1_save(const sha1_ctx *ctx, uint8_t *p)
+{
+
+	memcpy(p, ctx->block, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_put32(p, &ctx->blocklen, 1);
+	p = state_put32(p, ctx->h, 5);
+	p = state_put64(p, ctx->bitlen);
+}
+
+static int
+sha1_restore(sha1_ctx *ctx, const uint8_t *p)
+{
+
+	memcpy(ctx->block, p, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_get32(p, &ctx->blocklen, 1);
+	p = state_get32(p, ctx->h, 5);
+	p = state_get64(p, &ctx->bitlen);
+	return (ctx->blocklen <= sizeof ctx->block ? 0 : -1);
+}
+
+static void
+sha256_save(const sha256_ctx *ctx, uint8_t *p)
+{
+
+	memcpy(p, ctx->block, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_put32(p, &ctx->blocklen, 1);
+	p = state_put32(p, ctx->h, 8);
+	p = state_put64(p, ctx->bitlen);
+}
+
+static int
+sha256_restore(sha256_ctx *ctx, const uint8_t *p)
+{
+
+	memcpy(ctx->block, p, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_get32(p, &ctx->blocklen, 1);
+	p = state_get32(p, ctx->h, 8);
+	p = state_get64(p, &ctx->bitlen);
+	return (ctx->blocklen <= sizeof ctx->block ? 0 : -1);
+}
+
+static void
+blake3_save(const blake3_ctx *ctx, uint8_t *p)
+{
+
+	p = state_put32(p, ctx->cv, 8);
+	p = state_put64(p, ctx->chunk);
+	memcpy(p, ctx->block, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_put32(p, &ctx->blocklen, 1);
+	p = state_put32(p, &ctx->nblocks, 1);
+	p = state_put32(p, &ctx->stack[0][0], BLAKE3_MAX_DEPTH * 8);
+	p = state_put32(p, &ctx->depth, 1);
+}
+
+static int
+blake3_restore(blake3_ctx *ctx, const uint8_t *p)
+{
+
+	p = state_get32(p, ctx->cv, 8);
+	p = state_get64(p, &ctx->chunk);
+	memcpy(ctx->block, p, sizeof ctx->block);
+	p += sizeof ctx->block;
+	p = state_get32(p, &ctx->blocklen, 1);
+	p = state_get32(p, &ctx->nblocks, 1);
+	p = state_get32(p, &ctx->stack[0][0], BLAKE3_MAX_DEPTH * 8);
+	p = state_get32(p, &ctx->depth, 1);
+	if (ctx->blocklen > BLAKE3_BLOCK_LEN ||
+	    ctx->nblocks >= BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN ||
+	    ctx->depth > BLAKE3_MAX_DEPTH)
+		return (-1);
+	return (0);
+}
+
+static const struct tsd_digest_alg tsd_digest_algs[] = {
+	{
+		"sha1", SHA1_DIGEST_LEN, SHA1_STATE_LEN,
+		(tsd_digest_init_func)sha1_init,
+		(tsd_digest_update_func)sha1_update,
+		(tsd_digest_final_func)sha1_final,
+		(tsd_digest_save_func)sha1_save,
+		(tsd_digest_restore_func)sha1_restore,
+	},
+	{
+		"sha256", SHA256_DIGEST_LEN, SHA256_STATE_LEN,
+		(tsd_digest_init_func)sha256_init,
+		(tsd_digest_update_func)sha256_update,
+		(tsd_digest_final_func)sha256_final,
+		(tsd_digest_save_func)sha256_save,
+		(tsd_digest_restore_func)sha256_restore,
+	},
+	{
+		"blake3", BLAKE3_DIGEST_LEN, BLAKE3_STATE_LEN,
+		(tsd_digest_init_func)blake3_init,
+		(tsd_digest_update_func)blake3_update,
+		(tsd_digest_final_func)blake3_final,
+		(tsd_digest_save_func)blake3_save,
+		(tsd_digest_restore_func)blake3_restore,
+	},
+};
+
+const struct tsd_digest_alg *
+tsd_digest_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof tsd_digest_algs / sizeof *tsd_digest_algs; ++i)
+		if (strcmp(tsd_digest_algs[i].name, name) == 0)
+			return (&tsd_digest_algs[i]);
+	errno = ENOENT;
+	return (NULL);
+}
+
+const char *
+tsd_digest_name(const struct tsd_digest_alg *alg)
+{
+
+	return (alg->name);
+}
+
+size_t
+tsd_digest_len(const struct tsd_digest_alg *alg)
+{
+
+	return (alg->len);
+}
+
+void
+tsd_digest_init(tsd_digest_ctx *ctx, const struct tsd_digest_alg *alg)
+{
+
+	ctx->alg = alg;
+	alg->init(&ctx->u);
+}
+
+void
+tsd_digest_update(tsd_digest_ctx *ctx, const void *buf, size_t len)
+{
+
+	ctx->alg->update(&ctx->u, buf, len);
+}
+
+void
+tsd_digest_final(tsd_digest_ctx *ctx, uint8_t *digest)
+{
+
+	ctx->alg->final(&ctx->u, digest);
+}
+
+size_t
+tsd_digest_save(const tsd_digest_ctx *ctx, void *buf, size_t size)
+{
+
+	if (buf != NULL && size >= ctx->alg->statelen)
+		ctx->alg->save(&ctx->u, buf);
+	return (ctx->alg->statelen);
+}
+
+/*
+ * The context is initialized first, so that the algorithm has picked
+ * its implementation before it is used; if the state turns out to be
+ * invalid, it is left initialized.
+ */
+int
+tsd_digest_restore(tsd_digest_ctx *ctx, const struct tsd_digest_alg *alg,
+    const void *buf, size_t len)
+{
+
+	tsd_digest_init(ctx, alg);
+	if (len != alg->statelen || alg->restore(&ctx->u, buf) != 0) {
+		tsd_digest_init(ctx, alg);
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
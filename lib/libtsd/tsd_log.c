@@ -99,6 +99,7 @@ tsd_log(tsd_log_level_t level, const char *file, int line, const char *func,
 {
 	char *msgbuffer;
 	char timestr[32];
+	struct tm tm;
 	time_t now;
 	va_list ap;
 	int serrno;
@@ -134,7 +135,7 @@ tsd_log(tsd_log_level_t level, const char *file, int line, const char *func,
 	}
 	now = time(NULL);
 	strftime(timestr, sizeof timestr, "%Y-%m-%d %H:%M:%S UTC",
-		 gmtime(&now));
+		 gmtime_r(&now, &tm));
 #define LOGFMT "%s [%d] %s: %s:%d %s() %s\n"
 	if (tsd_log_file != NULL)
 		fprintf(tsd_log_file, LOGFMT, timestr, (int)getpid(),
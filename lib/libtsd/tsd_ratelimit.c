@@ -0,0 +1,250 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tsd/ratelimit.h>
+
+/*
+ * Parse a rate: a number of bytes per second, optionally followed by k,
+ * m or g for binary kilobytes, megabytes or gigabytes per second.
+ */
+static const char *
+tsd_ratelimit_parse_rate(const char *str, uint64_t *rate)
+{
+	uintmax_t n;
+	char *end;
+	int shift;
+
+	if (*str < '0' || *str > '9')
+		return (NULL);
+	n = strtoumax(str, &end, 10);
+	if (end == str)
+		return (NULL);
+	shift = 0;
+	switch (*end) {
+	case 'g':
+	case 'G':
+		shift += 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		shift += 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		shift += 10;
+		++end;
+		break;
+	}
+	if (n > UINT64_MAX >> shift)
+		return (NULL);
+	*rate = (uint64_t)n << shift;
+	return (end);
+}
+
+/*
+ * Parse a time of day in the form HH:MM into minutes past midnight.
+ */
+static const char *
+tsd_ratelimit_parse_time(const char *str, unsigned int *min)
+{
+	unsigned long h, m;
+	char *end;
+
+	if (*str < '0' || *str > '9')
+		return (NULL);
+	h = strtoul(str, &end, 10);
+	if (end == str || *end != ':' || h > 23)
+		return (NULL);
+	str = end + 1;
+	m = strtoul(str, &end, 10);
+	if (end != str + 2 || m > 59)
+		return (NULL);
+	*min = h * 60 + m;
+	return (end);
+}
+
+/*
+ * Parse a comma-separated list of rates, each of which is either a time
+ * window in the form HH:MM-HH:MM=rate, or a single rate which applies
+ * outside all windows.  The first matching window wins.  Windows may
+ * wrap around midnight.
+ */
+int
+tsd_ratelimit_parse(struct tsd_ratelimit *rl, const char *str)
+{
+	const char *p;
+	size_t len;
+	int haverate;
+
+	memset(rl, 0, sizeof *rl);
+	haverate = 0;
+	for (p = str; ; ++p) {
+		len = strcspn(p, ",");
+		if (memchr(p, '=', len) != NULL) {
+			if (rl->nwin == TSD_RATELIMIT_MAX_WINDOWS)
+				goto fail;
+			if ((p = tsd_ratelimit_parse_time(p,
+			    &rl->win[rl->nwin].start)) == NULL || *p++ != '-' ||
+			    (p = tsd_ratelimit_parse_time(p,
+			    &rl->win[rl->nwin].end)) == NULL || *p++ != '=' ||
+			    (p = tsd_ratelimit_parse_rate(p,
+			    &rl->win[rl->nwin].rate)) == NULL)
+				goto fail;
+			rl->nwin++;
+		} else {
+			if (haverate++ ||
+			    (p = tsd_ratelimit_parse_rate(p, &rl->rate)) == NULL)
+				goto fail;
+		}
+		if (*p == '\0')
+			return (0);
+		if (*p != ',')
+			goto fail;
+	}
+fail:
+	memset(rl, 0, sizeof *rl);
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Format a rate limit in a form tsd_ratelimit_parse() will accept.
+ */
+int
+tsd_ratelimit_format(const struct tsd_ratelimit *rl, char *buf, size_t size)
+{
+	unsigned int i;
+	size_t len;
+	int n;
+
+	for (i = 0, len = 0; i < rl->nwin; ++i, len += n) {
+		n = snprintf(buf + len, size - len, "%02u:%02u-%02u:%02u=%ju,",
+		    rl->win[i].start / 60, rl->win[i].start % 60,
+		    rl->win[i].end / 60, rl->win[i].end % 60,
+		    (uintmax_t)rl->win[i].rate);
+		if (n < 0 || (size_t)n >= size - len)
+			goto fail;
+	}
+	n = snprintf(buf + len, size - len, "%ju", (uintmax_t)rl->rate);
+	if (n < 0 || (size_t)n >= size - len)
+		goto fail;
+	return (0);
+fail:
+	errno = ENOSPC;
+	return (-1);
+}
+
+/*
+ * Divide a rate limit between n consumers.
+ */
+void
+tsd_ratelimit_scale(struct tsd_ratelimit *rl, unsigned int n)
+{
+	unsigned int i;
+
+	if (n <= 1)
+		return;
+	for (i = 0; i < rl->nwin; ++i)
+		if (rl->win[i].rate > 0 && (rl->win[i].rate /= n) == 0)
+			rl->win[i].rate = 1;
+	if (rl->rate > 0 && (rl->rate /= n) == 0)
+		rl->rate = 1;
+}
+
+/*
+ * Return the rate limit in effect at the given time.
+ */
+uint64_t
+tsd_ratelimit_rate(const struct tsd_ratelimit *rl, time_t when)
+{
+	struct tm tm;
+	unsigned int i, min;
+
+	if (rl->nwin == 0 || localtime_r(&when, &tm) == NULL)
+		return (rl->rate);
+	min = tm.tm_hour * 60 + tm.tm_min;
+	for (i = 0; i < rl->nwin; ++i) {
+		if (rl->win[i].start <= rl->win[i].end ?
+		    (min >= rl->win[i].start && min < rl->win[i].end) :
+		    (min >= rl->win[i].start || min < rl->win[i].end))
+			return (rl->win[i].rate);
+	}
+	return (rl->rate);
+}
+
+/*
+ * Account for len bytes of I/O, and sleep for as long as it takes for
+ * the bucket to cover it.  The bucket holds at most one second's worth
+ * of tokens, so a burst after an idle period is short; a transfer larger
+ * than that puts the bucket in debt, which later calls pay off.  If the
+ * sleep is interrupted by a signal, we return early and leave the rest
+ * of the debt for the next call.
+ */
+void
+tsd_ratelimit_consume(struct tsd_ratelimit *rl, size_t len)
+{
+	struct timespec now, ts;
+	double wait;
+	uint64_t rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((rate = tsd_ratelimit_rate(rl, time(NULL))) == 0) {
+		rl->tokens = 0;
+		rl->last = now;
+		return;
+	}
+	if (rl->last.tv_sec == 0 && rl->last.tv_nsec == 0) {
+		rl->tokens = rate;
+	} else {
+		rl->tokens += rate * ((now.tv_sec - rl->last.tv_sec) +
+		    (now.tv_nsec - rl->last.tv_nsec) / 1e9);
+		if (rl->tokens > rate)
+			rl->tokens = rate;
+	}
+	rl->last = now;
+	rl->tokens -= len;
+	if (rl->tokens < 0) {
+		wait = -rl->tokens / rate;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		(void)nanosleep(&ts, NULL);
+	}
+}
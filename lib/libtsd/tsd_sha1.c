@@ -42,34 +42,55 @@
 #include <endian.h>
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && HAVE_CPUID_H
+#define SHA1_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && HAVE_SYS_AUXV_H && HAVE_GETAUXVAL
+#define SHA1_ARMV8 1
+#include <arm_neon.h>
+#endif
+
 #include <tsd/bitwise.h>
+#include <tsd/cpu.h>
 #include <tsd/sha1.h>
 
-static uint32_t sha1_h[5] = {
+static const uint32_t sha1_h[5] = {
 	0x67452301U, 0xefcdab89U, 0x98badcfeU, 0x10325476U, 0xc3d2e1f0U,
 };
 
-static uint32_t sha1_k[4] = {
+static const uint32_t sha1_k[4] = {
 	0x5a827999U, 0x6ed9eba1U, 0x8f1bbcdcU, 0xca62c1d6U,
 };
 
-void
-sha1_init(sha1_ctx *ctx)
-{
+/*
+ * A compression function processes one or more consecutive 64-byte
+ * blocks.  Several implementations are available, depending on the
+ * platform; the best one supported by the CPU we are running on is
+ * selected the first time a context is initialized.
+ */
+typedef void (*sha1_compute_func)(uint32_t *, const uint8_t *, size_t);
 
-	memset(ctx, 0, sizeof *ctx);
-	memcpy(ctx->h, sha1_h, sizeof ctx->h);
-}
+struct sha1_impl {
+	const char		*name;
+	sha1_compute_func	 compute;
+	int			(*usable)(void);
+};
+
+static const struct sha1_impl *sha1_impl;
 
 #define sha1_ch(x, y, z)	((x & y) ^ (~x & z))
 #define sha1_parity(x, y, z)	((x ^ y ^ z))
 #define sha1_maj(x, y, z)	(((x & y) ^ (x & z) ^ (y & z)))
 #define sha1_step(t, a, f, e, w)					\
 	do {								\
-		uint32_t T = rol32(a, 5) + f + e + sha1_k[t/20] + w[t];	\
+		uint32_t T = rol32(a, 5) + f + e + w[t] +		\
+		    (addk ? sha1_k[t/20] : 0);				\
 		e = d;							\
 		d = c;							\
 		c = rol32(b, 30);					\
@@ -77,23 +98,23 @@ sha1_init(sha1_ctx *ctx)
 		a = T;							\
 	} while (0)
 
-static void
-sha1_compute(sha1_ctx *ctx, const uint8_t *block)
+/*
+ * Perform the 80 rounds on a message schedule.  The vector
+ * implementations add the round constants while computing the
+ * schedule; the generic one has them added here.  This must be inlined
+ * for the addk test to be resolved at compile time, and to keep the
+ * state in registers.
+ */
+static inline __attribute__((__always_inline__)) void
+sha1_rounds(uint32_t *h, const uint32_t *w, int addk)
 {
-	uint32_t w[80], a, b, c, d, e;
+	uint32_t a, b, c, d, e;
 
-	memcpy(w, block, 64);
-	for (int i = 0; i < 16; ++i)
-		w[i] = be32toh(w[i]);
-	for (int i = 16; i < 80; ++i) {
-		w[i] = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
-		w[i] = rol32(w[i], 1);
-	}
-	a = ctx->h[0];
-	b = ctx->h[1];
-	c = ctx->h[2];
-	d = ctx->h[3];
-	e = ctx->h[4];
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
 
 	sha1_step( 0, a, sha1_ch(b, c, d), e, w);
 	sha1_step( 1, a, sha1_ch(b, c, d), e, w);
@@ -179,11 +200,432 @@ sha1_compute(sha1_ctx *ctx, const uint8_t *block)
 	sha1_step(78, a, sha1_parity(b, c, d), e, w);
 	sha1_step(79, a, sha1_parity(b, c, d), e, w);
 
-	ctx->h[0] += a;
-	ctx->h[1] += b;
-	ctx->h[2] += c;
-	ctx->h[3] += d;
-	ctx->h[4] += e;
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+static void
+sha1_compute_generic(uint32_t *h, const uint8_t *block, size_t nblocks)
+{
+	uint32_t w[80];
+
+	for (; nblocks > 0; --nblocks, block += SHA1_BLOCK_LEN) {
+		memcpy(w, block, 64);
+		for (int i = 0; i < 16; ++i)
+			w[i] = be32toh(w[i]);
+		for (int i = 16; i < 80; ++i) {
+			w[i] = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+			w[i] = rol32(w[i], 1);
+		}
+		sha1_rounds(h, w, 1);
+	}
+}
+
+static int
+sha1_usable_generic(void)
+{
+
+	return (1);
+}
+
+#if SHA1_X86
+/*
+ * Message schedule using SSSE3, four words at a time.  The first 16
+ * words after the message itself depend on words in the same vector,
+ * which requires a fixup of the last lane; from word 32 on we use the
+ * equivalent recurrence
+ *
+ *   w[i] = (w[i-6] ^ w[i-16] ^ w[i-28] ^ w[i-32]) <<< 2
+ *
+ * which doesn't.
+ */
+__attribute__((target("ssse3")))
+static void
+sha1_schedule_ssse3(uint32_t *wk, const uint8_t *block)
+{
+	const __m128i bswap =
+	    _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i w[20], t, u;
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		w[i] = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(block + i * 16)), bswap);
+	for (i = 4; i < 8; ++i) {
+		t = _mm_xor_si128(_mm_srli_si128(w[i-1], 4), w[i-2]);
+		t = _mm_xor_si128(t, _mm_alignr_epi8(w[i-3], w[i-4], 8));
+		t = _mm_xor_si128(t, w[i-4]);
+		u = _mm_slli_si128(t, 12);
+		w[i] = _mm_or_si128(_mm_slli_epi32(t, 1), _mm_srli_epi32(t, 31));
+		u = _mm_or_si128(_mm_slli_epi32(u, 2), _mm_srli_epi32(u, 30));
+		w[i] = _mm_xor_si128(w[i], u);
+	}
+	for (i = 8; i < 20; ++i) {
+		t = _mm_xor_si128(_mm_alignr_epi8(w[i-1], w[i-2], 8), w[i-4]);
+		t = _mm_xor_si128(t, _mm_xor_si128(w[i-7], w[i-8]));
+		w[i] = _mm_or_si128(_mm_slli_epi32(t, 2), _mm_srli_epi32(t, 30));
+	}
+	for (i = 0; i < 20; ++i)
+		_mm_storeu_si128((__m128i *)(wk + i * 4),
+		    _mm_add_epi32(w[i], _mm_set1_epi32(sha1_k[i/5])));
+}
+
+__attribute__((target("ssse3")))
+static void
+sha1_compute_ssse3(uint32_t *h, const uint8_t *block, size_t nblocks)
+{
+	uint32_t wk[80];
+
+	for (; nblocks > 0; --nblocks, block += SHA1_BLOCK_LEN) {
+		sha1_schedule_ssse3(wk, block);
+		sha1_rounds(h, wk, 0);
+	}
+}
+
+static int
+sha1_usable_ssse3(void)
+{
+
+	return ((tsd_cpu_features() & TSD_CPU_SSSE3) != 0);
+}
+
+/*
+ * Message schedule using AVX2: the same algorithm as above, but
+ * working on two blocks at a time, one in each 128-bit lane.
+ */
+__attribute__((target("avx2")))
+static void
+sha1_schedule_avx2(uint32_t *wk0, uint32_t *wk1, const uint8_t *block)
+{
+	const __m256i bswap = _mm256_set_epi8(
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i w[20], t, u;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		t = _mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *)(block + i * 16)));
+		t = _mm256_inserti128_si256(t, _mm_loadu_si128(
+		    (const __m128i *)(block + SHA1_BLOCK_LEN + i * 16)), 1);
+		w[i] = _mm256_shuffle_epi8(t, bswap);
+	}
+	for (i = 4; i < 8; ++i) {
+		t = _mm256_xor_si256(_mm256_srli_si256(w[i-1], 4), w[i-2]);
+		t = _mm256_xor_si256(t, _mm256_alignr_epi8(w[i-3], w[i-4], 8));
+		t = _mm256_xor_si256(t, w[i-4]);
+		u = _mm256_slli_si256(t, 12);
+		w[i] = _mm256_or_si256(_mm256_slli_epi32(t, 1),
+		    _mm256_srli_epi32(t, 31));
+		u = _mm256_or_si256(_mm256_slli_epi32(u, 2),
+		    _mm256_srli_epi32(u, 30));
+		w[i] = _mm256_xor_si256(w[i], u);
+	}
+	for (i = 8; i < 20; ++i) {
+		t = _mm256_xor_si256(_mm256_alignr_epi8(w[i-1], w[i-2], 8),
+		    w[i-4]);
+		t = _mm256_xor_si256(t, _mm256_xor_si256(w[i-7], w[i-8]));
+		w[i] = _mm256_or_si256(_mm256_slli_epi32(t, 2),
+		    _mm256_srli_epi32(t, 30));
+	}
+	for (i = 0; i < 20; ++i) {
+		t = _mm256_add_epi32(w[i], _mm256_set1_epi32(sha1_k[i/5]));
+		_mm_storeu_si128((__m128i *)(wk0 + i * 4),
+		    _mm256_castsi256_si128(t));
+		_mm_storeu_si128((__m128i *)(wk1 + i * 4),
+		    _mm256_extracti128_si256(t, 1));
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+sha1_compute_avx2(uint32_t *h, const uint8_t *block, size_t nblocks)
+{
+	uint32_t wk0[80], wk1[80];
+
+	for (; nblocks >= 2; nblocks -= 2, block += 2 * SHA1_BLOCK_LEN) {
+		sha1_schedule_avx2(wk0, wk1, block);
+		sha1_rounds(h, wk0, 0);
+		sha1_rounds(h, wk1, 0);
+	}
+	if (nblocks > 0) {
+		sha1_schedule_ssse3(wk0, block);
+		sha1_rounds(h, wk0, 0);
+	}
+}
+
+static int
+sha1_usable_avx2(void)
+{
+	unsigned int features;
+
+	features = tsd_cpu_features();
+	return ((features & TSD_CPU_SSSE3) && (features & TSD_CPU_AVX2));
+}
+
+/*
+ * Intel SHA extensions.  Each group of four rounds is a single
+ * instruction, and the message schedule is computed by the sha1msg1,
+ * xor and sha1msg2 sequence three, two and one groups ahead of use.
+ */
+#define sha1ni_rnds(E, F, M, f)						\
+	do {								\
+		E = _mm_sha1nexte_epu32(E, M);				\
+		F = abcd;						\
+		abcd = _mm_sha1rnds4_epu32(abcd, E, f);			\
+	} while (0)
+#define sha1ni_group(E, F, M0, M1, M2, M3, f)				\
+	do {								\
+		sha1ni_rnds(E, F, M0, f);				\
+		M1 = _mm_sha1msg2_epu32(M1, M0);			\
+		M3 = _mm_sha1msg1_epu32(M3, M0);			\
+		M2 = _mm_xor_si128(M2, M0);				\
+	} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha1_compute_shani(uint32_t *h, const uint8_t *block, size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+	    0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e1, e_save, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+	e0 = _mm_set_epi32((int)h[4], 0, 0, 0);
+	for (; nblocks > 0; --nblocks, block += SHA1_BLOCK_LEN) {
+		abcd_save = abcd;
+		e_save = e0;
+
+		m0 = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(block + 0)), bswap);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(block + 16)), bswap);
+		sha1ni_rnds(e1, e0, m1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(block + 32)), bswap);
+		sha1ni_rnds(e0, e1, m2, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(
+		    _mm_loadu_si128((const __m128i *)(block + 48)), bswap);
+		sha1ni_rnds(e1, e0, m3, 0);
+		m0 = _mm_sha1msg2_epu32(m0, m3);
+		m2 = _mm_sha1msg1_epu32(m2, m3);
+		m1 = _mm_xor_si128(m1, m3);
+
+		sha1ni_group(e0, e1, m0, m1, m2, m3, 0);
+		sha1ni_group(e1, e0, m1, m2, m3, m0, 1);
+		sha1ni_group(e0, e1, m2, m3, m0, m1, 1);
+		sha1ni_group(e1, e0, m3, m0, m1, m2, 1);
+		sha1ni_group(e0, e1, m0, m1, m2, m3, 1);
+		sha1ni_group(e1, e0, m1, m2, m3, m0, 1);
+		sha1ni_group(e0, e1, m2, m3, m0, m1, 2);
+		sha1ni_group(e1, e0, m3, m0, m1, m2, 2);
+		sha1ni_group(e0, e1, m0, m1, m2, m3, 2);
+		sha1ni_group(e1, e0, m1, m2, m3, m0, 2);
+		sha1ni_group(e0, e1, m2, m3, m0, m1, 2);
+		sha1ni_group(e1, e0, m3, m0, m1, m2, 3);
+		sha1ni_group(e0, e1, m0, m1, m2, m3, 3);
+
+		sha1ni_rnds(e1, e0, m1, 3);
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		m3 = _mm_xor_si128(m3, m1);
+
+		sha1ni_rnds(e0, e1, m2, 3);
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+
+		sha1ni_rnds(e1, e0, m3, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+	h[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+static int
+sha1_usable_shani(void)
+{
+	unsigned int features;
+
+	features = tsd_cpu_features();
+	return ((features & TSD_CPU_SSSE3) && (features & TSD_CPU_SSE41) &&
+	    (features & TSD_CPU_SHA));
+}
+#endif
+
+#if SHA1_ARMV8
+/*
+ * ARMv8 cryptographic extensions.  As with the Intel SHA extensions,
+ * each group of four rounds is a single instruction; the message
+ * schedule is computed two groups ahead and the round constants added
+ * one group ahead of use.
+ */
+#if defined(__clang__)
+#define SHA1_ARMV8_TARGET "crypto"
+#else
+#define SHA1_ARMV8_TARGET "+crypto"
+#endif
+
+#define sha1_armv8_rnds(En, Ec, op, T)					\
+	do {								\
+		En = vsha1h_u32(vgetq_lane_u32(abcd, 0));		\
+		abcd = op(abcd, Ec, T);					\
+	} while (0)
+#define sha1_armv8_group(En, Ec, op, T, M0, M1, M2, M3, k)		\
+	do {								\
+		sha1_armv8_rnds(En, Ec, op, T);				\
+		T = vaddq_u32(M2, vdupq_n_u32(sha1_k[k]));		\
+		M3 = vsha1su1q_u32(M3, M2);				\
+		M0 = vsha1su0q_u32(M0, M1, M2);				\
+	} while (0)
+#define sha1_armv8_load(p)						\
+	vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)))
+
+__attribute__((target(SHA1_ARMV8_TARGET)))
+static void
+sha1_compute_armv8(uint32_t *h, const uint8_t *block, size_t nblocks)
+{
+	uint32x4_t abcd, abcd_save, m0, m1, m2, m3, t0, t1;
+	uint32_t e0, e1, e_save;
+
+	abcd = vld1q_u32(h);
+	e0 = h[4];
+	for (; nblocks > 0; --nblocks, block += SHA1_BLOCK_LEN) {
+		abcd_save = abcd;
+		e_save = e0;
+
+		m0 = sha1_armv8_load(block + 0);
+		m1 = sha1_armv8_load(block + 16);
+		m2 = sha1_armv8_load(block + 32);
+		m3 = sha1_armv8_load(block + 48);
+		t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[0]));
+		t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[0]));
+
+		sha1_armv8_rnds(e1, e0, vsha1cq_u32, t0);
+		t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[0]));
+		m0 = vsha1su0q_u32(m0, m1, m2);
+
+		sha1_armv8_group(e0, e1, vsha1cq_u32, t1, m1, m2, m3, m0, 0);
+		sha1_armv8_group(e1, e0, vsha1cq_u32, t0, m2, m3, m0, m1, 0);
+		sha1_armv8_group(e0, e1, vsha1cq_u32, t1, m3, m0, m1, m2, 1);
+		sha1_armv8_group(e1, e0, vsha1cq_u32, t0, m0, m1, m2, m3, 1);
+		sha1_armv8_group(e0, e1, vsha1pq_u32, t1, m1, m2, m3, m0, 1);
+		sha1_armv8_group(e1, e0, vsha1pq_u32, t0, m2, m3, m0, m1, 1);
+		sha1_armv8_group(e0, e1, vsha1pq_u32, t1, m3, m0, m1, m2, 1);
+		sha1_armv8_group(e1, e0, vsha1pq_u32, t0, m0, m1, m2, m3, 2);
+		sha1_armv8_group(e0, e1, vsha1pq_u32, t1, m1, m2, m3, m0, 2);
+		sha1_armv8_group(e1, e0, vsha1mq_u32, t0, m2, m3, m0, m1, 2);
+		sha1_armv8_group(e0, e1, vsha1mq_u32, t1, m3, m0, m1, m2, 2);
+		sha1_armv8_group(e1, e0, vsha1mq_u32, t0, m0, m1, m2, m3, 2);
+		sha1_armv8_group(e0, e1, vsha1mq_u32, t1, m1, m2, m3, m0, 3);
+		sha1_armv8_group(e1, e0, vsha1mq_u32, t0, m2, m3, m0, m1, 3);
+		sha1_armv8_group(e0, e1, vsha1pq_u32, t1, m3, m0, m1, m2, 3);
+
+		sha1_armv8_rnds(e1, e0, vsha1pq_u32, t0);
+		t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[3]));
+		m3 = vsha1su1q_u32(m3, m2);
+
+		sha1_armv8_rnds(e0, e1, vsha1pq_u32, t1);
+		t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[3]));
+
+		sha1_armv8_rnds(e1, e0, vsha1pq_u32, t0);
+		sha1_armv8_rnds(e0, e1, vsha1pq_u32, t1);
+
+		e0 += e_save;
+		abcd = vaddq_u32(abcd, abcd_save);
+	}
+	vst1q_u32(h, abcd);
+	h[4] = e0;
+}
+
+static int
+sha1_usable_armv8(void)
+{
+
+	return ((tsd_cpu_features() & TSD_CPU_ARMV8_SHA1) != 0);
+}
+#endif
+
+/* in order of preference */
+static const struct sha1_impl sha1_impls[] = {
+#if SHA1_X86
+	{ "sha-ni",	sha1_compute_shani,	sha1_usable_shani },
+	{ "avx2",	sha1_compute_avx2,	sha1_usable_avx2 },
+	{ "ssse3",	sha1_compute_ssse3,	sha1_usable_ssse3 },
+#endif
+#if SHA1_ARMV8
+	{ "armv8",	sha1_compute_armv8,	sha1_usable_armv8 },
+#endif
+	{ "generic",	sha1_compute_generic,	sha1_usable_generic },
+};
+
+/*
+ * Select an implementation by name, or the best one available if name
+ * is NULL.
+ */
+int
+sha1_select(const char *name)
+{
+	const struct sha1_impl *impl;
+	unsigned int i;
+
+	for (i = 0; i < sizeof sha1_impls / sizeof sha1_impls[0]; ++i) {
+		impl = &sha1_impls[i];
+		if (name != NULL && strcmp(name, impl->name) != 0)
+			continue;
+		if (!impl->usable()) {
+			if (name == NULL)
+				continue;
+			errno = ENOTSUP;
+			return (-1);
+		}
+		__atomic_store_n(&sha1_impl, impl, __ATOMIC_RELAXED);
+		return (0);
+	}
+	errno = ENOENT;
+	return (-1);
+}
+
+const char *
+sha1_implementation(void)
+{
+	const struct sha1_impl *impl;
+
+	if ((impl = __atomic_load_n(&sha1_impl, __ATOMIC_RELAXED)) == NULL) {
+		sha1_select(NULL);
+		impl = __atomic_load_n(&sha1_impl, __ATOMIC_RELAXED);
+	}
+	return (impl->name);
+}
+
+static inline void
+sha1_compute(sha1_ctx *ctx, const uint8_t *block, size_t nblocks)
+{
+	const struct sha1_impl *impl;
+
+	impl = __atomic_load_n(&sha1_impl, __ATOMIC_RELAXED);
+	impl->compute(ctx->h, block, nblocks);
+}
+
+void
+sha1_init(sha1_ctx *ctx)
+{
+
+	if (__atomic_load_n(&sha1_impl, __ATOMIC_RELAXED) == NULL)
+		sha1_select(NULL);
+	memset(ctx, 0, sizeof *ctx);
+	memcpy(ctx->h, sha1_h, sizeof ctx->h);
 }
 
 void
@@ -199,13 +641,14 @@ sha1_update(sha1_ctx *ctx, const void *buf, size_t len)
 			memcpy(ctx->block + ctx->blocklen, buf, copylen);
 			ctx->blocklen += copylen;
 			if (ctx->blocklen == sizeof ctx->block) {
-				sha1_compute(ctx, ctx->block);
+				sha1_compute(ctx, ctx->block, 1);
 				ctx->blocklen = 0;
 				memset(ctx->block, 0, sizeof ctx->block);
 			}
 		} else {
-			copylen = sizeof ctx->block;
-			sha1_compute(ctx, buf);
+			/* hash as many whole blocks as we can in one go */
+			copylen = len - len % sizeof ctx->block;
+			sha1_compute(ctx, buf, copylen / sizeof ctx->block);
 		}
 		ctx->bitlen += copylen * 8;
 		buf += copylen;
@@ -220,7 +663,7 @@ sha1_final(sha1_ctx *ctx, uint8_t *digest)
 
 	ctx->block[ctx->blocklen++] = 0x80;
 	if (ctx->blocklen > 56) {
-		sha1_compute(ctx, ctx->block);
+		sha1_compute(ctx, ctx->block, 1);
 		ctx->blocklen = 0;
 		memset(ctx->block, 0, sizeof ctx->block);
 	}
@@ -229,7 +672,7 @@ sha1_final(sha1_ctx *ctx, uint8_t *digest)
 	memcpy(ctx->block + 56, &hi, 4);
 	memcpy(ctx->block + 60, &lo, 4);
 	ctx->blocklen = 64;
-	sha1_compute(ctx, ctx->block);
+	sha1_compute(ctx, ctx->block, 1);
 	for (int i = 0; i < 5; ++i)
 		ctx->h[i] = htobe32(ctx->h[i]);
 	memcpy(digest, ctx->h, 20);
@@ -0,0 +1,176 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if HAVE_SYS_ENDIAN_H
+#include <sys/endian.h>
+#endif
+
+#if HAVE_ENDIAN_H
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#include <endian.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <tsd/bitwise.h>
+#include <tsd/sha256.h>
+
+static const uint32_t sha256_h[8] = {
+	0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU,
+	0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U,
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98U, 0x71374491U, 0xb5c0fbcfU, 0xe9b5dba5U,
+	0x3956c25bU, 0x59f111f1U, 0x923f82a4U, 0xab1c5ed5U,
+	0xd807aa98U, 0x12835b01U, 0x243185beU, 0x550c7dc3U,
+	0x72be5d74U, 0x80deb1feU, 0x9bdc06a7U, 0xc19bf174U,
+	0xe49b69c1U, 0xefbe4786U, 0x0fc19dc6U, 0x240ca1ccU,
+	0x2de92c6fU, 0x4a7484aaU, 0x5cb0a9dcU, 0x76f988daU,
+	0x983e5152U, 0xa831c66dU, 0xb00327c8U, 0xbf597fc7U,
+	0xc6e00bf3U, 0xd5a79147U, 0x06ca6351U, 0x14292967U,
+	0x27b70a85U, 0x2e1b2138U, 0x4d2c6dfcU, 0x53380d13U,
+	0x650a7354U, 0x766a0abbU, 0x81c2c92eU, 0x92722c85U,
+	0xa2bfe8a1U, 0xa81a664bU, 0xc24b8b70U, 0xc76c51a3U,
+	0xd192e819U, 0xd6990624U, 0xf40e3585U, 0x106aa070U,
+	0x19a4c116U, 0x1e376c08U, 0x2748774cU, 0x34b0bcb5U,
+	0x391c0cb3U, 0x4ed8aa4aU, 0x5b9cca4fU, 0x682e6ff3U,
+	0x748f82eeU, 0x78a5636fU, 0x84c87814U, 0x8cc70208U,
+	0x90befffaU, 0xa4506cebU, 0xbef9a3f7U, 0xc67178f2U,
+};
+
+void
+sha256_init(sha256_ctx *ctx)
+{
+
+	memset(ctx, 0, sizeof *ctx);
+	memcpy(ctx->h, sha256_h, sizeof ctx->h);
+}
+
+#define sha256_ch(x, y, z)	((x & y) ^ (~x & z))
+#define sha256_maj(x, y, z)	((x & y) ^ (x & z) ^ (y & z))
+#define sha256_S0(x)		(ror32(x, 2) ^ ror32(x, 13) ^ ror32(x, 22))
+#define sha256_S1(x)		(ror32(x, 6) ^ ror32(x, 11) ^ ror32(x, 25))
+#define sha256_s0(x)		(ror32(x, 7) ^ ror32(x, 18) ^ (x >> 3))
+#define sha256_s1(x)		(ror32(x, 17) ^ ror32(x, 19) ^ (x >> 10))
+
+static void
+sha256_compute(sha256_ctx *ctx, const uint8_t *block)
+{
+	uint32_t w[64], s[8], T1, T2;
+
+	memcpy(w, block, 64);
+	for (int i = 0; i < 16; ++i)
+		w[i] = be32toh(w[i]);
+	for (int i = 16; i < 64; ++i)
+		w[i] = sha256_s1(w[i-2]) + w[i-7] +
+		    sha256_s0(w[i-15]) + w[i-16];
+	memcpy(s, ctx->h, sizeof s);
+	for (int i = 0; i < 64; ++i) {
+		T1 = s[7] + sha256_S1(s[4]) + sha256_ch(s[4], s[5], s[6]) +
+		    sha256_k[i] + w[i];
+		T2 = sha256_S0(s[0]) + sha256_maj(s[0], s[1], s[2]);
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + T1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = T1 + T2;
+	}
+	for (int i = 0; i < 8; ++i)
+		ctx->h[i] += s[i];
+}
+
+void
+sha256_update(sha256_ctx *ctx, const void *buf, size_t len)
+{
+	size_t copylen;
+
+	while (len) {
+		if (ctx->blocklen > 0 || len < sizeof ctx->block) {
+			copylen = sizeof ctx->block - ctx->blocklen;
+			if (copylen > len)
+				copylen = len;
+			memcpy(ctx->block + ctx->blocklen, buf, copylen);
+			ctx->blocklen += copylen;
+			if (ctx->blocklen == sizeof ctx->block) {
+				sha256_compute(ctx, ctx->block);
+				ctx->blocklen = 0;
+				memset(ctx->block, 0, sizeof ctx->block);
+			}
+		} else {
+			copylen = sizeof ctx->block;
+			sha256_compute(ctx, buf);
+		}
+		ctx->bitlen += copylen * 8;
+		buf += copylen;
+		len -= copylen;
+	}
+}
+
+void
+sha256_final(sha256_ctx *ctx, uint8_t *digest)
+{
+	uint32_t hi, lo;
+
+	ctx->block[ctx->blocklen++] = 0x80;
+	if (ctx->blocklen > 56) {
+		sha256_compute(ctx, ctx->block);
+		ctx->blocklen = 0;
+		memset(ctx->block, 0, sizeof ctx->block);
+	}
+	hi = htobe32(ctx->bitlen >> 32);
+	lo = htobe32(ctx->bitlen & 0xffffffffUL);
+	memcpy(ctx->block + 56, &hi, 4);
+	memcpy(ctx->block + 60, &lo, 4);
+	ctx->blocklen = 64;
+	sha256_compute(ctx, ctx->block);
+	for (int i = 0; i < 8; ++i)
+		ctx->h[i] = htobe32(ctx->h[i]);
+	memcpy(digest, ctx->h, 32);
+	memset(ctx, 0, sizeof *ctx);
+}
+
+void
+sha256_complete(const void *buf, size_t len, uint8_t *digest)
+{
+	sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, len);
+	sha256_final(&ctx, digest);
+}
@@ -0,0 +1,143 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <tsd/stat.h>
+
+#if HAVE_STATX
+/* set if statx() turns out not to be implemented */
+static int tsd_stat_nostatx;
+
+/*
+ * Translate our flags into statx() flags.
+ */
+int
+tsd_statx_flags(int flags)
+{
+	int xflags;
+
+	xflags = AT_STATX_SYNC_AS_STAT;
+	if (flags & TSD_STAT_NOFOLLOW)
+		xflags |= AT_SYMLINK_NOFOLLOW;
+	if (flags & TSD_STAT_CACHED)
+		xflags |= AT_STATX_DONT_SYNC;
+	return (xflags);
+}
+
+/*
+ * Translate our attribute mask into a statx() mask.
+ */
+unsigned int
+tsd_statx_mask(unsigned int mask)
+{
+	unsigned int xmask;
+
+	xmask = 0;
+	if (mask & TSD_STAT_TYPE)
+		xmask |= STATX_TYPE;
+	if (mask & TSD_STAT_MODE)
+		xmask |= STATX_MODE;
+	if (mask & TSD_STAT_OWNER)
+		xmask |= STATX_UID | STATX_GID;
+	if (mask & TSD_STAT_SIZE)
+		xmask |= STATX_SIZE;
+	if (mask & TSD_STAT_ATIME)
+		xmask |= STATX_ATIME;
+	if (mask & TSD_STAT_MTIME)
+		xmask |= STATX_MTIME;
+	if (mask & TSD_STAT_INO)
+		xmask |= STATX_INO;
+	return (xmask);
+}
+
+/*
+ * Copy the result of a statx() call into a struct stat.
+ */
+void
+tsd_statx_to_stat(const struct statx *stx, struct stat *st)
+{
+
+	memset(st, 0, sizeof *st);
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+#endif
+
+/*
+ * Retrieve the requested attributes of a file, relative to a directory
+ * descriptor as with fstatat(), and store them in a struct stat.  Where
+ * statx() is available, only the requested attributes are retrieved,
+ * which saves the file system some work, and if the caller allows it,
+ * cached attributes are used instead of asking the server for fresh
+ * ones on network file systems.  Fields which were not requested may or
+ * may not be filled in.
+ */
+int
+tsd_stat(int dfd, const char *path, int flags, unsigned int mask,
+    struct stat *st)
+{
+#if HAVE_STATX
+	struct statx stx;
+
+	if (!tsd_stat_nostatx) {
+		if (statx(dfd, path, tsd_statx_flags(flags),
+		    tsd_statx_mask(mask), &stx) == 0) {
+			tsd_statx_to_stat(&stx, st);
+			return (0);
+		}
+		if (errno != ENOSYS)
+			return (-1);
+		tsd_stat_nostatx = 1;
+	}
+#else
+	(void)mask;
+#endif
+	return (fstatat(dfd, path, st,
+	    (flags & TSD_STAT_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0));
+}
@@ -0,0 +1,506 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tsd/uring.h>
+
+/*
+ * Minimal io_uring(7) support, using the raw system calls so we don't
+ * depend on liburing.  A ring is meant to be used by a single thread.
+ * The caller queues up a number of requests, each tagged with an
+ * arbitrary 64-bit value, submits them, and then reaps the completions,
+ * which may arrive in any order.
+ */
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct tsd_uring {
+	int			 fd;
+	unsigned int		 entries;
+	unsigned int		 supported;
+
+	/* submission queue */
+	void			*sq_ring;
+	size_t			 sq_ringsz;
+	unsigned int		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqesz;
+	unsigned int		 sq_queued;
+
+	/* completion queue */
+	void			*cq_ring;
+	size_t			 cq_ringsz;
+	unsigned int		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* submitted but not yet reaped */
+	unsigned int		 inflight;
+};
+
+static const int tsd_uring_opcode[] = {
+	[TSD_URING_READ]	= IORING_OP_READ,
+	[TSD_URING_WRITE]	= IORING_OP_WRITE,
+	[TSD_URING_STATX]	= IORING_OP_STATX,
+	[TSD_URING_OPENAT]	= IORING_OP_OPENAT,
+};
+#define TSD_URING_NOPS (sizeof tsd_uring_opcode / sizeof tsd_uring_opcode[0])
+
+/*
+ * Ask the kernel which of the operations we know about it supports.
+ */
+static void
+tsd_uring_probe(struct tsd_uring *ur)
+{
+	struct io_uring_probe *probe;
+	size_t sz;
+	unsigned int i;
+	int op;
+
+	ur->supported = 0;
+	sz = sizeof *probe + 256 * sizeof probe->ops[0];
+	if ((probe = calloc(1, sz)) == NULL)
+		return;
+	if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PROBE,
+	    probe, 256) == 0) {
+		for (i = 0; i < TSD_URING_NOPS; ++i) {
+			op = tsd_uring_opcode[i];
+			if (op <= probe->last_op &&
+			    (probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				ur->supported |= 1U << i;
+		}
+	}
+	free(probe);
+}
+
+/*
+ * Set up a ring which can hold the specified number of requests.
+ */
+struct tsd_uring *
+tsd_uring_create(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct tsd_uring *ur;
+	int serrno;
+
+	if (entries == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((ur = calloc(1, sizeof *ur)) == NULL)
+		return (NULL);
+	ur->sq_ring = ur->cq_ring = ur->sqes = MAP_FAILED;
+	memset(&p, 0, sizeof p);
+	if ((ur->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		goto fail;
+	ur->entries = p.sq_entries;
+
+	/* map the rings, which may share a single mapping */
+	ur->sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_ringsz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ringsz > ur->sq_ringsz)
+			ur->sq_ringsz = ur->cq_ringsz;
+		ur->cq_ringsz = ur->sq_ringsz;
+	}
+	ur->sq_ring = mmap(NULL, ur->sq_ringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = mmap(NULL, ur->cq_ringsz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	ur->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqesz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		goto fail;
+
+	ur->sq_head = (unsigned int *)((char *)ur->sq_ring + p.sq_off.head);
+	ur->sq_tail = (unsigned int *)((char *)ur->sq_ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)((char *)ur->sq_ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *)((char *)ur->sq_ring + p.sq_off.array);
+	ur->cq_head = (unsigned int *)((char *)ur->cq_ring + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)((char *)ur->cq_ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)((char *)ur->cq_ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ring + p.cq_off.cqes);
+	ur->sq_queued = *ur->sq_tail;
+
+	tsd_uring_probe(ur);
+	return (ur);
+fail:
+	serrno = errno;
+	tsd_uring_destroy(ur);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Tear down a ring, after waiting for any requests still in flight,
+ * since closing the ring does not stop those the kernel has already
+ * started from reading or writing the memory they refer to.
+ */
+void
+tsd_uring_destroy(struct tsd_uring *ur)
+{
+	int serrno;
+
+	if (ur == NULL)
+		return;
+	serrno = errno;
+	(void)tsd_uring_drain(ur);
+	if (ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqesz);
+	if (ur->cq_ring != MAP_FAILED && ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ringsz);
+	if (ur->sq_ring != MAP_FAILED)
+		munmap(ur->sq_ring, ur->sq_ringsz);
+	if (ur->fd >= 0)
+		close(ur->fd);
+	free(ur);
+	errno = serrno;
+}
+
+/*
+ * Return non-zero if the kernel supports the specified operation.
+ */
+int
+tsd_uring_supported(const struct tsd_uring *ur, enum tsd_uring_op op)
+{
+
+	return ((unsigned int)op < TSD_URING_NOPS &&
+	    (ur->supported & (1U << op)) != 0);
+}
+
+/*
+ * Grab a free submission queue entry.  We never allow more requests to
+ * be outstanding than the submission queue can hold, which guarantees
+ * that the completion queue, which is at least twice as large, never
+ * overflows.
+ */
+static struct io_uring_sqe *
+tsd_uring_sqe(struct tsd_uring *ur, enum tsd_uring_op op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx, queued;
+
+	if (!tsd_uring_supported(ur, op)) {
+		errno = EOPNOTSUPP;
+		return (NULL);
+	}
+	queued = ur->sq_queued - load_acquire(ur->sq_head);
+	if (queued + ur->inflight >= ur->entries) {
+		errno = EBUSY;
+		return (NULL);
+	}
+	idx = ur->sq_queued & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = tsd_uring_opcode[op];
+	ur->sq_array[idx] = idx;
+	ur->sq_queued++;
+	return (sqe);
+}
+
+/*
+ * Queue a read of up to len bytes at the specified offset.
+ */
+int
+tsd_uring_read(struct tsd_uring *ur, int fd, void *buf, size_t len,
+    off_t off, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = tsd_uring_sqe(ur, TSD_URING_READ)) == NULL)
+		return (-1);
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = ud;
+	return (0);
+}
+
+/*
+ * Queue a write of len bytes at the specified offset.
+ */
+int
+tsd_uring_write(struct tsd_uring *ur, int fd, const void *buf, size_t len,
+    off_t off, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = tsd_uring_sqe(ur, TSD_URING_WRITE)) == NULL)
+		return (-1);
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = ud;
+	return (0);
+}
+
+/*
+ * Queue a statx(2) call.
+ */
+int
+tsd_uring_statx(struct tsd_uring *ur, int dd, const char *path, int flags,
+    unsigned int mask, struct statx *stx, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = tsd_uring_sqe(ur, TSD_URING_STATX)) == NULL)
+		return (-1);
+	sqe->fd = dd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mask;
+	sqe->off = (uintptr_t)stx;
+	sqe->statx_flags = flags;
+	sqe->user_data = ud;
+	return (0);
+}
+
+/*
+ * Queue an openat(2) call.  The result is the new file descriptor.
+ */
+int
+tsd_uring_openat(struct tsd_uring *ur, int dd, const char *path, int flags,
+    mode_t mode, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = tsd_uring_sqe(ur, TSD_URING_OPENAT)) == NULL)
+		return (-1);
+	sqe->fd = dd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	sqe->user_data = ud;
+	return (0);
+}
+
+/*
+ * Submit all queued requests and wait until at least the specified
+ * number of completions are available.  Returns the number of requests
+ * submitted.
+ */
+int
+tsd_uring_submit(struct tsd_uring *ur, unsigned int wait)
+{
+	unsigned int consumed, head, flags, submitted;
+	int ret;
+
+	store_release(ur->sq_tail, ur->sq_queued);
+	flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+	submitted = 0;
+	for (;;) {
+		head = load_acquire(ur->sq_head);
+		ret = syscall(__NR_io_uring_enter, ur->fd, ur->sq_queued - head,
+		    wait, flags, NULL, 0);
+		if (ret >= 0) {
+			ur->inflight += ret;
+			submitted += ret;
+			break;
+		}
+		if (errno != EINTR)
+			return (-1);
+		/* requests may have been consumed before we were interrupted */
+		consumed = load_acquire(ur->sq_head) - head;
+		ur->inflight += consumed;
+		submitted += consumed;
+	}
+	return ((int)submitted);
+}
+
+/*
+ * Retrieve the next completion, if there is one.  Returns 1 and sets
+ * *ud to the request's tag and *res to its result (a negative errno on
+ * failure), or 0 if no completions are available.
+ */
+int
+tsd_uring_reap(struct tsd_uring *ur, uint64_t *ud, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ur->cq_head;
+	if (head == load_acquire(ur->cq_tail))
+		return (0);
+	cqe = &ur->cqes[head & *ur->cq_mask];
+	*ud = cqe->user_data;
+	*res = cqe->res;
+	store_release(ur->cq_head, head + 1);
+	ur->inflight--;
+	return (1);
+}
+
+/*
+ * Wait for all submitted requests to complete and discard their
+ * results, so the memory they refer to can be released or reused.
+ * Requests which were queued but never submitted are not submitted.
+ * This is meant for error paths, where the caller has given up on the
+ * results.
+ */
+int
+tsd_uring_drain(struct tsd_uring *ur)
+{
+	uint64_t ud;
+	int res;
+
+	while (ur->inflight > 0) {
+		if (tsd_uring_reap(ur, &ud, &res) == 1)
+			continue;
+		if (syscall(__NR_io_uring_enter, ur->fd, 0, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			return (-1);
+	}
+	return (0);
+}
+
+#else
+
+struct tsd_uring *
+tsd_uring_create(unsigned int entries)
+{
+
+	(void)entries;
+	errno = ENOSYS;
+	return (NULL);
+}
+
+void
+tsd_uring_destroy(struct tsd_uring *ur)
+{
+
+	(void)ur;
+}
+
+int
+tsd_uring_drain(struct tsd_uring *ur)
+{
+
+	(void)ur;
+	return (0);
+}
+
+int
+tsd_uring_supported(const struct tsd_uring *ur, enum tsd_uring_op op)
+{
+
+	(void)ur;
+	(void)op;
+	return (0);
+}
+
+int
+tsd_uring_read(struct tsd_uring *ur, int fd, void *buf, size_t len,
+    off_t off, uint64_t ud)
+{
+
+	(void)ur, (void)fd, (void)buf, (void)len, (void)off, (void)ud;
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+tsd_uring_write(struct tsd_uring *ur, int fd, const void *buf, size_t len,
+    off_t off, uint64_t ud)
+{
+
+	(void)ur, (void)fd, (void)buf, (void)len, (void)off, (void)ud;
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+tsd_uring_statx(struct tsd_uring *ur, int dd, const char *path, int flags,
+    unsigned int mask, struct statx *stx, uint64_t ud)
+{
+
+	(void)ur, (void)dd, (void)path, (void)flags, (void)mask, (void)stx;
+	(void)ud;
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+tsd_uring_openat(struct tsd_uring *ur, int dd, const char *path, int flags,
+    mode_t mode, uint64_t ud)
+{
+
+	(void)ur, (void)dd, (void)path, (void)flags, (void)mode, (void)ud;
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+tsd_uring_submit(struct tsd_uring *ur, unsigned int wait)
+{
+
+	(void)ur, (void)wait;
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+tsd_uring_reap(struct tsd_uring *ur, uint64_t *ud, int *res)
+{
+
+	(void)ur, (void)ud, (void)res;
+	return (0);
+}
+
+#endif
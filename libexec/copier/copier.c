@@ -32,19 +32,45 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
 #if HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
 #else
 #undef HAVE_STATVFS
 #endif
 
+#if HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#else
+#undef HAVE_FSTATFS
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#else
+#undef HAVE_INOTIFY_INIT1
+#endif
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#undef HAVE_PTHREAD_CREATE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
@@ -55,52 +81,265 @@
 #include <unistd.h>
 
 #include <tsd/assert.h>
+#include <tsd/blake3.h>
+#include <tsd/digest.h>
 #include <tsd/log.h>
 #include <tsd/percent.h>
+#include <tsd/ratelimit.h>
 #include <tsd/sha1.h>
 #include <tsd/strutil.h>
+#include <tsd/uring.h>
+
+#include "copier_manifest.h"
 
+static int tsdfx_check;
+static int tsdfx_direct;
 static int tsdfx_dryrun;
 static int tsdfx_force;
+static int tsdfx_hugetlb;
+static int tsdfx_kcopy;
+static unsigned int tsdfx_qdepth;
+static size_t tsdfx_blocksize;
+static const struct tsd_digest_alg *tsdfx_digest;
+static const char *tsdfx_statedir;
+
+/* page cache policy */
+#define CACHE_SEQUENTIAL	0x01	/* advise sequential access */
+#define CACHE_DONTNEED		0x02	/* drop pages behind the cursor */
+#define CACHE_READAHEAD		0x04	/* explicitly read ahead */
+static int tsdfx_cache = CACHE_SEQUENTIAL;
 
 static mode_t mumask;
 
-/* XXX make these configurable */
+/* byte rate limits for reading the source, all of which apply */
+#define MAX_RATELIMITS 4
+static struct tsd_ratelimit tsdfx_ratelimit[MAX_RATELIMITS];
+static unsigned int tsdfx_nratelimits;
 
-/* how much to attempt to copy at a time */
+/* what a dry run found: bytes to write, bytes compared, time spent */
+static struct copyplan {
+	uintmax_t	 len;
+	uintmax_t	 size;
+	struct timeval	 tv;
+} copyplan;
+
+/*
+ * How much to attempt to copy at a time: by default, and the range
+ * within which we adjust it to suit the file and the file system.
+ */
 #define BLOCKSIZE	(1024*1024)
+#define MIN_BLOCKSIZE	(4*1024)
+#define MAX_BLOCKSIZE	(64*1024*1024)
+
+/* upper limit for the amount of memory used by the copy pipeline */
+#define MAX_RING	(256*1024*1024)
 
 /* how long (in seconds) to wait after a file was last modified */
 #define MIN_AGE		6
 
+/* how many blocks can be in flight in the copy pipeline */
+#define NBLOCKS		4
+
+/* upper limit for the io_uring queue depth */
+#define MAX_QDEPTH	64
+
+/* largest hole handed to the pipeline as a single block */
+#define MAX_HOLE	(1024*(off_t)BLOCKSIZE)
+
+/* alignment of buffers, offsets and lengths for direct I/O */
+#define DIO_ALIGN	4096
+#define DIO_ALIGNED(x)	(((uintptr_t)(x) & (DIO_ALIGN - 1)) == 0)
+
+/* smallest file for which we keep a block manifest */
+#define MANIFEST_MIN	(16*(off_t)1024*1024)
+
+#ifndef OFF_MAX
+#define OFF_MAX		((off_t)INT64_MAX)
+#endif
+
 struct copyfile {
 	char		 name[PATH_MAX];
 	char		*pname;
 	int		 fd;
+	int		 dfd;		/* for direct I/O, or -1 */
+	int		 ifd;		/* inotify, -1 if unused, -2 if n/a */
+	int		 quiescent;	/* a writer has closed the file */
 	int		 mode;
 	struct stat	 st;
 	struct timeval	 tvo, tvf, tve;
-	sha1_ctx	 sha_ctx;
-	uint8_t		 digest[SHA1_DIGEST_LEN];
+	tsd_digest_ctx	 digest_ctx;
+	uint8_t		 digest[TSD_DIGEST_MAX_LEN];
 	off_t		 offset;
+	off_t		 dataend;
+	off_t		 flushed;	/* writeback started up to here */
+	off_t		 dropped;	/* cache dropped up to here */
 	size_t		 bufsize, buflen;
-	char		 buf[];
+	char		*buf;
+#if HAVE_STATX
+	struct statx	 stx;
+#endif
+};
+
+/*
+ * A block on its way through the copy pipeline.  The main thread reads
+ * the source and destination data and compares them, then hands the
+ * block over to the hash and write stages, which process it
+ * independently of each other.  Once both are done with it, the block
+ * can be reused.
+ */
+struct copyblock {
+	off_t		 offset;
+	size_t		 len;
+	int		 write;
+#define CB_WRITE	1	/* write dbuf to the destination */
+#define CB_KCOPY	2	/* have the kernel copy it */
+#define CB_HOLE		3	/* hole, nothing to write */
+#define CB_PUNCH	4	/* hole, punch it in the destination */
+	char		*sbuf;
+	char		*dbuf;
+	int		 digested;	/* digest holds the block digest */
+	uint8_t		 digest[TSD_DIGEST_MAX_LEN];
+};
+
+/*
+ * The copy pipeline.  Blocks are numbered in the order in which they
+ * are read and occupy slot (number % nblocks) in the ring.  Each stage
+ * processes blocks in order and counts how many it has completed, so a
+ * slot is free when both stages have moved past it.
+ *
+ * For files larger than one block, the hash and write stages run in
+ * their own threads so that reading, hashing and writing overlap.
+ * Otherwise, or if threads are unavailable, they run synchronously.
+ */
+struct copypipe {
+	struct copyfile		*src, *dst;
+	struct copyblock	*block;
+	size_t			 blocksize;
+	unsigned int		 nblocks;
+	struct copier_manifest	*manifest;
+	char			*spare;		/* for the read-ahead */
+	unsigned int		 nspare;
+	unsigned long		 nread, nhashed, nwritten;
+	int			 done;
+	int			 error;
+#if HAVE_PTHREAD_CREATE
+	int			 threaded;
+	pthread_t		 hasher, writer;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+#endif
+};
+
+typedef int (copystage_func)(struct copypipe *, const struct copyblock *);
+
+/*
+ * Source reads issued ahead of the main loop when using io_uring.  Up
+ * to depth reads of consecutive blocks, starting with the one at the
+ * current source offset, are kept in flight, each into a spare buffer
+ * of its own.  When the main loop gets to a block, the buffer it was
+ * read into is exchanged with the source buffer of the pipeline block,
+ * which then becomes the spare for a later read.
+ */
+struct copyahead {
+	unsigned int		 depth;
+	unsigned int		 head, count;
+	struct {
+		char		*buf;
+		off_t		 offset;
+		int		 res;
+		int		 done;
+	}			 slot[MAX_QDEPTH];
 };
 
+/* read-ahead requests are tagged with their slot number plus this */
+#define UD_AHEAD	4
+
+static char *copybuf_get(size_t);
+
 static struct copyfile *copyfile_open(const char *, int, int);
+static size_t copyfile_blocksize(struct copyfile *, struct copyfile *);
+static int copyfile_direct(struct copyfile *);
+static int copyfile_iofd(const struct copyfile *, const void *, off_t,
+    size_t);
 static int copyfile_refresh(struct copyfile *);
+static int copyfile_restat(struct copyfile *, const struct stat *);
 static int copyfile_read(struct copyfile *);
+static void copyfile_advise(struct copyfile *);
+static void copyfile_readahead(struct copyfile *, off_t, size_t);
+static void copyfile_dropbehind(struct copyfile *, off_t);
+#if HAVE_DECL_SEEK_HOLE
+static off_t copyfile_hole(struct copyfile *);
+#endif
 static int copyfile_compare(struct copyfile *, struct copyfile *);
 static int copyfile_comparestat(struct copyfile *, struct copyfile *);
 static void copyfile_copy(struct copyfile *, struct copyfile *);
 static void copyfile_copystat(struct copyfile *, struct copyfile *);
-static int copyfile_write(struct copyfile *);
-static void copyfile_advance(struct copyfile *);
+static int copyfile_pwrite(struct copyfile *, const char *, size_t, off_t);
+static int copyfile_write(struct copyfile *, const struct copyblock *);
+static off_t copyfile_clone(struct copyfile *, struct copyfile *);
+static int copyfile_preallocate(struct copyfile *, struct copyfile *);
+static int copyfile_wait(struct copyfile *, unsigned int);
+static int copyfile_kcopy(struct copyfile *, struct copyfile *,
+    const struct copyblock *);
+static int copyfile_punch(struct copyfile *, const struct copyblock *);
+static void copyfile_advance(struct copyfile *, size_t);
+static void copyfile_update(struct copyfile *, const void *, size_t);
 static int copyfile_finish(struct copyfile *);
+static int copyfile_readback(struct copyfile *, off_t);
+static int copyfile_sidename(const struct copyfile *, const char *, char *,
+    size_t);
+static int copyfile_journal_save(struct copyfile *, struct copyfile *,
+    const tsd_digest_ctx *);
+static int copyfile_journal_load(struct copyfile *, struct copyfile *);
+static int copyfile_range_save(struct copyfile *, struct copyfile *, off_t);
+static int copyfile_range_load(struct copyfile *, struct copyfile *, off_t,
+    off_t, uint8_t *, struct timeval *, struct timeval *);
 static void copyfile_close(struct copyfile *);
 
+static int copypipe_init(struct copypipe *, struct copyfile *,
+    struct copyfile *, size_t, unsigned int);
+static struct copyblock *copypipe_next(struct copypipe *);
+static int copypipe_submit(struct copypipe *, struct copyblock *, off_t,
+    size_t);
+static int copypipe_finish(struct copypipe *);
+
+static void copyahead_init(struct copyahead *, char *, unsigned int, size_t);
+static int copyahead_drain(struct tsd_uring *, struct copyahead *);
+
+static void copier_throttle(size_t);
+
 static volatile sig_atomic_t killed;
 
+/* what holes read as, for writing or hashing them a block at a time */
+static const char zeroblock[BLOCKSIZE];
+
+/*
+ * Kernel copy methods, in order of preference.  We start out with the
+ * first and fall back to the next one whenever the kernel tells us the
+ * current one is not supported for this pair of files.
+ */
+static enum {
+	KCOPY_COPY_FILE_RANGE,
+	KCOPY_SPLICE,
+	KCOPY_WRITE,
+} kcopy_method;
+static int kcopy_pipe[2] = { -1, -1 };
+
+/*
+ * Close the splice pipe after an error, since it may still hold data
+ * which would otherwise end up at the start of the next copy.
+ */
+static void
+kcopy_pipe_close(void)
+{
+
+	if (kcopy_pipe[0] >= 0) {
+		close(kcopy_pipe[0]);
+		close(kcopy_pipe[1]);
+		kcopy_pipe[0] = kcopy_pipe[1] = -1;
+	}
+}
+
 /*
  * Signal handler
  */
@@ -112,6 +351,85 @@ signal_handler(int sig)
 		killed = sig;
 }
 
+/*
+ * The pipeline's I/O buffers come from a single region which is kept
+ * for the lifetime of the process and reused for every copy, so we
+ * don't keep allocating, clearing and freeing them.  The region is
+ * page-aligned, as direct I/O requires, and we ask for transparent huge
+ * pages.  Pages from the administrator's reserved huge page pool are
+ * only used if explicitly requested.
+ */
+static char *copybuf_pool;
+static size_t copybuf_size;
+
+#ifdef MAP_HUGETLB
+/*
+ * Return the default huge page size.
+ */
+static size_t
+copybuf_hugepagesize(void)
+{
+	char line[128];
+	unsigned long kb;
+	FILE *f;
+
+	kb = 0;
+	if ((f = fopen("/proc/meminfo", "r")) != NULL) {
+		while (fgets(line, sizeof line, f) != NULL)
+			if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+				break;
+		fclose(f);
+	}
+	return (kb > 0 ? kb * 1024 : 2 * 1024 * 1024);
+}
+#endif
+
+static char *
+copybuf_get(size_t size)
+{
+	size_t mapsz;
+	void *p;
+#ifdef MAP_HUGETLB
+	size_t hpsz;
+#endif
+
+	if (size <= copybuf_size)
+		return (copybuf_pool);
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (tsdfx_hugetlb) {
+		/* the length must be a multiple of the huge page size */
+		hpsz = copybuf_hugepagesize();
+		mapsz = (size + hpsz - 1) / hpsz * hpsz;
+		p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			VERBOSE("using %zu kB huge pages for I/O buffers",
+			    hpsz / 1024);
+		else
+			VERBOSE("huge pages unavailable: %s", strerror(errno));
+	}
+#endif
+	if (p == MAP_FAILED) {
+		mapsz = size;
+		p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (p == MAP_FAILED) {
+			ERROR("unable to allocate I/O buffers: %s",
+			    strerror(errno));
+			return (NULL);
+		}
+#ifdef MADV_HUGEPAGE
+		(void)madvise(p, mapsz, MADV_HUGEPAGE);
+#endif
+	}
+	if (copybuf_pool != NULL && munmap(copybuf_pool, copybuf_size) != 0)
+		ERROR("unable to release I/O buffers: %s", strerror(errno));
+	copybuf_pool = p;
+	copybuf_size = mapsz;
+	return (copybuf_pool);
+}
+
 /* open a file or directory and populate the state structure */
 static struct copyfile *
 copyfile_open(const char *fn, int mode, int perm)
@@ -123,9 +441,10 @@ copyfile_open(const char *fn, int mode, int perm)
 	size_t plen;
 
 	/* allocate state structure */
-	if ((cf = calloc(1, sizeof *cf + BLOCKSIZE)) == NULL)
+	if ((cf = calloc(1, sizeof *cf)) == NULL)
 		goto fail;
-	sha1_init(&cf->sha_ctx);
+	cf->fd = cf->dfd = cf->ifd = -1;
+	tsd_digest_init(&cf->digest_ctx, tsdfx_digest);
 	cf->bufsize = BLOCKSIZE;
 
 	/* copy name, check for trailing /, then strip it off */
@@ -236,24 +555,316 @@ copyfile_refresh(struct copyfile *cf)
 		ERROR("%s: %s", cf->pname, strerror(errno));
 		return (-1);
 	}
-	if (st.st_dev != cf->st.st_dev ||
+	return (copyfile_restat(cf, &st));
+}
+
+/*
+ * Open a second descriptor for direct I/O, bypassing the page cache.
+ * Direct I/O has alignment requirements, so the regular descriptor is
+ * still used for anything that doesn't meet them, such as the tail end
+ * of the file.
+ */
+static int
+copyfile_direct(struct copyfile *cf)
+{
+#ifdef O_DIRECT
+	struct stat st;
+	int fd;
+
+	fd = open(cf->name, (cf->mode & O_RDWR ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		VERBOSE("%s: O_DIRECT: %s", cf->pname, strerror(errno));
+		return (-1);
+	}
+	if (fstat(fd, &st) != 0 || st.st_dev != cf->st.st_dev ||
 	    st.st_ino != cf->st.st_ino) {
+		VERBOSE("%s: file was replaced", cf->pname);
+		close(fd);
+		errno = ESTALE;
+		return (-1);
+	}
+	cf->dfd = fd;
+	return (0);
+#else
+	VERBOSE("%s: direct I/O not supported", cf->pname);
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/* select the descriptor to use for a given transfer */
+static int
+copyfile_iofd(const struct copyfile *cf, const void *buf, off_t off,
+    size_t len)
+{
+
+	if (cf->dfd >= 0 && DIO_ALIGNED(buf) && DIO_ALIGNED(off) &&
+	    DIO_ALIGNED(len))
+		return (cf->dfd);
+	return (cf->fd);
+}
+
+#if HAVE_FSTATFS
+/* file systems which do best with large requests */
+static const unsigned long bigio_fstypes[] = {
+	0x00006969,	/* NFS */
+	0x0bd00bd0,	/* Lustre */
+	0x47504653,	/* GPFS */
+	0x00c36400,	/* Ceph */
+	0x19830326,	/* BeeGFS */
+	0xff534d42,	/* CIFS */
+	0xfe534d42,	/* SMB2 */
+};
+
+static int
+copyfile_bigio(const struct copyfile *cf)
+{
+	struct statfs sfs;
+	unsigned int i;
+
+	if (fstatfs(cf->fd, &sfs) != 0)
+		return (0);
+	for (i = 0; i < sizeof bigio_fstypes / sizeof *bigio_fstypes; ++i)
+		if ((unsigned long)sfs.f_type == bigio_fstypes[i])
+			return (1);
+	return (0);
+}
+#endif
+
+/*
+ * Pick the I/O size for a copy: at least what either file system says
+ * it prefers, and larger still for network and cluster file systems,
+ * but no larger than the source file.  The result is always a power of
+ * two unless overridden on the command line.
+ */
+static size_t
+copyfile_blocksize(struct copyfile *src, struct copyfile *dst)
+{
+	size_t bs;
+
+	if (tsdfx_blocksize > 0)
+		return (tsdfx_blocksize);
+	bs = BLOCKSIZE;
+#if HAVE_FSTATFS
+	if (copyfile_bigio(src) || copyfile_bigio(dst))
+		bs = 16 * BLOCKSIZE;
+#endif
+	while (bs < MAX_BLOCKSIZE && (bs < (size_t)src->st.st_blksize ||
+	    bs < (size_t)dst->st.st_blksize))
+		bs *= 2;
+	while (bs > MIN_BLOCKSIZE && (off_t)bs / 2 >= src->st.st_size)
+		bs /= 2;
+	return (bs);
+}
+
+/* compare fresh stat data with what we had and update it */
+static int
+copyfile_restat(struct copyfile *cf, const struct stat *st)
+{
+
+	if (st->st_dev != cf->st.st_dev ||
+	    st->st_ino != cf->st.st_ino) {
 		ERROR("%s has moved", cf->pname);
 		errno = ESTALE;
 		return (-1);
 	}
-	if (st.st_uid != cf->st.st_uid || st.st_gid != cf->st.st_gid)
+	if (st->st_uid != cf->st.st_uid || st->st_gid != cf->st.st_gid)
 		WARNING("%s: owner changed from %lu:%lu to %lu:%lu", cf->pname,
 		    (unsigned long)cf->st.st_uid, (unsigned long)cf->st.st_gid,
-		    (unsigned long)st.st_uid, (unsigned long)st.st_gid);
-	if (st.st_mode != cf->st.st_mode)
+		    (unsigned long)st->st_uid, (unsigned long)st->st_gid);
+	if (st->st_mode != cf->st.st_mode)
 		WARNING("%s: mode has changed from %04o to %04o", cf->pname,
-		    (int)cf->st.st_mode, (int)st.st_mode);
-	if (st.st_mtime < cf->st.st_mtime)
+		    (int)cf->st.st_mode, (int)st->st_mode);
+	if (st->st_mtime < cf->st.st_mtime)
 		WARNING("%s: mtime went backwards", cf->pname);
-	if (st.st_size < cf->st.st_size)
+	if (st->st_size < cf->st.st_size)
 		WARNING("%s: truncated", cf->pname);
-	cf->st = st;
+	cf->st = *st;
+	return (0);
+}
+
+#if HAVE_STATX
+/* convert the parts of a struct statx that we use to a struct stat */
+static void
+copyfile_statx2stat(const struct statx *stx, struct stat *st)
+{
+
+	memset(st, 0, sizeof *st);
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * Re-stat both files, read the next block from the source and, unless
+ * told otherwise, from the destination, with a single io_uring
+ * submission instead of four separate system calls.  The source block
+ * has usually been read ahead already; reads of the blocks after it
+ * are queued in the same submission.  The destination read is
+ * speculative; if there is nothing there, it simply returns no data.
+ */
+static int
+copyfile_uring_step(struct tsd_uring *ur, struct copyahead *ra,
+    struct copyblock *cb, struct copyfile *src, struct copyfile *dst,
+    int readdst)
+{
+	struct copyfile *cf[2] = { src, dst };
+	struct stat st;
+	uint64_t ud;
+	unsigned int i, n, want;
+	off_t off;
+	char *buf;
+	int r, res[3];
+
+	/* discard what was read ahead if we have skipped past it */
+	if (ra->count > 0 && ra->slot[ra->head].offset != src->offset &&
+	    copyahead_drain(ur, ra) != 0)
+		return (-1);
+
+	/* keep the read-ahead full, without going past the end */
+	while (ra->count < ra->depth) {
+		off = src->offset + (off_t)ra->count * src->bufsize;
+		if (ra->count > 0 && off >= src->st.st_size)
+			break;
+		i = (ra->head + ra->count) % ra->depth;
+		ra->slot[i].offset = off;
+		ra->slot[i].done = 0;
+		if (tsd_uring_read(ur, copyfile_iofd(src, ra->slot[i].buf,
+		    off, src->bufsize), ra->slot[i].buf, src->bufsize, off,
+		    UD_AHEAD + i) != 0) {
+			ERROR("unable to queue requests: %s", strerror(errno));
+			return (-1);
+		}
+		ra->count++;
+	}
+
+	want = readdst ? 3 : 2;
+	for (i = 0; i < 2; ++i) {
+		if (tsd_uring_statx(ur, AT_FDCWD, cf[i]->name,
+		    AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &cf[i]->stx,
+		    i) != 0) {
+			ERROR("unable to queue requests: %s", strerror(errno));
+			return (-1);
+		}
+	}
+	if (readdst && tsd_uring_read(ur, copyfile_iofd(dst, dst->buf,
+	    dst->offset, dst->bufsize), dst->buf, dst->bufsize, dst->offset,
+	    2) != 0) {
+		ERROR("unable to queue requests: %s", strerror(errno));
+		return (-1);
+	}
+	for (n = 0; n < want || !ra->slot[ra->head].done; ) {
+		if (tsd_uring_reap(ur, &ud, &r) == 1) {
+			if (ud >= UD_AHEAD) {
+				ra->slot[ud - UD_AHEAD].res = r;
+				ra->slot[ud - UD_AHEAD].done = 1;
+			} else {
+				res[ud] = r;
+				++n;
+			}
+		} else if (tsd_uring_submit(ur, 1) < 0) {
+			ERROR("io_uring_enter(): %s", strerror(errno));
+			return (-1);
+		}
+	}
+	for (i = 0; i < 2; ++i) {
+		if (res[i] < 0) {
+			errno = -res[i];
+			ERROR("%s: %s", cf[i]->pname, strerror(errno));
+			return (-1);
+		}
+		copyfile_statx2stat(&cf[i]->stx, &st);
+		if (copyfile_restat(cf[i], &st) != 0)
+			return (-1);
+	}
+
+	/* swap the block's source buffer for the one we read ahead into */
+	i = ra->head;
+	ra->head = (ra->head + 1) % ra->depth;
+	ra->count--;
+	buf = ra->slot[i].buf;
+	ra->slot[i].buf = cb->sbuf;
+	cb->sbuf = src->buf = buf;
+	if ((r = ra->slot[i].res) == -EINVAL && src->dfd >= 0) {
+		/* direct I/O refused, try again through the cache */
+		if (copyfile_read(src) != 0)
+			return (-1);
+	} else if (r < 0) {
+		errno = -r;
+		ERROR("%s: read(): %s", src->pname, strerror(errno));
+		return (-1);
+	} else {
+		src->buflen = (size_t)r;
+		/* it may have grown since the read was issued */
+		if (src->buflen < src->bufsize &&
+		    src->offset + r < src->st.st_size &&
+		    copyfile_read(src) != 0)
+			return (-1);
+	}
+
+	if (!readdst)
+		return (0);
+	if (res[2] == -EINVAL && dst->dfd >= 0) {
+		if (copyfile_read(dst) != 0)
+			return (-1);
+	} else if (res[2] < 0) {
+		errno = -res[2];
+		ERROR("%s: read(): %s", dst->pname, strerror(errno));
+		return (-1);
+	} else {
+		dst->buflen = (size_t)res[2];
+	}
+	return (0);
+}
+#endif
+
+static void
+copyahead_init(struct copyahead *ra, char *buf, unsigned int depth,
+    size_t bs)
+{
+	unsigned int i;
+
+	memset(ra, 0, sizeof *ra);
+	ra->depth = depth;
+	for (i = 0; i < depth; ++i)
+		ra->slot[i].buf = buf + i * bs;
+}
+
+/*
+ * Wait for all the reads still in flight to complete and discard them,
+ * so their buffers can be reused.
+ */
+static int
+copyahead_drain(struct tsd_uring *ur, struct copyahead *ra)
+{
+	uint64_t ud;
+	int r;
+
+	while (ra->count > 0) {
+		if (ra->slot[ra->head].done) {
+			ra->head = (ra->head + 1) % ra->depth;
+			ra->count--;
+		} else if (tsd_uring_reap(ur, &ud, &r) == 1) {
+			if (ud >= UD_AHEAD)
+				ra->slot[ud - UD_AHEAD].done = 1;
+		} else if (tsd_uring_submit(ur, 1) < 0) {
+			ERROR("io_uring_enter(): %s", strerror(errno));
+			return (-1);
+		}
+	}
+	ra->head = 0;
 	return (0);
 }
 
@@ -276,6 +887,7 @@ static int
 copyfile_read(struct copyfile *cf)
 {
 	ssize_t rlen;
+	int fd;
 
 	if (copyfile_isdir(cf))
 		return (-1);
@@ -283,14 +895,15 @@ copyfile_read(struct copyfile *cf)
 	ASSERTF(cf->offset <= cf->st.st_size,
 	    "trying to read past end of file: %zu > %zu",
 	    (size_t)cf->offset, (size_t)cf->st.st_size);
-	ASSERTF(lseek(cf->fd, 0, SEEK_CUR) == cf->offset,
-	    "file position does not match stored offset: %zu != %zu",
-	    (size_t)lseek(cf->fd, 0, SEEK_CUR), (size_t)cf->offset);
 
 	if (cf->offset == cf->st.st_size)
 		return (0);
 
-	if ((rlen = read(cf->fd, cf->buf, cf->bufsize)) < 0) {
+	fd = copyfile_iofd(cf, cf->buf, cf->offset, cf->bufsize);
+	rlen = pread(fd, cf->buf, cf->bufsize, cf->offset);
+	if (rlen < 0 && errno == EINVAL && fd != cf->fd)
+		rlen = pread(cf->fd, cf->buf, cf->bufsize, cf->offset);
+	if (rlen < 0) {
 		ERROR("%s: read(): %s", cf->pname, strerror(errno));
 		return (-1);
 	}
@@ -302,6 +915,111 @@ copyfile_read(struct copyfile *cf)
 	return (0);
 }
 
+/*
+ * Tell the kernel how we intend to access the file.
+ */
+static void
+copyfile_advise(struct copyfile *cf)
+{
+
+#if HAVE_POSIX_FADVISE
+	if (tsdfx_cache & CACHE_SEQUENTIAL)
+		(void)posix_fadvise(cf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+	(void)cf;
+#endif
+}
+
+/*
+ * Start reading a range of the file into the page cache.
+ */
+static void
+copyfile_readahead(struct copyfile *cf, off_t off, size_t len)
+{
+
+	if (!(tsdfx_cache & CACHE_READAHEAD) || off >= cf->st.st_size)
+		return;
+#if HAVE_READAHEAD
+	(void)readahead(cf->fd, off, len);
+#elif HAVE_POSIX_FADVISE
+	(void)posix_fadvise(cf->fd, off, len, POSIX_FADV_WILLNEED);
+#else
+	(void)len;
+#endif
+}
+
+/*
+ * Drop everything up to the given offset from the page cache, so that
+ * a bulk transfer does not evict everybody else's data.  Dirty pages
+ * can't be dropped, so if the file is open for writing, we start
+ * writeback of the new range and wait for the previous one to complete
+ * before dropping it, which means we stay one call behind.
+ */
+static void
+copyfile_dropbehind(struct copyfile *cf, off_t off)
+{
+	off_t end;
+
+	if (!(tsdfx_cache & CACHE_DONTNEED) || off <= cf->flushed)
+		return;
+	end = off;
+#if HAVE_SYNC_FILE_RANGE
+	if (cf->mode & O_RDWR) {
+		(void)sync_file_range(cf->fd, cf->flushed, off - cf->flushed,
+		    SYNC_FILE_RANGE_WRITE);
+		end = cf->flushed;
+		if (end > cf->dropped)
+			(void)sync_file_range(cf->fd, cf->dropped,
+			    end - cf->dropped, SYNC_FILE_RANGE_WAIT_BEFORE |
+			    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+#endif
+	cf->flushed = off;
+#if HAVE_POSIX_FADVISE
+	if (end > cf->dropped)
+		(void)posix_fadvise(cf->fd, cf->dropped, end - cf->dropped,
+		    POSIX_FADV_DONTNEED);
+#endif
+	cf->dropped = end;
+}
+
+#if HAVE_DECL_SEEK_HOLE
+/*
+ * Return the length of the hole at the current offset, or 0 if there
+ * is data there.  After finding data, we also look up where it ends so
+ * we don't have to ask again for every block.  If the filesystem does
+ * not support SEEK_DATA, the entire file is treated as data.
+ */
+static off_t
+copyfile_hole(struct copyfile *cf)
+{
+	off_t data, hole;
+
+	if (cf->offset < cf->dataend || cf->offset >= cf->st.st_size)
+		return (0);
+	if ((data = lseek(cf->fd, cf->offset, SEEK_DATA)) < 0) {
+		if (errno != ENXIO) {
+			VERBOSE("%s: SEEK_DATA: %s", cf->pname,
+			    strerror(errno));
+			cf->dataend = OFF_MAX;
+			return (0);
+		}
+		/* no data past this point */
+		data = cf->st.st_size;
+	}
+	if (data > cf->offset) {
+		if (data > cf->st.st_size)
+			data = cf->st.st_size;
+		hole = data - cf->offset;
+		return (hole > MAX_HOLE ? MAX_HOLE : hole);
+	}
+	if ((hole = lseek(cf->fd, cf->offset, SEEK_HOLE)) < 0)
+		hole = OFF_MAX;
+	cf->dataend = hole;
+	return (0);
+}
+#endif
+
 /* compare buffer length and content */
 static int
 copyfile_compare(struct copyfile *src, struct copyfile *dst)
@@ -366,45 +1084,357 @@ copyfile_copystat(struct copyfile *src, struct copyfile *dst)
 	dst->st.st_mtim = src->st.st_mtim;
 }
 
-/* write a block at the previous offset */
+/* write data at the specified offset, retrying short writes */
 static int
-copyfile_write(struct copyfile *cf)
+copyfile_pwrite(struct copyfile *cf, const char *buf, size_t len, off_t off)
 {
 	ssize_t wlen;
-
-	if (copyfile_isdir(cf))
-		return (-1);
-	if (lseek(cf->fd, cf->offset, SEEK_SET) != cf->offset) {
-		ERROR("%s: lseek(): %s", cf->pname, strerror(errno));
-		return (-1);
-	}
-	if ((wlen = write(cf->fd, cf->buf, cf->buflen)) != (ssize_t)cf->buflen) {
-		ERROR("%s: write(): %s", cf->pname, strerror(errno));
-		return (-1);
+	size_t n;
+	int fd;
+
+	while (len > 0) {
+		/* write as much as possible directly, the rest through the cache */
+		n = len & ~(size_t)(DIO_ALIGN - 1);
+		if (n == 0 || (fd = copyfile_iofd(cf, buf, off, n)) == cf->fd) {
+			fd = cf->fd;
+			n = len;
+		}
+		wlen = pwrite(fd, buf, n, off);
+		if (wlen < 0 && errno == EINVAL && fd != cf->fd)
+			wlen = pwrite(cf->fd, buf, n, off);
+		if (wlen <= 0) {
+			ERROR("%s: write(): %s", cf->pname,
+			    wlen < 0 ? strerror(errno) : "short write");
+			if (wlen == 0)
+				errno = EIO;
+			return (-1);
+		}
+		buf += wlen;
+		off += wlen;
+		len -= wlen;
 	}
 	return (0);
 }
 
-/* update the running digest */
-static void
-copyfile_advance(struct copyfile *cf)
+/* write a block at its offset */
+static int
+copyfile_write(struct copyfile *cf, const struct copyblock *cb)
 {
 
-	sha1_update(&cf->sha_ctx, cf->buf, cf->buflen);
-	cf->offset += cf->buflen;
-	cf->buflen = 0;
+	return (copyfile_pwrite(cf, cb->dbuf, cb->len, cb->offset));
 }
 
-/* truncate at current offset, finalize digest */
+/*
+ * Clone the entire source file into the destination file if both are
+ * on the same copy-on-write filesystem.  Returns the number of bytes
+ * cloned, which is zero if cloning is not supported.
+ */
+static off_t
+copyfile_clone(struct copyfile *src, struct copyfile *dst)
+{
+
+#ifdef FICLONE
+	if (ioctl(dst->fd, FICLONE, src->fd) == 0) {
+		VERBOSE("cloned %zu bytes", (size_t)src->st.st_size);
+		return (src->st.st_size);
+	}
+	VERBOSE("%s: FICLONE: %s", dst->pname, strerror(errno));
+#else
+	(void)src;
+	(void)dst;
+#endif
+	return (0);
+}
+
+/*
+ * Reserve space for the part of the source which lies beyond the end of
+ * the destination, so it is laid out contiguously and we run out of
+ * space now rather than halfway through.  The destination's size does
+ * not change, and whatever we don't use is released by the final
+ * ftruncate().  Sparse sources are left alone so as not to fill in
+ * their holes.  Returns -1 only if there is not enough space.
+ */
 static int
-copyfile_finish(struct copyfile *cf)
+copyfile_preallocate(struct copyfile *src, struct copyfile *dst)
 {
-	struct timeval times[2];
-	mode_t mode;
 
-	gettimeofday(&cf->tvf, NULL);
-	timersub(&cf->tvf, &cf->tvo, &cf->tve);
-	if (cf->mode & O_RDWR) {
+#if HAVE_FALLOCATE && defined(FALLOC_FL_KEEP_SIZE)
+	if (src->st.st_size <= dst->st.st_size ||
+	    src->st.st_blocks * 512 < src->st.st_size)
+		return (0);
+	if (fallocate(dst->fd, FALLOC_FL_KEEP_SIZE, dst->st.st_size,
+	    src->st.st_size - dst->st.st_size) == 0) {
+		VERBOSE("preallocated %zu bytes",
+		    (size_t)(src->st.st_size - dst->st.st_size));
+		return (0);
+	}
+	if (errno == ENOSPC || errno == EDQUOT)
+		return (-1);
+	VERBOSE("%s: fallocate(): %s", dst->pname, strerror(errno));
+#else
+	(void)src;
+	(void)dst;
+#endif
+	return (0);
+}
+
+/*
+ * Copy a block we read from the source file to the same offset in the
+ * destination file, letting the kernel move the data if possible.
+ * Use copy_file_range(2) first, which lets the filesystem perform a
+ * server-side copy or share extents if it knows how to, then splice(2)
+ * through a pipe, and finally plain write(2) from the source buffer.
+ */
+static int
+copyfile_kcopy(struct copyfile *src, struct copyfile *dst,
+    const struct copyblock *cb)
+{
+	off_t ioff, ooff;
+	size_t len;
+	ssize_t clen, wlen;
+
+	ioff = ooff = cb->offset;
+	len = cb->len;
+#if HAVE_COPY_FILE_RANGE
+	while (kcopy_method == KCOPY_COPY_FILE_RANGE && len > 0) {
+		clen = copy_file_range(src->fd, &ioff, dst->fd, &ooff, len, 0);
+		if (clen < 0 && (errno == EXDEV || errno == EINVAL ||
+		    errno == ENOSYS || errno == EOPNOTSUPP)) {
+			VERBOSE("copy_file_range(): %s, falling back to splice",
+			    strerror(errno));
+			kcopy_method = KCOPY_SPLICE;
+			break;
+		} else if (clen < 0) {
+			ERROR("%s: copy_file_range(): %s", dst->pname,
+			    strerror(errno));
+			return (-1);
+		} else if (clen == 0) {
+			ERROR("%s: unexpected end of file", src->pname);
+			errno = EIO;
+			return (-1);
+		}
+		len -= clen;
+	}
+#else
+	if (kcopy_method == KCOPY_COPY_FILE_RANGE)
+		kcopy_method = KCOPY_SPLICE;
+#endif
+#if HAVE_SPLICE
+	if (kcopy_method == KCOPY_SPLICE && kcopy_pipe[0] < 0 &&
+	    pipe(kcopy_pipe) != 0) {
+		VERBOSE("pipe(): %s, falling back to write", strerror(errno));
+		kcopy_method = KCOPY_WRITE;
+	}
+	while (kcopy_method == KCOPY_SPLICE && len > 0) {
+		clen = splice(src->fd, &ioff, kcopy_pipe[1], NULL, len,
+		    SPLICE_F_MOVE);
+		if (clen < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			VERBOSE("splice(): %s, falling back to write",
+			    strerror(errno));
+			kcopy_pipe_close();
+			kcopy_method = KCOPY_WRITE;
+			break;
+		} else if (clen < 0) {
+			ERROR("%s: splice(): %s", src->pname, strerror(errno));
+			kcopy_pipe_close();
+			return (-1);
+		} else if (clen == 0) {
+			ERROR("%s: unexpected end of file", src->pname);
+			errno = EIO;
+			return (-1);
+		}
+		/* the pipe must be drained before we can do anything else */
+		while (clen > 0) {
+			wlen = splice(kcopy_pipe[0], NULL, dst->fd, &ooff,
+			    clen, SPLICE_F_MOVE);
+			if (wlen <= 0) {
+				ERROR("%s: splice(): %s", dst->pname,
+				    wlen < 0 ? strerror(errno) : "short write");
+				kcopy_pipe_close();
+				if (wlen == 0)
+					errno = EIO;
+				return (-1);
+			}
+			clen -= wlen;
+			len -= wlen;
+		}
+	}
+#else
+	if (kcopy_method == KCOPY_SPLICE)
+		kcopy_method = KCOPY_WRITE;
+#endif
+	/* whatever is left, write it from our own copy */
+	return (copyfile_pwrite(dst, cb->sbuf + (ioff - cb->offset), len,
+	    ooff));
+}
+
+/*
+ * Make sure a block of the destination reads as zeroes, preferably by
+ * punching a hole, otherwise by writing zeroes over it.
+ */
+static int
+copyfile_punch(struct copyfile *cf, const struct copyblock *cb)
+{
+	size_t len;
+	off_t off;
+
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE)
+	if (fallocate(cf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    cb->offset, cb->len) == 0)
+		return (0);
+	VERBOSE("%s: fallocate(): %s", cf->pname, strerror(errno));
+#endif
+	for (off = 0; (size_t)off < cb->len; off += len) {
+		len = cb->len - off;
+		if (len > sizeof zeroblock)
+			len = sizeof zeroblock;
+		if (copyfile_pwrite(cf, zeroblock, len, cb->offset + off) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+#if HAVE_INOTIFY_INIT1
+/*
+ * Start watching a file for modifications, making sure that the name
+ * still refers to the file we have open.
+ */
+static int
+copyfile_watch(struct copyfile *cf)
+{
+	struct stat st;
+
+	if ((cf->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return (-1);
+	if (inotify_add_watch(cf->ifd, cf->name, IN_MODIFY | IN_CLOSE_WRITE |
+	    IN_DELETE_SELF | IN_MOVE_SELF) < 0 || stat(cf->name, &st) != 0 ||
+	    st.st_dev != cf->st.st_dev || st.st_ino != cf->st.st_ino) {
+		close(cf->ifd);
+		cf->ifd = -1;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Wait up to the given number of milliseconds for events on a watched
+ * file and process them.  A close after writing marks the file as
+ * possibly quiescent until it is modified again.
+ */
+static int
+copyfile_events(struct copyfile *cf, int timeout)
+{
+	struct inotify_event ev[16];
+	struct pollfd pfd;
+	ssize_t rlen;
+	size_t i;
+
+	pfd.fd = cf->ifd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) < 0)
+		return (errno == EINTR ? 0 : -1);
+	/* we watch a single file, so there are no names to skip */
+	while ((rlen = read(cf->ifd, ev, sizeof ev)) > 0) {
+		for (i = 0; i < (size_t)rlen / sizeof *ev; ++i) {
+			if (ev[i].mask & IN_MODIFY)
+				cf->quiescent = 0;
+			if (ev[i].mask & IN_CLOSE_WRITE)
+				cf->quiescent = 1;
+			if (ev[i].mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+			    IN_IGNORED))
+				return (-1);
+		}
+	}
+	if (rlen < 0 && errno != EAGAIN && errno != EINTR)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Check that nobody has the file open for writing.  The kernel will
+ * only grant us a read lease if that is the case.  If we can't tell,
+ * assume that someone does.
+ */
+static int
+copyfile_unwritten(struct copyfile *cf)
+{
+
+#ifdef F_SETLEASE
+	if (fcntl(cf->fd, F_SETLEASE, F_RDLCK) == 0) {
+		(void)fcntl(cf->fd, F_SETLEASE, F_UNLCK);
+		return (1);
+	}
+	if (errno != EAGAIN)
+		VERBOSE("%s: F_SETLEASE: %s", cf->pname, strerror(errno));
+#endif
+	return (0);
+}
+#endif
+
+/*
+ * Wait for a growing file to change, or for the given number of seconds
+ * to pass.  Where possible, we watch the file instead of sleeping, so
+ * we can pick up new data as soon as it is written.  Returns 1 if the
+ * file has been closed since it was last modified and nobody else has
+ * it open for writing, in which case there is no point in waiting for
+ * it any further.
+ */
+static int
+copyfile_wait(struct copyfile *cf, unsigned int sec)
+{
+
+#if HAVE_INOTIFY_INIT1
+	if (cf->ifd == -1 && copyfile_watch(cf) != 0) {
+		VERBOSE("%s: unable to watch: %s", cf->pname,
+		    strerror(errno));
+		cf->ifd = -2;
+	}
+	if (cf->ifd >= 0) {
+		/* pick up whatever happened since we last looked */
+		if (copyfile_events(cf, 0) == 0 && cf->quiescent) {
+			if (copyfile_unwritten(cf))
+				return (1);
+			/* someone else is still writing */
+			cf->quiescent = 0;
+		}
+		if (copyfile_events(cf, sec * 1000) == 0)
+			return (0);
+		/* the file went away or something went wrong */
+		close(cf->ifd);
+		cf->ifd = -2;
+	}
+#endif
+	(void)sleep(sec > 1 ? 1 : sec);
+	return (0);
+}
+
+/* move past a block which has been handed to the pipeline */
+static void
+copyfile_advance(struct copyfile *cf, size_t len)
+{
+
+	cf->offset += len;
+	cf->buflen = 0;
+}
+
+/* update the running digest */
+static void
+copyfile_update(struct copyfile *cf, const void *buf, size_t len)
+{
+
+	tsd_digest_update(&cf->digest_ctx, buf, len);
+}
+
+/* truncate at current offset, finalize digest */
+static int
+copyfile_finish(struct copyfile *cf)
+{
+	struct timeval times[2];
+	mode_t mode;
+
+	gettimeofday(&cf->tvf, NULL);
+	timersub(&cf->tvf, &cf->tvo, &cf->tve);
+	if (cf->mode & O_RDWR) {
 		if (!copyfile_isdir(cf) && ftruncate(cf->fd, cf->offset) != 0) {
 			ERROR("%s: ftruncate(): %s", cf->pname, strerror(errno));
 			return (-1);
@@ -424,11 +1454,427 @@ copyfile_finish(struct copyfile *cf)
 			return (-1);
 		}
 	}
-	sha1_final(&cf->sha_ctx, cf->digest);
-	memset(&cf->sha_ctx, 0, sizeof cf->sha_ctx);
+	tsd_digest_final(&cf->digest_ctx, cf->digest);
+	memset(&cf->digest_ctx, 0, sizeof cf->digest_ctx);
+	return (0);
+}
+
+/*
+ * Read the file back from the given offset up to the current offset,
+ * and compute its digest.  The file is flushed and, where possible,
+ * evicted from the page cache first, so that we verify what actually
+ * reached the disk rather than what we just wrote.
+ */
+static int
+copyfile_readback(struct copyfile *cf, off_t start)
+{
+	tsd_digest_ctx ctx;
+	char *buf;
+	size_t len;
+	ssize_t rlen;
+	off_t off;
+
+	if (fsync(cf->fd) != 0) {
+		ERROR("%s: fsync(): %s", cf->pname, strerror(errno));
+		return (-1);
+	}
+#if HAVE_POSIX_FADVISE
+	(void)posix_fadvise(cf->fd, start, cf->offset - start,
+	    POSIX_FADV_DONTNEED);
+#endif
+	if ((buf = malloc(cf->bufsize)) == NULL)
+		return (-1);
+	tsd_digest_init(&ctx, tsdfx_digest);
+	for (off = start; off < cf->offset; off += rlen) {
+		len = cf->bufsize;
+		if ((off_t)len > cf->offset - off)
+			len = cf->offset - off;
+		if ((rlen = pread(cf->fd, buf, len, off)) <= 0) {
+			if (rlen == 0)
+				errno = EIO;
+			ERROR("%s: read(): %s", cf->pname, strerror(errno));
+			free(buf);
+			return (-1);
+		}
+		tsd_digest_update(&ctx, buf, rlen);
+	}
+	tsd_digest_final(&ctx, cf->digest);
+	free(buf);
+#if HAVE_POSIX_FADVISE
+	if (tsdfx_cache & CACHE_DONTNEED)
+		(void)posix_fadvise(cf->fd, start, cf->offset - start,
+		    POSIX_FADV_DONTNEED);
+#endif
+	VERBOSE("%s: read back %zu bytes", cf->pname,
+	    (size_t)(cf->offset - start));
+	return (0);
+}
+
+/*
+ * Find or create our own directory within the state directory, if one
+ * was specified: statedir/uid.  Since we trust what we find in it, it
+ * must belong to us and be inaccessible to anyone else.  If it can't be
+ * used, we warn once and fall back to hidden files next to the files
+ * they describe.
+ */
+static const char *
+copier_statedir(void)
+{
+	static char dir[PATH_MAX];
+	static int checked;
+	struct stat st;
+	int len;
+
+	if (tsdfx_statedir == NULL || checked < 0)
+		return (NULL);
+	if (checked > 0)
+		return (dir);
+	checked = -1;
+	len = snprintf(dir, sizeof dir, "%s/%lu", tsdfx_statedir,
+	    (unsigned long)geteuid());
+	if (len < 0 || (size_t)len >= sizeof dir) {
+		WARNING("%s: %s", tsdfx_statedir, strerror(ENAMETOOLONG));
+		return (NULL);
+	}
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		WARNING("%s: mkdir(): %s", dir, strerror(errno));
+		return (NULL);
+	}
+	if (lstat(dir, &st) != 0) {
+		WARNING("%s: %s", dir, strerror(errno));
+		return (NULL);
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & 077) != 0) {
+		WARNING("%s: not a private directory", dir);
+		return (NULL);
+	}
+	checked = 1;
+	return (dir);
+}
+
+/*
+ * Construct the name of a file in which to keep state about the given
+ * one, with the given suffix: statedir/uid/dev.ino.suffix if we have a
+ * state directory, and a hidden file next to it, dir/.name.suffix,
+ * otherwise.
+ */
+static int
+copyfile_sidename(const struct copyfile *cf, const char *suffix, char *fn,
+    size_t size)
+{
+	const char *p;
+	int len;
+
+	if ((p = copier_statedir()) != NULL)
+		len = snprintf(fn, size, "%s/%ju.%ju.%s", p,
+		    (uintmax_t)cf->st.st_dev, (uintmax_t)cf->st.st_ino,
+		    suffix);
+	else if ((p = strrchr(cf->name, '/')) != NULL)
+		len = snprintf(fn, size, "%.*s/.%s.%s",
+		    (int)(p - cf->name), cf->name, p + 1, suffix);
+	else
+		len = snprintf(fn, size, ".%s.%s", cf->name, suffix);
+	if (len < 0 || (size_t)len >= size) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
 	return (0);
 }
 
+/*
+ * Resume journal.  When a copy is interrupted, we record how far we got,
+ * the state of the digest and the identity of both files in a state
+ * file for the destination, so the next attempt can continue from
+ * there instead of comparing the destination with the source all the
+ * way from the start.  The digest state is serialized by
+ * tsd_digest_save() in a portable format; the version number covers the
+ * layout of the journal itself.  Like the block manifest, the journal
+ * records the size, mtime and ctime of the destination as we left it,
+ * so that it is discarded if anything else has touched the file since.
+ */
+#define JOURNAL_MAGIC	"tsdfx-journal 2"
+
+/*
+ * Record how far we got, given the digest state at that point; must be
+ * called after copyfile_finish(), so that we see the destination as it
+ * will be left.
+ */
+static int
+copyfile_journal_save(struct copyfile *src, struct copyfile *dst,
+    const tsd_digest_ctx *ctx)
+{
+	uint8_t state[TSD_DIGEST_MAX_STATE_LEN];
+	struct stat st;
+	char fn[PATH_MAX];
+	size_t i, statelen;
+	FILE *f;
+	int fd;
+
+	if (copyfile_sidename(dst, "tsdfx-journal", fn, sizeof fn) != 0)
+		return (-1);
+	/* the data must be on disk before the journal says it is */
+	if (fsync(dst->fd) != 0 || fstat(dst->fd, &st) != 0) {
+		ERROR("%s: %s", dst->pname, strerror(errno));
+		return (-1);
+	}
+	if ((fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600)) < 0 ||
+	    (f = fdopen(fd, "w")) == NULL) {
+		ERROR("%s: %s", fn, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	statelen = tsd_digest_save(ctx, state, sizeof state);
+	fprintf(f, "%s\n", JOURNAL_MAGIC);
+	fprintf(f, "src %ju %ju %jd %jd.%09ld\n",
+	    (uintmax_t)src->st.st_dev, (uintmax_t)src->st.st_ino,
+	    (intmax_t)src->st.st_size, (intmax_t)src->st.st_mtim.tv_sec,
+	    (long)src->st.st_mtim.tv_nsec);
+	fprintf(f, "dst %ju %ju %jd %jd.%09ld %jd.%09ld\n",
+	    (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+	    (intmax_t)st.st_size, (intmax_t)st.st_mtim.tv_sec,
+	    (long)st.st_mtim.tv_nsec, (intmax_t)st.st_ctim.tv_sec,
+	    (long)st.st_ctim.tv_nsec);
+	fprintf(f, "offset %jd\n", (intmax_t)src->offset);
+	fprintf(f, "digest %s ", tsd_digest_name(tsdfx_digest));
+	for (i = 0; i < statelen; ++i)
+		fprintf(f, "%02x", state[i]);
+	fprintf(f, "\nend\n");
+	if (fflush(f) != 0 || fsync(fd) != 0) {
+		ERROR("%s: %s", fn, strerror(errno));
+		fclose(f);
+		unlink(fn);
+		return (-1);
+	}
+	fclose(f);
+	VERBOSE("journaled %s at %zu bytes", dst->pname, (size_t)src->offset);
+	return (0);
+}
+
+/*
+ * Look for a journal left by an earlier attempt, and if it matches both
+ * files, restore the digest state and skip ahead.  The journal is
+ * removed whether we use it or not; if we are interrupted again, a new
+ * one will be written.  Returns 0 if we resumed from the journal.
+ */
+static int
+copyfile_journal_load(struct copyfile *src, struct copyfile *dst)
+{
+	const struct tsd_digest_alg *alg;
+	uint8_t state[TSD_DIGEST_MAX_STATE_LEN];
+	tsd_digest_ctx ctx;
+	uintmax_t sdev, sino, ddev, dino;
+	intmax_t ssize, smtime, dsize, dmtime, dctime, offset;
+	long snsec, dmnsec, dcnsec;
+	char fn[PATH_MAX], name[16], end[4];
+	unsigned int byte;
+	size_t i, statelen;
+	FILE *f;
+	int fd, ret;
+
+	if (copyfile_sidename(dst, "tsdfx-journal", fn, sizeof fn) != 0)
+		return (-1);
+	if ((fd = open(fn, O_RDONLY|O_NOFOLLOW)) < 0 ||
+	    (f = fdopen(fd, "r")) == NULL) {
+		if (errno != ENOENT)
+			WARNING("%s: %s", fn, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	ret = -1;
+	if (fscanf(f, JOURNAL_MAGIC " src %ju %ju %jd %jd.%ld "
+	    "dst %ju %ju %jd %jd.%ld %jd.%ld offset %jd digest %15s ",
+	    &sdev, &sino, &ssize, &smtime, &snsec, &ddev, &dino, &dsize,
+	    &dmtime, &dmnsec, &dctime, &dcnsec, &offset, name) != 14) {
+		WARNING("%s: invalid journal", fn);
+		goto done;
+	}
+	if (sdev != (uintmax_t)src->st.st_dev ||
+	    sino != (uintmax_t)src->st.st_ino ||
+	    ssize != (intmax_t)src->st.st_size ||
+	    smtime != (intmax_t)src->st.st_mtim.tv_sec ||
+	    snsec != (long)src->st.st_mtim.tv_nsec ||
+	    ddev != (uintmax_t)dst->st.st_dev ||
+	    dino != (uintmax_t)dst->st.st_ino ||
+	    dsize != (intmax_t)dst->st.st_size ||
+	    dmtime != (intmax_t)dst->st.st_mtim.tv_sec ||
+	    dmnsec != (long)dst->st.st_mtim.tv_nsec ||
+	    dctime != (intmax_t)dst->st.st_ctim.tv_sec ||
+	    dcnsec != (long)dst->st.st_ctim.tv_nsec ||
+	    offset <= 0 || offset > dst->st.st_size ||
+	    offset > src->st.st_size) {
+		VERBOSE("%s: stale journal", fn);
+		goto done;
+	}
+	if ((alg = tsd_digest_lookup(name)) != tsdfx_digest) {
+		VERBOSE("%s: journal uses a different digest", fn);
+		goto done;
+	}
+	tsd_digest_init(&ctx, alg);
+	statelen = tsd_digest_save(&ctx, NULL, 0);
+	for (i = 0; i < statelen && i < sizeof state; ++i) {
+		if (fscanf(f, "%2x", &byte) != 1)
+			break;
+		state[i] = byte;
+	}
+	if (i < statelen || fscanf(f, " %3s", end) != 1 ||
+	    strcmp(end, "end") != 0 ||
+	    tsd_digest_restore(&ctx, alg, state, statelen) != 0) {
+		WARNING("%s: invalid journal", fn);
+		goto done;
+	}
+	src->digest_ctx = ctx;
+	src->offset = dst->offset = offset;
+	ret = 0;
+done:
+	fclose(f);
+	unlink(fn);
+	return (ret);
+}
+
+/*
+ * Range records.  When a large file is copied in several ranges by
+ * separate processes, each of them records the digest of its range
+ * and the identity of both files in a state file for the destination,
+ * named after the offset of the range.  Once all ranges have been
+ * copied, the records are collected and combined into a digest of the
+ * whole file.
+ */
+#define RANGE_MAGIC	"tsdfx-range 1"
+
+static int
+copyfile_range_name(const struct copyfile *dst, off_t offset, char *fn,
+    size_t size)
+{
+	char suffix[32];
+
+	snprintf(suffix, sizeof suffix, "tsdfx-range.%jd", (intmax_t)offset);
+	return (copyfile_sidename(dst, suffix, fn, size));
+}
+
+/* record a completed range; must be called after copyfile_finish() */
+static int
+copyfile_range_save(struct copyfile *src, struct copyfile *dst, off_t offset)
+{
+	char fn[PATH_MAX];
+	size_t i;
+	FILE *f;
+	int fd;
+
+	if (copyfile_range_name(dst, offset, fn, sizeof fn) != 0)
+		return (-1);
+	/* the data must be on disk before the record says it is */
+	if (fsync(dst->fd) != 0) {
+		ERROR("%s: fsync(): %s", dst->pname, strerror(errno));
+		return (-1);
+	}
+	if ((fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600)) < 0 ||
+	    (f = fdopen(fd, "w")) == NULL) {
+		ERROR("%s: %s", fn, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	fprintf(f, "%s\n", RANGE_MAGIC);
+	fprintf(f, "src %ju %ju %jd %jd.%09ld\n",
+	    (uintmax_t)src->st.st_dev, (uintmax_t)src->st.st_ino,
+	    (intmax_t)src->st.st_size, (intmax_t)src->st.st_mtim.tv_sec,
+	    (long)src->st.st_mtim.tv_nsec);
+	fprintf(f, "dst %ju %ju\n",
+	    (uintmax_t)dst->st.st_dev, (uintmax_t)dst->st.st_ino);
+	fprintf(f, "range %jd %jd\n",
+	    (intmax_t)offset, (intmax_t)(src->offset - offset));
+	fprintf(f, "time %jd.%06ld %jd.%06ld\n",
+	    (intmax_t)src->tvo.tv_sec, (long)src->tvo.tv_usec,
+	    (intmax_t)src->tvf.tv_sec, (long)src->tvf.tv_usec);
+	fprintf(f, "digest %s ", tsd_digest_name(tsdfx_digest));
+	for (i = 0; i < tsd_digest_len(tsdfx_digest); ++i)
+		fprintf(f, "%02x", src->digest[i]);
+	fprintf(f, "\nend\n");
+	if (fflush(f) != 0 || fsync(fd) != 0) {
+		ERROR("%s: %s", fn, strerror(errno));
+		fclose(f);
+		unlink(fn);
+		return (-1);
+	}
+	fclose(f);
+	return (0);
+}
+
+/*
+ * Look for the record of a range and check that it matches both files
+ * and the range we expect.  If it does, return the digest of the range
+ * and the times at which it was started and finished.  The record is
+ * removed whether we use it or not.
+ */
+static int
+copyfile_range_load(struct copyfile *src, struct copyfile *dst, off_t offset,
+    off_t length, uint8_t *digest, struct timeval *tvo, struct timeval *tvf)
+{
+	uintmax_t sdev, sino, ddev, dino;
+	intmax_t ssize, smtime, roff, rlen, tosec, tfsec;
+	long snsec, tousec, tfusec;
+	char fn[PATH_MAX], name[16], end[4];
+	unsigned int byte;
+	size_t i;
+	FILE *f;
+	int fd, ret;
+
+	if (copyfile_range_name(dst, offset, fn, sizeof fn) != 0)
+		return (-1);
+	if ((fd = open(fn, O_RDONLY|O_NOFOLLOW)) < 0 ||
+	    (f = fdopen(fd, "r")) == NULL) {
+		ERROR("%s: %s", fn, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	ret = -1;
+	if (fscanf(f, RANGE_MAGIC " src %ju %ju %jd %jd.%ld dst %ju %ju "
+	    "range %jd %jd time %jd.%ld %jd.%ld digest %15s ", &sdev, &sino,
+	    &ssize, &smtime, &snsec, &ddev, &dino, &roff, &rlen, &tosec,
+	    &tousec, &tfsec, &tfusec, name) != 14) {
+		ERROR("%s: invalid range record", fn);
+		goto done;
+	}
+	if (sdev != (uintmax_t)src->st.st_dev ||
+	    sino != (uintmax_t)src->st.st_ino ||
+	    ssize != (intmax_t)src->st.st_size ||
+	    smtime != (intmax_t)src->st.st_mtim.tv_sec ||
+	    snsec != (long)src->st.st_mtim.tv_nsec ||
+	    ddev != (uintmax_t)dst->st.st_dev ||
+	    dino != (uintmax_t)dst->st.st_ino ||
+	    roff != (intmax_t)offset || rlen != (intmax_t)length) {
+		ERROR("%s: stale range record", fn);
+		goto done;
+	}
+	if (tsd_digest_lookup(name) != tsdfx_digest) {
+		ERROR("%s: range record uses a different digest", fn);
+		goto done;
+	}
+	for (i = 0; i < tsd_digest_len(tsdfx_digest); ++i) {
+		if (fscanf(f, "%2x", &byte) != 1)
+			break;
+		digest[i] = byte;
+	}
+	if (i < tsd_digest_len(tsdfx_digest) ||
+	    fscanf(f, " %3s", end) != 1 || strcmp(end, "end") != 0) {
+		ERROR("%s: invalid range record", fn);
+		goto done;
+	}
+	tvo->tv_sec = tosec;
+	tvo->tv_usec = tousec;
+	tvf->tv_sec = tfsec;
+	tvf->tv_usec = tfusec;
+	ret = 0;
+done:
+	fclose(f);
+	unlink(fn);
+	return (ret);
+}
+
 /* close */
 static void
 copyfile_close(struct copyfile *cf)
@@ -440,17 +1886,425 @@ copyfile_close(struct copyfile *cf)
 	}
 	if (cf->fd >= 0)
 		close(cf->fd);
-	memset(cf, 0, sizeof *cf + cf->bufsize);
+	if (cf->dfd >= 0)
+		close(cf->dfd);
+	if (cf->ifd >= 0)
+		close(cf->ifd);
+	memset(cf, 0, sizeof *cf);
 	free(cf);
 }
 
+/*
+ * Hash stage: update the running digest.  Once a block has been
+ * compared or copied, the destination is identical to the source as
+ * far as our buffers are concerned, so only the source is hashed; the
+ * destination can be verified separately by reading it back.
+ */
+static int
+copypipe_hash(struct copypipe *cp, const struct copyblock *cb)
+{
+	size_t len, off;
+
+	if (cb->write == CB_HOLE || cb->write == CB_PUNCH) {
+		/* holes hash the same as the zeroes they read as */
+		for (off = 0; off < cb->len; off += len) {
+			len = cb->len - off;
+			if (len > sizeof zeroblock)
+				len = sizeof zeroblock;
+			copyfile_update(cp->src, zeroblock, len);
+		}
+		if (cp->manifest != NULL)
+			copier_manifest_update(cp->manifest, NULL, cb->len);
+		return (0);
+	}
+	copyfile_update(cp->src, cb->sbuf, cb->len);
+	if (cp->manifest != NULL) {
+		if (cb->digested)
+			copier_manifest_add(cp->manifest, cb->digest);
+		else
+			copier_manifest_update(cp->manifest, cb->sbuf, cb->len);
+	}
+	return (0);
+}
+
+/* write stage: write the block to the destination if needed */
+static int
+copypipe_output(struct copypipe *cp, const struct copyblock *cb)
+{
+
+	switch (cb->write) {
+	case CB_WRITE:
+		return (copyfile_write(cp->dst, cb));
+	case CB_KCOPY:
+		return (copyfile_kcopy(cp->src, cp->dst, cb));
+	case CB_PUNCH:
+		return (copyfile_punch(cp->dst, cb));
+	default:
+		return (0);
+	}
+}
+
+/* drop both files from the page cache up to the end of a block */
+static void
+copypipe_dropbehind(struct copypipe *cp, const struct copyblock *cb)
+{
+
+	copyfile_dropbehind(cp->src, cb->offset + cb->len);
+	copyfile_dropbehind(cp->dst, cb->offset + cb->len);
+}
+
+static int
+copypipe_write(struct copypipe *cp, const struct copyblock *cb)
+{
+
+	if (copypipe_output(cp, cb) != 0)
+		return (-1);
+	copypipe_dropbehind(cp, cb);
+	return (0);
+}
+
+#if HAVE_PTHREAD_CREATE
+/*
+ * Run one stage of the pipeline: wait for blocks to be submitted and
+ * pass them to the stage function in order until the pipeline is shut
+ * down and there are no more blocks.  After an error, blocks are still
+ * consumed, but no longer processed.
+ */
+static void
+copypipe_run(struct copypipe *cp, unsigned long *count, copystage_func *func)
+{
+	struct copyblock *cb;
+	int error;
+
+	pthread_mutex_lock(&cp->mtx);
+	for (;;) {
+		while (*count == cp->nread && !cp->done)
+			pthread_cond_wait(&cp->cond, &cp->mtx);
+		if (*count == cp->nread)
+			break;
+		cb = &cp->block[*count % cp->nblocks];
+		error = cp->error;
+		pthread_mutex_unlock(&cp->mtx);
+		if (error == 0 && func(cp, cb) != 0)
+			error = errno ? errno : EIO;
+		pthread_mutex_lock(&cp->mtx);
+		if (error != 0 && cp->error == 0)
+			cp->error = error;
+		++*count;
+		pthread_cond_broadcast(&cp->cond);
+	}
+	pthread_mutex_unlock(&cp->mtx);
+}
+
+static void *
+copypipe_hasher(void *arg)
+{
+	struct copypipe *cp = arg;
+
+	copypipe_run(cp, &cp->nhashed, copypipe_hash);
+	return (NULL);
+}
+
+/*
+ * Run the write stage using io_uring: queue writes for all the blocks
+ * that are ready, up to the queue depth, submit them at once and wait
+ * for all of them to complete before releasing the blocks.  Blocks that
+ * the kernel is to copy are handled synchronously in between.
+ */
+static void
+copypipe_run_uring(struct copypipe *cp, struct tsd_uring *ur)
+{
+	struct copyblock *cb;
+	unsigned long first;
+	unsigned int i, n, queued;
+	uint64_t ud;
+	size_t len;
+	int error, res;
+
+	pthread_mutex_lock(&cp->mtx);
+	for (;;) {
+		while (cp->nwritten == cp->nread && !cp->done)
+			pthread_cond_wait(&cp->cond, &cp->mtx);
+		if (cp->nwritten == cp->nread)
+			break;
+		first = cp->nwritten;
+		n = cp->nread - first;
+		if (n > tsdfx_qdepth)
+			n = tsdfx_qdepth;
+		error = cp->error;
+		pthread_mutex_unlock(&cp->mtx);
+		for (i = queued = 0; error == 0 && i < n; ++i) {
+			cb = &cp->block[(first + i) % cp->nblocks];
+			if (cb->write != CB_WRITE) {
+				if (copypipe_output(cp, cb) != 0)
+					error = errno ? errno : EIO;
+				continue;
+			}
+			/* leave an unaligned tail for the short write path */
+			len = cb->len;
+			if (cp->dst->dfd >= 0 && len > DIO_ALIGN)
+				len &= ~(size_t)(DIO_ALIGN - 1);
+			if (tsd_uring_write(ur, copyfile_iofd(cp->dst,
+			    cb->dbuf, cb->offset, len), cb->dbuf,
+			    len, cb->offset, i) != 0) {
+				ERROR("unable to queue write: %s",
+				    strerror(errno));
+				error = errno;
+			} else {
+				++queued;
+			}
+		}
+		while (queued > 0) {
+			if (tsd_uring_reap(ur, &ud, &res) != 1) {
+				if (tsd_uring_submit(ur, 1) < 0) {
+					ERROR("io_uring_enter(): %s",
+					    strerror(errno));
+					error = errno;
+					break;
+				}
+				continue;
+			}
+			--queued;
+			cb = &cp->block[(first + ud) % cp->nblocks];
+			if (res == -EINVAL && cp->dst->dfd >= 0)
+				res = 0;	/* retry through the cache */
+			if (res < 0) {
+				ERROR("%s: write(): %s", cp->dst->pname,
+				    strerror(-res));
+				if (error == 0)
+					error = -res;
+			} else if ((size_t)res < cb->len && error == 0 &&
+			    copyfile_pwrite(cp->dst, cb->dbuf + res,
+			    cb->len - res, cb->offset + res) != 0) {
+				error = errno;
+			}
+		}
+		/* the kernel may still be writing from these blocks */
+		if (queued > 0 && tsd_uring_drain(ur) != 0)
+			ERROR("io_uring_enter(): %s", strerror(errno));
+		if (error == 0)
+			copypipe_dropbehind(cp,
+			    &cp->block[(first + n - 1) % cp->nblocks]);
+		pthread_mutex_lock(&cp->mtx);
+		if (error != 0 && cp->error == 0)
+			cp->error = error;
+		cp->nwritten += n;
+		pthread_cond_broadcast(&cp->cond);
+	}
+	pthread_mutex_unlock(&cp->mtx);
+}
+
+static void *
+copypipe_writer(void *arg)
+{
+	struct copypipe *cp = arg;
+	struct tsd_uring *ur;
+
+	if (tsdfx_qdepth > 0 &&
+	    (ur = tsd_uring_create(tsdfx_qdepth)) != NULL) {
+		if (tsd_uring_supported(ur, TSD_URING_WRITE)) {
+			copypipe_run_uring(cp, ur);
+			tsd_uring_destroy(ur);
+			return (NULL);
+		}
+		tsd_uring_destroy(ur);
+	}
+	copypipe_run(cp, &cp->nwritten, copypipe_write);
+	return (NULL);
+}
+#endif
+
+/*
+ * Prepare the pipeline.  If the source is larger than a single block,
+ * start the hash and write threads; signals are blocked in the new
+ * threads so they are always delivered to the main thread.  If the
+ * threads can't be started, everything runs synchronously.  The ring
+ * must be at least as large as the io_uring queue depth, since that is
+ * how many blocks the write stage will try to have in flight.  Up to
+ * one spare source buffer per block is set aside for the read-ahead.
+ */
+static int
+copypipe_init(struct copypipe *cp, struct copyfile *src,
+    struct copyfile *dst, size_t blocksize, unsigned int nspare)
+{
+	unsigned int i;
+	char *buf;
+#if HAVE_PTHREAD_CREATE
+	sigset_t all, saved;
+#endif
+
+	cp->src = src;
+	cp->dst = dst;
+	cp->blocksize = blocksize;
+	cp->nblocks = 1;
+	if (src->st.st_size > (off_t)blocksize) {
+		cp->nblocks = tsdfx_qdepth > NBLOCKS ? tsdfx_qdepth : NBLOCKS;
+		while (cp->nblocks > 2 &&
+		    2 * cp->nblocks * blocksize > MAX_RING)
+			cp->nblocks--;
+	}
+	if (nspare > cp->nblocks)
+		nspare = cp->nblocks;
+	cp->nspare = nspare;
+	if ((cp->block = calloc(cp->nblocks, sizeof *cp->block)) == NULL)
+		return (-1);
+	if ((buf = copybuf_get((2 * cp->nblocks + nspare) * blocksize)) == NULL)
+		return (-1);
+	for (i = 0; i < cp->nblocks; ++i) {
+		cp->block[i].sbuf = buf + 2 * i * blocksize;
+		cp->block[i].dbuf = cp->block[i].sbuf + blocksize;
+	}
+	cp->spare = buf + 2 * cp->nblocks * blocksize;
+#if HAVE_PTHREAD_CREATE
+	if (src->st.st_size <= (off_t)blocksize)
+		return (0);
+	if (pthread_mutex_init(&cp->mtx, NULL) != 0)
+		return (0);
+	if (pthread_cond_init(&cp->cond, NULL) != 0) {
+		pthread_mutex_destroy(&cp->mtx);
+		return (0);
+	}
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	if (pthread_create(&cp->hasher, NULL, copypipe_hasher, cp) == 0) {
+		if (pthread_create(&cp->writer, NULL, copypipe_writer, cp) == 0) {
+			cp->threaded = 1;
+		} else {
+			pthread_mutex_lock(&cp->mtx);
+			cp->done = 1;
+			pthread_cond_broadcast(&cp->cond);
+			pthread_mutex_unlock(&cp->mtx);
+			pthread_join(cp->hasher, NULL);
+			cp->done = 0;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (!cp->threaded) {
+		VERBOSE("unable to start pipeline threads");
+		pthread_cond_destroy(&cp->cond);
+		pthread_mutex_destroy(&cp->mtx);
+	}
+#endif
+	return (0);
+}
+
+/*
+ * Return the next free block, waiting for one to become available if
+ * necessary.  Returns NULL if a stage has failed.
+ */
+static struct copyblock *
+copypipe_next(struct copypipe *cp)
+{
+	struct copyblock *cb;
+	int error;
+
+#if HAVE_PTHREAD_CREATE
+	if (cp->threaded) {
+		pthread_mutex_lock(&cp->mtx);
+		while (cp->error == 0 &&
+		    (cp->nread - cp->nhashed >= cp->nblocks ||
+		    cp->nread - cp->nwritten >= cp->nblocks))
+			pthread_cond_wait(&cp->cond, &cp->mtx);
+		error = cp->error;
+		pthread_mutex_unlock(&cp->mtx);
+	} else
+#endif
+		error = cp->error;
+	if (error != 0) {
+		errno = error;
+		return (NULL);
+	}
+	cb = &cp->block[cp->nread % cp->nblocks];
+	cb->offset = 0;
+	cb->len = 0;
+	cb->write = 0;
+	cb->digested = 0;
+	return (cb);
+}
+
+/*
+ * Hand a block over to the hash and write stages.
+ */
+static int
+copypipe_submit(struct copypipe *cp, struct copyblock *cb, off_t offset,
+    size_t len)
+{
+
+	ASSERT(cb == &cp->block[cp->nread % cp->nblocks]);
+	cb->offset = offset;
+	cb->len = len;
+#if HAVE_PTHREAD_CREATE
+	if (cp->threaded) {
+		pthread_mutex_lock(&cp->mtx);
+		cp->nread++;
+		pthread_cond_broadcast(&cp->cond);
+		pthread_mutex_unlock(&cp->mtx);
+		return (0);
+	}
+#endif
+	cp->nread++;
+	copypipe_hash(cp, cb);
+	cp->nhashed++;
+	if (copypipe_write(cp, cb) != 0) {
+		cp->error = errno ? errno : EIO;
+		return (-1);
+	}
+	cp->nwritten++;
+	return (0);
+}
+
+/*
+ * Wait for all submitted blocks to pass through the pipeline, stop the
+ * threads and release the buffers.  Returns -1 if any stage failed.
+ */
+static int
+copypipe_finish(struct copypipe *cp)
+{
+
+#if HAVE_PTHREAD_CREATE
+	if (cp->threaded) {
+		pthread_mutex_lock(&cp->mtx);
+		cp->done = 1;
+		pthread_cond_broadcast(&cp->cond);
+		pthread_mutex_unlock(&cp->mtx);
+		pthread_join(cp->hasher, NULL);
+		pthread_join(cp->writer, NULL);
+		pthread_cond_destroy(&cp->cond);
+		pthread_mutex_destroy(&cp->mtx);
+		cp->threaded = 0;
+	}
+#endif
+	cp->done = 1;
+	/* the buffers belong to the pool and are reused */
+	free(cp->block);
+	cp->block = NULL;
+	if (cp->error != 0) {
+		errno = cp->error;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Account for a block read from the source under each rate limit, and
+ * wait until all of them allow us to continue.
+ */
+static void
+copier_throttle(size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < tsdfx_nratelimits && !killed; ++i)
+		tsd_ratelimit_consume(&tsdfx_ratelimit[i], len);
+}
+
 static void
 digest2hex(const struct copyfile *cf, char *s, const size_t len)
 {
-	int i;
+	size_t i;
 
-	ASSERT(len >= SHA1_DIGEST_LEN * 2 + 1);
-	for (i = 0; i < SHA1_DIGEST_LEN; ++i) {
+	ASSERT(len >= tsd_digest_len(tsdfx_digest) * 2 + 1);
+	for (i = 0; i < tsd_digest_len(tsdfx_digest); ++i) {
 		s[i * 2] = "0123456789abcdef"[cf->digest[i] >> 4];
 		s[i * 2 + 1] = "0123456789abcdef"[cf->digest[i] & 0xf];
 	}
@@ -461,28 +2315,196 @@ digest2hex(const struct copyfile *cf, char *s, const size_t len)
 void
 tsdfx_log_complete(const struct copyfile *src, const struct copyfile *dst)
 {
-	char hex[SHA1_DIGEST_LEN * 2 + 1];
+	char hex[TSD_DIGEST_MAX_LEN * 2 + 1];
 
 	digest2hex(dst, hex, sizeof(hex));
-	NOTICE("copied %s to %s len %zu bytes sha1 %s in %lu.%03lu s",
-	    src->name, dst->name, (size_t)dst->st.st_size, hex,
+	NOTICE("copied %s to %s len %zu bytes %s %s in %lu.%03lu s",
+	    src->name, dst->name, (size_t)dst->st.st_size,
+	    tsd_digest_name(tsdfx_digest), hex,
 	    (unsigned long)dst->tve.tv_sec,
 	    (unsigned long)dst->tve.tv_usec / 1000);
 }
 
-/* log an interrupted transfer */
-void
-tsdfx_log_interrupted(const struct copyfile *src, const struct copyfile *dst)
+/* log an interrupted transfer */
+void
+tsdfx_log_interrupted(const struct copyfile *src, const struct copyfile *dst)
+{
+	char hex[TSD_DIGEST_MAX_LEN * 2 + 1];
+
+	digest2hex(dst, hex, sizeof(hex));
+	NOTICE("copied %s to %s len %zu bytes %s %s in %lu.%03lu s"
+	    " (interrupted by %s)",
+	    src->name, dst->name, (size_t)dst->st.st_size,
+	    tsd_digest_name(tsdfx_digest), hex,
+	    (unsigned long)dst->tve.tv_sec,
+	    (unsigned long)dst->tve.tv_usec / 1000,
+	    killed ? "signal" : "size limitation");
+}
+
+/* log a combined transfer */
+void
+tsdfx_log_joined(const struct copyfile *src, const struct copyfile *dst,
+    off_t rangesize)
+{
+	char hex[TSD_DIGEST_MAX_LEN * 2 + 1];
+
+	digest2hex(dst, hex, sizeof(hex));
+	NOTICE("copied %s to %s len %zu bytes %s/%jd %s in %lu.%03lu s",
+	    src->name, dst->name, (size_t)dst->st.st_size,
+	    tsd_digest_name(tsdfx_digest), (intmax_t)rangesize, hex,
+	    (unsigned long)dst->tve.tv_sec,
+	    (unsigned long)dst->tve.tv_usec / 1000);
+}
+
+/*
+ * Dry run: work out how much of the source, or of the given range of
+ * it, would have to be written to the destination, without creating or
+ * changing anything.  Both files are opened read-only and compared
+ * block by block as in a real copy, and the time spent reading the
+ * source is recorded so the caller can estimate how long the real copy
+ * would take.
+ */
+static int
+tsdfx_copier_plan(const char *srcfn, const char *dstfn, off_t offset,
+    off_t length)
+{
+	char dir[PATH_MAX], *p;
+	struct copyfile *src, *dst;
+	struct timeval tvo, tvf;
+	char *buf;
+	size_t bs;
+	off_t end;
+	int serrno;
+
+	memset(&copyplan, 0, sizeof copyplan);
+
+	/* what's my umask? */
+	umask(mumask = umask(0));
+
+	/* open the source, and the destination if it exists */
+	src = dst = NULL;
+	if ((src = copyfile_open(srcfn, O_RDONLY, 0)) == NULL)
+		goto fail;
+	if ((dst = copyfile_open(dstfn, O_RDONLY, 0)) == NULL) {
+		if (errno != ENOENT)
+			goto fail;
+		/* we would have to create it */
+		if (strlcpy(dir, dstfn, sizeof dir) >= sizeof dir) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+		for (p = dir + strlen(dir); p > dir && p[-1] == '/'; --p)
+			/* nothing */ ;
+		while (p > dir && p[-1] != '/')
+			--p;
+		if (p == dir)
+			strlcpy(dir, ".", sizeof dir);
+		else if (p == dir + 1)
+			dir[1] = '\0';
+		else
+			p[-1] = '\0';
+		if (access(dir, W_OK | X_OK) != 0) {
+			ERROR("%s: %s", dir, strerror(errno));
+			goto fail;
+		}
+		NOTICE("would create %s %s",
+		    copyfile_isdir(src) ? "directory" : "file", dstfn);
+	} else if (!copyfile_isdir(dst) && access(dst->name, W_OK) != 0) {
+		ERROR("%s: %s", dst->pname, strerror(errno));
+		goto fail;
+	}
+
+	/* compare size and times, unless we only have part of the file */
+	if (!tsdfx_force && dst != NULL && length == 0 &&
+	    copyfile_comparestat(src, dst) == 0) {
+		VERBOSE("mode, size and mtime match");
+		goto done;
+	}
+
+	/* directories only need their mode and times set */
+	if (copyfile_isdir(src))
+		goto done;
+
+	/* read and compare */
+	bs = copyfile_blocksize(src, dst != NULL ? dst : src);
+	if ((buf = copybuf_get(2 * bs)) == NULL)
+		goto fail;
+	src->buf = buf;
+	src->bufsize = bs;
+	src->offset = offset;
+	if (dst != NULL) {
+		dst->buf = buf + bs;
+		dst->bufsize = bs;
+		dst->offset = offset;
+	}
+	end = src->st.st_size;
+	if (length > 0 && length < end - offset)
+		end = offset + length;
+	while (src->offset < end) {
+		if (killed) {
+			errno = EINTR;
+			goto fail;
+		}
+		gettimeofday(&tvo, NULL);
+		if (copyfile_read(src) != 0)
+			goto fail;
+		gettimeofday(&tvf, NULL);
+		timersub(&tvf, &tvo, &tvf);
+		timeradd(&copyplan.tv, &tvf, &copyplan.tv);
+		if (src->buflen == 0)
+			break;
+		if ((off_t)src->buflen > end - src->offset)
+			src->buflen = end - src->offset;
+		copyplan.size += src->buflen;
+		if (dst != NULL && dst->offset < dst->st.st_size) {
+			if (copyfile_read(dst) != 0)
+				goto fail;
+		} else if (dst != NULL) {
+			dst->buflen = 0;
+		}
+		if (dst == NULL || copyfile_compare(src, dst) != 0)
+			copyplan.len += src->buflen;
+		src->offset += src->buflen;
+		if (dst != NULL)
+			dst->offset = src->offset;
+	}
+	NOTICE("would copy %ju of %ju bytes from %s to %s, read in %lu.%03lu s",
+	    copyplan.len, copyplan.size, srcfn, dstfn,
+	    (unsigned long)copyplan.tv.tv_sec,
+	    (unsigned long)copyplan.tv.tv_usec / 1000);
+done:
+	copyfile_close(src);
+	if (dst != NULL)
+		copyfile_close(dst);
+	return (0);
+fail:
+	serrno = errno;
+	USERERROR("failed to check %s against %s", srcfn, dstfn);
+	if (src != NULL)
+		copyfile_close(src);
+	if (dst != NULL)
+		copyfile_close(dst);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Report the outcome of a copy on stdout: 0 for success or 1 for
+ * failure, followed in dry-run mode by the number of bytes which would
+ * have been written, the number of bytes compared, and the time in
+ * microseconds spent reading the source.
+ */
+static void
+tsdfx_copier_report(int ret)
 {
-	char hex[SHA1_DIGEST_LEN * 2 + 1];
 
-	digest2hex(dst, hex, sizeof(hex));
-	NOTICE("copied %s to %s len %zu bytes sha1 %s in %lu.%03lu s"
-	    " (interrupted by %s)",
-	    src->name, dst->name, (size_t)dst->st.st_size, hex,
-	    (unsigned long)dst->tve.tv_sec,
-	    (unsigned long)dst->tve.tv_usec / 1000,
-	    killed ? "signal" : "size limitation");
+	if (tsdfx_dryrun)
+		printf("%d %ju %ju %ju\n", ret == 0 ? 0 : 1, copyplan.len,
+		    copyplan.size, (uintmax_t)copyplan.tv.tv_sec * 1000000 +
+		    (uintmax_t)copyplan.tv.tv_usec);
+	else
+		printf("%d\n", ret == 0 ? 0 : 1);
+	fflush(stdout);
 }
 
 /* read from both files, compare and write if necessary */
@@ -494,7 +2516,21 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 	off_t have, need;
 #endif
 	struct copyfile *src, *dst;
-	int serrno;
+	struct copier_manifest *omf, *nmf;
+	struct stat mst;
+	size_t bs;
+	char mfn[PATH_MAX];
+	struct copypipe cp;
+	tsd_digest_ctx jctx;
+	struct copyblock *cb;
+	struct copyahead ra;
+	struct tsd_uring *ur;
+	unsigned long mblocks;
+#if HAVE_DECL_SEEK_HOLE
+	off_t hole;
+#endif
+	off_t clonelen;
+	int interrupted, match, readdst, resumed, serrno;
 	time_t now;
 
 	/* check file names */
@@ -505,28 +2541,24 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 	}
 	VERBOSE("%s to %s", srcfn, dstfn);
 
+	if (tsdfx_dryrun)
+		return (tsdfx_copier_plan(srcfn, dstfn, 0, 0));
+
 	/*
-	 * It would be nice to have a fully implemented dry-run mode:
-	 *
-	 * - Check that we have permission to create or write to the
-         *   destination file.
-	 * - If the destination file exists, open it read-only, otherwise
-         *   open /dev/null.
-	 * - Read and compare as usual, but do not write.
-	 * - Do not set mode and times at the end.
-	 *
-	 * Until we have time to implement this, just sleep and return.
+	 * In batch mode, a previous file may have made us fall back from
+	 * copy_file_range(2) for reasons which need not apply to this one.
 	 */
-	if (tsdfx_dryrun) {
-		sleep(5);
-		return (0);
-	}
+	kcopy_method = KCOPY_COPY_FILE_RANGE;
 
 	/* what's my umask? */
 	umask(mumask = umask(0));
 
 	/* open source and destination files / directories */
+	memset(&cp, 0, sizeof cp);
+	memset(&ra, 0, sizeof ra);
+	omf = nmf = NULL;
 	src = dst = NULL;
+	ur = NULL;
 	if ((src = copyfile_open(srcfn, O_RDONLY, 0)) == NULL)
 		goto fail;
 	if ((dst = copyfile_open(dstfn, O_RDWR|O_CREAT,
@@ -555,9 +2587,51 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 		return (0);
 	}
 
+	/* pick the I/O size */
+	bs = copyfile_blocksize(src, dst);
+	src->bufsize = dst->bufsize = bs;
+	VERBOSE("using %zu-byte blocks", bs);
+
+	/*
+	 * Look for a manifest of the destination's blocks, and start a
+	 * new one if the source is large enough to warrant it.
+	 */
+	if (copyfile_sidename(dst, "tsdfx-manifest", mfn, sizeof mfn) != 0)
+		mfn[0] = '\0';
+	if (mfn[0] != '\0' && dst->st.st_size > 0) {
+		omf = copier_manifest_load(mfn, &dst->st, bs);
+		if (omf != NULL)
+			VERBOSE("%s: using block manifest", dst->pname);
+		else if (errno != ENOENT)
+			VERBOSE("%s: %s", mfn, strerror(errno));
+	}
+	if (mfn[0] != '\0' && src->st.st_size >= MANIFEST_MIN)
+		nmf = copier_manifest_new(bs);
+
+	/* pick up where an earlier attempt left off, if we can */
+	resumed = (copyfile_journal_load(src, dst) == 0);
+	if (resumed && nmf != NULL && (omf == NULL ||
+	    copier_manifest_copy(nmf, omf, dst->offset) != 0)) {
+		/* can't cover the part we skipped */
+		copier_manifest_free(nmf);
+		nmf = NULL;
+	}
+
+	/*
+	 * If the source has stopped changing, try to clone it.  We still
+	 * need to read it to compute the digest, but there is no need to
+	 * read, compare or write the destination within the cloned range.
+	 */
+	clonelen = 0;
+	time(&now);
+	if (now - src->st.st_mtime >= MIN_AGE &&
+	    dst->st.st_size <= src->st.st_size)
+		clonelen = copyfile_clone(src, dst);
+
 #if HAVE_STATVFS
 	/* check for available space */
-	if (src->st.st_size > dst->st.st_size && fstatvfs(dst->fd, &st) == 0) {
+	if (clonelen == 0 && src->st.st_size > dst->st.st_size &&
+	    fstatvfs(dst->fd, &st) == 0) {
 		have = (off_t)(st.f_bavail * st.f_bsize);
 		need = src->st.st_size - dst->st.st_size;
 		if (have < need) {
@@ -572,13 +2646,71 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 	}
 #endif
 
+	/* reserve space for what we are about to write */
+	if (clonelen == 0 && copyfile_preallocate(src, dst) != 0) {
+		USERERROR("insufficient space for %s: %s", dstfn,
+		    strerror(errno));
+		/* release whatever we did get, or the file itself */
+		if (dst->st.st_size == 0)
+			unlink(dstfn);
+		else
+			(void)ftruncate(dst->fd, dst->st.st_size);
+		goto fail;
+	}
+
 	/* resumed? */
-	if (dst->st.st_size > 0)
+	if (resumed)
+		NOTICE("resuming %s at %zu bytes from journal", dst->name,
+		    (size_t)dst->offset);
+	else if (clonelen == 0 && dst->st.st_size > 0)
 		NOTICE("resuming %s at %zu bytes", dst->name,
 		    (size_t)dst->st.st_size);
 
+#if HAVE_STATX
+	/* set up io_uring for the main thread if requested */
+	if (tsdfx_qdepth > 0) {
+		/* two statx, a read and up to qdepth reads ahead */
+		if ((ur = tsd_uring_create(tsdfx_qdepth + 3)) == NULL) {
+			VERBOSE("io_uring unavailable: %s", strerror(errno));
+		} else if (!tsd_uring_supported(ur, TSD_URING_STATX) ||
+		    !tsd_uring_supported(ur, TSD_URING_READ)) {
+			VERBOSE("io_uring lacks statx or read support");
+			tsd_uring_destroy(ur);
+			ur = NULL;
+		}
+	}
+#endif
+
 	/* loop over the input and compare with the destination */
+	if (tsdfx_direct) {
+		(void)copyfile_direct(src);
+		(void)copyfile_direct(dst);
+	}
+	copyfile_advise(src);
+	copyfile_advise(dst);
+	cp.manifest = nmf;
+	if (copypipe_init(&cp, src, dst, bs,
+	    ur != NULL ? tsdfx_qdepth : 0) != 0)
+		goto fail;
+	copyahead_init(&ra, cp.spare, cp.nspare, bs);
+	/* with a manifest, only read the destination if it doesn't match */
+	readdst = (ur != NULL && omf == NULL);
+	mblocks = 0;
 	while (!killed) {
+		/* get a free block */
+		if ((cb = copypipe_next(&cp)) == NULL)
+			goto fail;
+		src->buf = cb->sbuf;
+		dst->buf = cb->dbuf;
+
+		/* re-stat the source, or both files and read both blocks */
+#if HAVE_STATX
+		if (ur != NULL) {
+			if (copyfile_uring_step(ur, &ra, cb, src, dst,
+			    readdst) != 0)
+				goto fail;
+		} else
+#endif
 		if (copyfile_refresh(src) != 0)
 			goto fail;
 
@@ -590,37 +2722,92 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 		time(&now);
 		VERBOSE("sdiff %zu < %zu tdiff %lu < %lu",
 		    (size_t)(src->st.st_size - src->offset),
-		    (size_t)(2*BLOCKSIZE),
+		    2 * bs,
 		    (unsigned long)(now - src->st.st_mtime),
 		    (unsigned long)MIN_AGE);
 		if ((maxsize == 0 || (size_t)src->offset <= maxsize) &&
 		    src->st.st_size > src->offset &&
-		    src->st.st_size - src->offset < 2*BLOCKSIZE &&
-		    now > src->st.st_mtime &&
+		    src->st.st_size - src->offset < 2 * (off_t)bs &&
+		    now >= src->st.st_mtime &&
 		    now - src->st.st_mtime < MIN_AGE) {
 			VERBOSE("waiting for the file to grow");
-			sleep(1);
+			if (copyfile_wait(src,
+			    MIN_AGE - (now - src->st.st_mtime)) == 0)
+				continue;
+			VERBOSE("the file has been closed");
+		}
+
+#if HAVE_DECL_SEEK_HOLE
+		/*
+		 * Skip over holes in the source.  If the destination has
+		 * data in the same range, we need to punch a hole in it;
+		 * otherwise, the final ftruncate() will take care of it.
+		 */
+		if ((hole = copyfile_hole(src)) > 0) {
+			if (ur == NULL && copyfile_refresh(dst) != 0)
+				goto fail;
+			cb->write = src->offset >= clonelen &&
+			    dst->offset < dst->st.st_size ? CB_PUNCH : CB_HOLE;
+			VERBOSE("skipping %zu-byte hole at %zu",
+			    (size_t)hole, (size_t)src->offset);
+			if (copypipe_submit(&cp, cb, src->offset, hole) != 0)
+				goto fail;
+			copyfile_advance(src, hole);
+			copyfile_advance(dst, hole);
 			continue;
 		}
+#endif
 
 		/* read as much as we can from the source file */
-		if (copyfile_read(src) != 0)
+		copyfile_readahead(src, src->offset + bs, bs);
+		if (ur == NULL && copyfile_read(src) != 0)
 			goto fail;
 		if (src->buflen == 0)
 			/* end of source file */
 			break;
 
-		/* check and read from destination file */
-		if (copyfile_refresh(dst) != 0 || copyfile_read(dst) != 0)
+		/*
+		 * Check and read from destination file.  Note that its
+		 * size may lag behind our offset while writes are still
+		 * in the pipeline.
+		 */
+		if (src->offset + (off_t)src->buflen <= clonelen) {
+			/* already cloned */
+		} else if (ur == NULL && copyfile_refresh(dst) != 0) {
 			goto fail;
-		if (copyfile_compare(src, dst) != 0) {
-			/* input and output differ */
-			copyfile_copy(src, dst);
-			if (copyfile_write(dst) != 0)
+		} else if (dst->offset >= dst->st.st_size) {
+			/* nothing to compare with */
+			if (tsdfx_kcopy) {
+				cb->write = CB_KCOPY;
+			} else {
+				copyfile_copy(src, dst);
+				cb->write = CB_WRITE;
+			}
+		} else if (omf != NULL &&
+		    (match = copier_manifest_match(omf, src->offset, src->buf,
+		    src->buflen, cb->digest)) >= 0) {
+			/* compare with the manifest instead of reading */
+			cb->digested = (src->buflen == bs);
+			mblocks++;
+			if (!match) {
+				copyfile_copy(src, dst);
+				cb->write = CB_WRITE;
+			}
+		} else {
+			copyfile_readahead(dst, dst->offset + bs, bs);
+			if (!readdst && copyfile_read(dst) != 0)
 				goto fail;
+			if (copyfile_compare(src, dst) != 0) {
+				/* input and output differ */
+				copyfile_copy(src, dst);
+				cb->write = CB_WRITE;
+			}
 		}
-		copyfile_advance(src);
-		copyfile_advance(dst);
+		copier_throttle(src->buflen);
+		if (copypipe_submit(&cp, cb, src->offset, src->buflen) != 0)
+			goto fail;
+		copyfile_advance(src, cb->len);
+		copyfile_advance(dst, cb->len);
 
 		/* stop if we have passed the threshold */
 		if (maxsize && (size_t)src->st.st_size > maxsize) {
@@ -630,14 +2817,50 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 	}
 
 	/* normal termination (file end or maxsize reached) */
+	if (mblocks > 0)
+		VERBOSE("%s: checked %lu blocks against the manifest",
+		    dst->pname, mblocks);
+	if (copyahead_drain(ur, &ra) != 0)
+		goto fail;
+	tsd_uring_destroy(ur);
+	ur = NULL;
+	if (copypipe_finish(&cp) != 0)
+		goto fail;
+	interrupted = killed || (maxsize && (size_t)src->st.st_size > maxsize);
+	if (interrupted && src->offset > 0)
+		jctx = src->digest_ctx;
 	copyfile_copystat(src, dst);
 	if (copyfile_finish(src) != 0 || copyfile_finish(dst) != 0)
 		goto fail;
-	if (memcmp(src->digest, dst->digest, SHA1_DIGEST_LEN) != 0) {
-		ERROR("digest differs after copy");
-		goto fail;
+	if (interrupted && src->offset > 0)
+		(void)copyfile_journal_save(src, dst, &jctx);
+	copyfile_dropbehind(src, src->offset);
+	copyfile_dropbehind(dst, dst->offset);
+	if (!tsdfx_check) {
+		memcpy(dst->digest, src->digest, sizeof dst->digest);
+	} else {
+		if (copyfile_readback(dst, 0) != 0)
+			goto fail;
+		if (memcmp(src->digest, dst->digest,
+		    tsd_digest_len(tsdfx_digest)) != 0) {
+			ERROR("digest differs after copy");
+			goto fail;
+		}
+	}
+
+	/* record the new block manifest, or remove the old one */
+	if (nmf != NULL) {
+		if (fstat(dst->fd, &mst) != 0 ||
+		    copier_manifest_save(nmf, mfn, &mst) != 0) {
+			WARNING("%s: %s", mfn, strerror(errno));
+			(void)unlink(mfn);
+		}
+	} else if (mfn[0] != '\0') {
+		(void)unlink(mfn);
 	}
-	if (killed || (maxsize && (size_t)src->st.st_size > maxsize))
+	copier_manifest_free(omf);
+	copier_manifest_free(nmf);
+	if (interrupted)
 		tsdfx_log_interrupted(src, dst);
 	else
 		tsdfx_log_complete(src, dst);
@@ -647,6 +2870,12 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 
 fail:
 	serrno = errno;
+	/* this waits for any requests into our blocks still in flight */
+	(void)copyahead_drain(ur, &ra);
+	tsd_uring_destroy(ur);
+	copypipe_finish(&cp);
+	copier_manifest_free(omf);
+	copier_manifest_free(nmf);
 	USERERROR("failed to copy %s to %s", srcfn, dstfn);
 	/* if we copied anything at all, we should log it here */
 	if (src != NULL)
@@ -657,29 +2886,441 @@ fail:
 	return (-1);
 }
 
+/*
+ * Copy one range of a file which is being copied in parallel by several
+ * processes.  The source must have stopped changing.  Only the range is
+ * compared and written; the size, mode and times of the destination are
+ * left for tsdfx_copier_join() to set once all the ranges are done.
+ */
+int
+tsdfx_copier_range(const char *srcfn, const char *dstfn, off_t offset,
+    off_t length)
+{
+	struct copyfile *src, *dst;
+	struct copypipe cp;
+	struct copyblock *cb;
+	struct stat st;
+	size_t bs;
+#if HAVE_DECL_SEEK_HOLE
+	off_t hole;
+#endif
+	off_t end;
+	time_t now;
+	int serrno;
+
+	if (!srcfn || !dstfn || !*srcfn || !*dstfn) {
+		errno = EINVAL;
+		return (-1);
+	}
+	VERBOSE("%s to %s at %jd+%jd", srcfn, dstfn, (intmax_t)offset,
+	    (intmax_t)length);
+	if (tsdfx_dryrun)
+		return (tsdfx_copier_plan(srcfn, dstfn, offset, length));
+
+	/* what's my umask? */
+	umask(mumask = umask(0));
+
+	/* open source and destination files */
+	memset(&cp, 0, sizeof cp);
+	src = dst = NULL;
+	if ((src = copyfile_open(srcfn, O_RDONLY, 0)) == NULL)
+		goto fail;
+	if ((dst = copyfile_open(dstfn, O_RDWR|O_CREAT, 0600)) == NULL)
+		goto fail;
+	if (copyfile_isdir(src) || copyfile_isdir(dst)) {
+		errno = EISDIR;
+		goto fail;
+	}
+	time(&now);
+	if (now - src->st.st_mtime < MIN_AGE) {
+		USERERROR("%s is still changing", srcfn);
+		errno = EAGAIN;
+		goto fail;
+	}
+	if (offset > src->st.st_size) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if (length > src->st.st_size - offset)
+		length = src->st.st_size - offset;
+	end = offset + length;
+
+	bs = copyfile_blocksize(src, dst);
+	src->bufsize = dst->bufsize = bs;
+	src->offset = dst->offset = offset;
+	if (tsdfx_direct) {
+		(void)copyfile_direct(src);
+		(void)copyfile_direct(dst);
+	}
+	copyfile_advise(src);
+	copyfile_advise(dst);
+	if (copypipe_init(&cp, src, dst, bs, 0) != 0)
+		goto fail;
+	while (!killed && src->offset < end) {
+		/* get a free block */
+		if ((cb = copypipe_next(&cp)) == NULL)
+			goto fail;
+		src->buf = cb->sbuf;
+		dst->buf = cb->dbuf;
+		if (end - src->offset < (off_t)bs)
+			src->bufsize = dst->bufsize = end - src->offset;
+
+		/* the other ranges may have extended the destination */
+		if (copyfile_refresh(dst) != 0)
+			goto fail;
+
+#if HAVE_DECL_SEEK_HOLE
+		/* skip over holes in the source */
+		if ((hole = copyfile_hole(src)) > 0) {
+			if (hole > end - src->offset)
+				hole = end - src->offset;
+			cb->write = dst->offset < dst->st.st_size ?
+			    CB_PUNCH : CB_HOLE;
+			if (copypipe_submit(&cp, cb, src->offset, hole) != 0)
+				goto fail;
+			copyfile_advance(src, hole);
+			copyfile_advance(dst, hole);
+			continue;
+		}
+#endif
+
+		/* read from the source, and the destination if it is there */
+		copyfile_readahead(src, src->offset + bs, bs);
+		if (copyfile_read(src) != 0)
+			goto fail;
+		if (src->buflen == 0) {
+			USERERROR("%s was truncated", srcfn);
+			errno = ESTALE;
+			goto fail;
+		}
+		if (dst->offset >= dst->st.st_size) {
+			if (tsdfx_kcopy) {
+				cb->write = CB_KCOPY;
+			} else {
+				copyfile_copy(src, dst);
+				cb->write = CB_WRITE;
+			}
+		} else {
+			copyfile_readahead(dst, dst->offset + bs, bs);
+			if (copyfile_read(dst) != 0)
+				goto fail;
+			if (copyfile_compare(src, dst) != 0) {
+				copyfile_copy(src, dst);
+				cb->write = CB_WRITE;
+			}
+		}
+		copier_throttle(src->buflen);
+		if (copypipe_submit(&cp, cb, src->offset, src->buflen) != 0)
+			goto fail;
+		copyfile_advance(src, cb->len);
+		copyfile_advance(dst, cb->len);
+	}
+	if (copypipe_finish(&cp) != 0)
+		goto fail;
+	if (killed) {
+		errno = EINTR;
+		goto fail;
+	}
+
+	/* make sure the source did not change while we were copying */
+	if (fstat(src->fd, &st) != 0)
+		goto fail;
+	if (st.st_size != src->st.st_size ||
+	    st.st_mtim.tv_sec != src->st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != src->st.st_mtim.tv_nsec) {
+		USERERROR("%s changed while being copied", srcfn);
+		errno = ESTALE;
+		goto fail;
+	}
+	if (copyfile_finish(src) != 0)
+		goto fail;
+	copyfile_dropbehind(src, src->offset);
+	copyfile_dropbehind(dst, dst->offset);
+	if (tsdfx_check) {
+		if (copyfile_readback(dst, offset) != 0)
+			goto fail;
+		if (memcmp(src->digest, dst->digest,
+		    tsd_digest_len(tsdfx_digest)) != 0) {
+			ERROR("digest differs after copy");
+			goto fail;
+		}
+	}
+	if (copyfile_range_save(src, dst, offset) != 0)
+		goto fail;
+	VERBOSE("copied %jd bytes at %jd", (intmax_t)length,
+	    (intmax_t)offset);
+	copyfile_close(src);
+	copyfile_close(dst);
+	return (0);
+
+fail:
+	serrno = errno;
+	copypipe_finish(&cp);
+	USERERROR("failed to copy %s to %s", srcfn, dstfn);
+	if (src != NULL)
+		copyfile_close(src);
+	if (dst != NULL)
+		copyfile_close(dst);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Complete a file which has been copied in ranges of the given size by
+ * tsdfx_copier_range(): collect the range records, set the size, mode
+ * and times of the destination, and log the combined digest, which is
+ * the digest of the concatenated digests of the ranges, in order.
+ */
+int
+tsdfx_copier_join(const char *srcfn, const char *dstfn, off_t rangesize)
+{
+	uint8_t digest[TSD_DIGEST_MAX_LEN], rdigest[TSD_DIGEST_MAX_LEN];
+	struct timeval tvo, tvf, rtvo, rtvf;
+	struct copyfile *src, *dst;
+	tsd_digest_ctx ctx;
+	off_t len, off;
+	int complete, serrno;
+
+	if (!srcfn || !dstfn || !*srcfn || !*dstfn || rangesize <= 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	VERBOSE("%s to %s in ranges of %jd", srcfn, dstfn,
+	    (intmax_t)rangesize);
+	if (tsdfx_dryrun)
+		return (0);
+
+	/* what's my umask? */
+	umask(mumask = umask(0));
+
+	src = dst = NULL;
+	if ((src = copyfile_open(srcfn, O_RDONLY, 0)) == NULL)
+		goto fail;
+	if ((dst = copyfile_open(dstfn, O_RDWR, 0)) == NULL)
+		goto fail;
+	if (copyfile_isdir(src) || copyfile_isdir(dst)) {
+		errno = EISDIR;
+		goto fail;
+	}
+
+	/* collect all the records, even if some are missing or stale */
+	tsd_digest_init(&ctx, tsdfx_digest);
+	timerclear(&tvo);
+	timerclear(&tvf);
+	complete = 1;
+	for (off = 0; off < src->st.st_size; off += rangesize) {
+		len = src->st.st_size - off;
+		if (len > rangesize)
+			len = rangesize;
+		if (copyfile_range_load(src, dst, off, len, rdigest,
+		    &rtvo, &rtvf) != 0) {
+			complete = 0;
+			continue;
+		}
+		tsd_digest_update(&ctx, rdigest, tsd_digest_len(tsdfx_digest));
+		if (!timerisset(&tvo) || timercmp(&rtvo, &tvo, <))
+			tvo = rtvo;
+		if (timercmp(&rtvf, &tvf, >))
+			tvf = rtvf;
+	}
+	tsd_digest_final(&ctx, digest);
+	if (!complete) {
+		USERERROR("some parts of %s were not copied", srcfn);
+		errno = ESTALE;
+		goto fail;
+	}
+
+	/* finish the destination and log the result */
+	src->offset = dst->offset = src->st.st_size;
+	copyfile_copystat(src, dst);
+	if (copyfile_finish(src) != 0 || copyfile_finish(dst) != 0)
+		goto fail;
+	memcpy(dst->digest, digest, sizeof dst->digest);
+	timersub(&tvf, &tvo, &dst->tve);
+	tsdfx_log_joined(src, dst, rangesize);
+	copyfile_close(src);
+	copyfile_close(dst);
+	return (0);
+
+fail:
+	serrno = errno;
+	USERERROR("failed to copy %s to %s", srcfn, dstfn);
+	if (src != NULL)
+		copyfile_close(src);
+	if (dst != NULL)
+		copyfile_close(dst);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Copy each of a list of files, read as NUL-terminated source and
+ * destination pairs from the named file or from stdin.  The outcome of
+ * each copy is reported on stdout as a line starting with 0 for success
+ * or 1 for failure, as soon as it is known, so the caller can keep
+ * track of the files while we work through the list.
+ */
+int
+tsdfx_copier_batch(const char *listfn, size_t maxsize)
+{
+	char *srcfn, *dstfn;
+	size_t srcsize, dstsize;
+	unsigned int nfiles, nfailed;
+	FILE *f;
+	int ret;
+
+	if (strcmp(listfn, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(listfn, "r")) == NULL)
+		return (-1);
+	srcfn = dstfn = NULL;
+	srcsize = dstsize = 0;
+	nfiles = nfailed = 0;
+	while (!killed && getdelim(&srcfn, &srcsize, '\0', f) > 0) {
+		if (getdelim(&dstfn, &dstsize, '\0', f) <= 0) {
+			ERROR("%s: missing destination for %s", listfn, srcfn);
+			++nfailed;
+			break;
+		}
+		ret = tsdfx_copier(srcfn, dstfn, maxsize);
+		if (killed)
+			break;
+		++nfiles;
+		if (ret != 0)
+			++nfailed;
+		tsdfx_copier_report(ret);
+	}
+	if (ferror(f)) {
+		ERROR("%s: %s", listfn, strerror(errno));
+		++nfailed;
+	}
+	VERBOSE("copied %u files, %u failed", nfiles - nfailed, nfailed);
+	free(srcfn);
+	free(dstfn);
+	if (f != stdin)
+		fclose(f);
+	return (nfailed > 0 ? -1 : 0);
+}
+
+/*
+ * Parse a comma-separated list of page cache policy flags.
+ */
+static int
+cache_policy(const char *str)
+{
+	const char *p;
+	size_t len;
+	int policy;
+
+	policy = 0;
+	for (p = str; ; p += len + 1) {
+		len = strcspn(p, ",");
+		if (len == 10 && strncmp(p, "sequential", len) == 0)
+			policy |= CACHE_SEQUENTIAL;
+		else if (len == 8 && strncmp(p, "dontneed", len) == 0)
+			policy |= CACHE_DONTNEED;
+		else if (len == 9 && strncmp(p, "readahead", len) == 0)
+			policy |= CACHE_READAHEAD;
+		else if (len != 4 || strncmp(p, "none", len) != 0)
+			return (-1);
+		if (p[len] == '\0')
+			return (policy);
+	}
+}
+
+/*
+ * Parse a block size, optionally suffixed with k or m.  It must be a
+ * multiple of the page size and within our limits.
+ */
+static size_t
+block_size(const char *str)
+{
+	unsigned long bs;
+	char *e;
+
+	bs = strtoul(str, &e, 10);
+	if (e == str)
+		return (0);
+	if (*e == 'k' || *e == 'K') {
+		bs *= 1024;
+		++e;
+	} else if (*e == 'm' || *e == 'M') {
+		bs *= 1024 * 1024;
+		++e;
+	}
+	if (*e != '\0' || bs < MIN_BLOCKSIZE || bs > MAX_BLOCKSIZE ||
+	    bs % MIN_BLOCKSIZE != 0)
+		return (0);
+	return (bs);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx-copier [-nv] [-m maxsize] [-l logname] src dst\n");
+	fprintf(stderr, "usage: tsdfx-copier [-cDfGknv] [-b blocksize] "
+	    "[-H digest] [-L ratelimit] [-m maxsize]\n    [-l logname] "
+	    "[-P policy] [-r offset:length | -R rangesize] [-s statedir]\n"
+	    "    [-u qdepth] src dst\n"
+	    "       tsdfx-copier [-cDfGknv] [-b blocksize] [-H digest] "
+	    "[-L ratelimit] [-m maxsize]\n    [-l logname] [-P policy] "
+	    "[-s statedir] [-u qdepth] -B list\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	const char *logfile, *userlog;
-	uintmax_t maxsize;
+	const char *listfn, *logfile, *userlog;
+	uintmax_t maxsize, offset, length, rangesize;
+	unsigned long qdepth;
 	char *e;
-	int opt;
+	int opt, ret;
 
-	maxsize = 0;
-	logfile = userlog = NULL;
-	while ((opt = getopt(argc, argv, "fhl:nm:v")) != -1)
+	maxsize = offset = length = rangesize = 0;
+	listfn = logfile = userlog = NULL;
+	tsdfx_digest = tsd_digest_lookup("sha1");
+	while ((opt = getopt(argc, argv, "B:b:cDfGH:hkL:l:nm:P:r:R:s:u:v")) != -1)
 		switch (opt) {
+		case 'B':
+			listfn = optarg;
+			break;
+		case 'b':
+			if ((tsdfx_blocksize = block_size(optarg)) == 0) {
+				fprintf(stderr, "-b: invalid block size\n");
+				usage();
+			}
+			break;
+		case 'c':
+			++tsdfx_check;
+			break;
+		case 'D':
+			++tsdfx_direct;
+			break;
 		case 'f':
 			++tsdfx_force;
 			break;
+		case 'G':
+			++tsdfx_hugetlb;
+			break;
+		case 'H':
+			if ((tsdfx_digest = tsd_digest_lookup(optarg)) == NULL) {
+				fprintf(stderr, "-H: unknown digest algorithm\n");
+				usage();
+			}
+			break;
+		case 'k':
+			++tsdfx_kcopy;
+			break;
+		case 'L':
+			if (tsdfx_nratelimits == MAX_RATELIMITS ||
+			    tsd_ratelimit_parse(&tsdfx_ratelimit[tsdfx_nratelimits],
+			    optarg) != 0) {
+				fprintf(stderr, "-L: invalid rate limit\n");
+				usage();
+			}
+			tsdfx_nratelimits++;
+			break;
 		case 'l':
 			if (strncmp(optarg, ":user=", 6) == 0)
 				userlog = optarg + 6;
@@ -694,6 +3335,41 @@ main(int argc, char *argv[])
 		case 'n':
 			++tsdfx_dryrun;
 			break;
+		case 'P':
+			if ((tsdfx_cache = cache_policy(optarg)) < 0) {
+				fprintf(stderr, "-P: invalid cache policy\n");
+				usage();
+			}
+			break;
+		case 'r':
+			offset = strtoumax(optarg, &e, 10);
+			if (e == optarg || *e != ':' ||
+			    (length = strtoumax(e + 1, &e, 10)) == 0 ||
+			    *e != '\0' || offset > (uintmax_t)OFF_MAX ||
+			    length > (uintmax_t)OFF_MAX - offset) {
+				fprintf(stderr, "-r: invalid range\n");
+				usage();
+			}
+			break;
+		case 'R':
+			rangesize = strtoumax(optarg, &e, 10);
+			if (e == optarg || *e != '\0' || rangesize == 0 ||
+			    rangesize > (uintmax_t)OFF_MAX) {
+				fprintf(stderr, "-R: invalid range size\n");
+				usage();
+			}
+			break;
+		case 's':
+			tsdfx_statedir = optarg;
+			break;
+		case 'u':
+			qdepth = strtoul(optarg, &e, 10);
+			if (e == optarg || *e != '\0' || qdepth > MAX_QDEPTH) {
+				fprintf(stderr, "-u: invalid queue depth\n");
+				usage();
+			}
+			tsdfx_qdepth = qdepth;
+			break;
 		case 'v':
 			++tsd_log_verbose;
 			break;
@@ -704,18 +3380,37 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 2)
+	if (listfn != NULL) {
+		if (argc != 0 || length > 0 || rangesize > 0)
+			usage();
+	} else if (argc != 2 || (length > 0 && rangesize > 0)) {
 		usage();
+	}
 
 	tsd_log_init("tsdfx-copier", logfile);
 	tsd_log_userlog(userlog);
 
 	if (getuid() == 0 || geteuid() == 0)
 		WARNING("running as root");
+	if (tsdfx_digest == tsd_digest_lookup("sha1"))
+		VERBOSE("using %s SHA-1 implementation", sha1_implementation());
+	else if (tsdfx_digest == tsd_digest_lookup("blake3"))
+		VERBOSE("using %s BLAKE3 implementation",
+		    blake3_implementation());
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
-	if (tsdfx_copier(argv[0], argv[1], maxsize) != 0)
+	if (listfn != NULL)
+		ret = tsdfx_copier_batch(listfn, maxsize);
+	else if (length > 0)
+		ret = tsdfx_copier_range(argv[0], argv[1], offset, length);
+	else if (rangesize > 0)
+		ret = tsdfx_copier_join(argv[0], argv[1], rangesize);
+	else
+		ret = tsdfx_copier(argv[0], argv[1], maxsize);
+	if (tsdfx_dryrun && listfn == NULL && !killed)
+		tsdfx_copier_report(ret);
+	if (ret != 0)
 		exit(1);
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
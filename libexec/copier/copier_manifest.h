@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef COPIER_MANIFEST_H_INCLUDED
+#define COPIER_MANIFEST_H_INCLUDED
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+struct copier_manifest;
+
+struct copier_manifest *copier_manifest_new(size_t);
+struct copier_manifest *copier_manifest_load(const char *, const struct stat *,
+    size_t);
+int copier_manifest_save(struct copier_manifest *, const char *,
+    const struct stat *);
+void copier_manifest_free(struct copier_manifest *);
+int copier_manifest_match(const struct copier_manifest *, off_t,
+    const void *, size_t, uint8_t *);
+void copier_manifest_update(struct copier_manifest *, const void *, size_t);
+void copier_manifest_add(struct copier_manifest *, const uint8_t *);
+int copier_manifest_copy(struct copier_manifest *,
+    const struct copier_manifest *, off_t);
+
+#endif /* COPIER_MANIFEST_H_INCLUDED */
@@ -0,0 +1,385 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tsd/assert.h>
+#include <tsd/digest.h>
+
+#include "copier_manifest.h"
+
+/*
+ * Block digest manifest.  After copying a file, we record a digest of
+ * each block of the destination in a state file, along with enough
+ * information about the destination (including its ctime) to tell
+ * whether it has been modified since.  The next time the source
+ * changes, we can then compare each block of the source with the
+ * manifest instead of reading the destination.
+ *
+ * The manifest file consists of a single line of text describing the
+ * destination, followed by the digests in binary form.
+ */
+
+#define MANIFEST_MAGIC	"tsdfx-manifest 1"
+#define MANIFEST_ALG	"blake3"
+
+struct copier_manifest {
+	const struct tsd_digest_alg *alg;
+	size_t		 dlen;		/* length of each digest */
+	size_t		 bsize;		/* block size */
+	uint8_t		*digests;
+	size_t		 nblocks;	/* number of digests */
+	size_t		 maxblocks;	/* space allocated */
+	off_t		 size;		/* number of bytes covered */
+	tsd_digest_ctx	 ctx;		/* incomplete block */
+	uint8_t		 zero[TSD_DIGEST_MAX_LEN];
+	int		 havezero;	/* zero holds digest of zero block */
+	int		 error;
+};
+
+static const uint8_t zeroes[64*1024];
+
+/* allocate a manifest without any blocks */
+static struct copier_manifest *
+copier_manifest_alloc(const char *algname, size_t bsize)
+{
+	struct copier_manifest *m;
+
+	if ((m = calloc(1, sizeof *m)) == NULL)
+		return (NULL);
+	if ((m->alg = tsd_digest_lookup(algname)) == NULL) {
+		free(m);
+		return (NULL);
+	}
+	m->dlen = tsd_digest_len(m->alg);
+	m->bsize = bsize;
+	return (m);
+}
+
+/* grow the digest array to hold at least n digests */
+static int
+copier_manifest_grow(struct copier_manifest *m, size_t n)
+{
+	uint8_t *p;
+	size_t max;
+
+	if (n <= m->maxblocks)
+		return (0);
+	max = m->maxblocks ? m->maxblocks : 64;
+	while (max < n)
+		max *= 2;
+	if ((p = realloc(m->digests, max * m->dlen)) == NULL)
+		return (-1);
+	m->digests = p;
+	m->maxblocks = max;
+	return (0);
+}
+
+/* append a digest */
+static void
+copier_manifest_append(struct copier_manifest *m, const uint8_t *digest)
+{
+
+	if (m->error != 0)
+		return;
+	if (copier_manifest_grow(m, m->nblocks + 1) != 0) {
+		m->error = errno ? errno : ENOMEM;
+		return;
+	}
+	memcpy(m->digests + m->nblocks * m->dlen, digest, m->dlen);
+	m->nblocks++;
+}
+
+/* update the digest context with zeroes */
+static void
+copier_manifest_zeroes(tsd_digest_ctx *ctx, size_t len)
+{
+	size_t n;
+
+	for (; len > 0; len -= n) {
+		n = len > sizeof zeroes ? sizeof zeroes : len;
+		tsd_digest_update(ctx, zeroes, n);
+	}
+}
+
+/*
+ * Create a new, empty manifest for the given block size.
+ */
+struct copier_manifest *
+copier_manifest_new(size_t bsize)
+{
+
+	return (copier_manifest_alloc(MANIFEST_ALG, bsize));
+}
+
+/*
+ * Load the manifest for a file from the given path.  Fails with ESTALE
+ * if the file no longer matches the manifest, and with EINVAL if the
+ * manifest is malformed or was made with a different block size.
+ */
+struct copier_manifest *
+copier_manifest_load(const char *fn, const struct stat *st, size_t bsize)
+{
+	struct copier_manifest *m;
+	uintmax_t dev, ino;
+	intmax_t size, ctime_sec;
+	long ctime_nsec;
+	size_t mbsize, nblocks;
+	char name[16];
+	FILE *f;
+	int fd, serrno;
+
+	m = NULL;
+	f = NULL;
+	if ((fd = open(fn, O_RDONLY|O_NOFOLLOW)) < 0 ||
+	    (f = fdopen(fd, "r")) == NULL)
+		goto fail;
+	if (fscanf(f, MANIFEST_MAGIC " %15s %zu %jd %ju %ju %jd.%ld",
+	    name, &mbsize, &size, &dev, &ino, &ctime_sec, &ctime_nsec) != 7 ||
+	    fgetc(f) != '\n' || mbsize != bsize || size < 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if (dev != (uintmax_t)st->st_dev || ino != (uintmax_t)st->st_ino ||
+	    size != (intmax_t)st->st_size ||
+	    ctime_sec != (intmax_t)st->st_ctim.tv_sec ||
+	    ctime_nsec != (long)st->st_ctim.tv_nsec) {
+		errno = ESTALE;
+		goto fail;
+	}
+	if ((m = copier_manifest_alloc(name, bsize)) == NULL)
+		goto fail;
+	nblocks = (size + bsize - 1) / bsize;
+	if (copier_manifest_grow(m, nblocks) != 0)
+		goto fail;
+	if (fread(m->digests, m->dlen, nblocks, f) != nblocks ||
+	    fgetc(f) != EOF) {
+		errno = EINVAL;
+		goto fail;
+	}
+	m->nblocks = nblocks;
+	m->size = size;
+	fclose(f);
+	return (m);
+fail:
+	serrno = errno;
+	copier_manifest_free(m);
+	if (f != NULL)
+		fclose(f);
+	else if (fd >= 0)
+		close(fd);
+	errno = serrno;
+	return (NULL);
+}
+
+/*
+ * Write the manifest to the given path.  The stat structure must
+ * describe the file the manifest covers as it is now.
+ */
+int
+copier_manifest_save(struct copier_manifest *m, const char *fn,
+    const struct stat *st)
+{
+	uint8_t digest[TSD_DIGEST_MAX_LEN];
+	FILE *f;
+	int fd;
+
+	if (m->error != 0) {
+		errno = m->error;
+		return (-1);
+	}
+	if (m->size != st->st_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+	/* finish the last block */
+	if (m->size % m->bsize != 0 && m->nblocks * m->bsize < (size_t)m->size) {
+		tsd_digest_final(&m->ctx, digest);
+		copier_manifest_append(m, digest);
+		if (m->error != 0) {
+			errno = m->error;
+			return (-1);
+		}
+	}
+	if ((fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600)) < 0)
+		return (-1);
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(fn);
+		return (-1);
+	}
+	fprintf(f, "%s %s %zu %jd %ju %ju %jd.%09ld\n", MANIFEST_MAGIC,
+	    tsd_digest_name(m->alg), m->bsize, (intmax_t)m->size,
+	    (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+	    (intmax_t)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec);
+	if (fwrite(m->digests, m->dlen, m->nblocks, f) != m->nblocks ||
+	    fclose(f) != 0) {
+		unlink(fn);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Free a manifest.
+ */
+void
+copier_manifest_free(struct copier_manifest *m)
+{
+
+	if (m == NULL)
+		return;
+	free(m->digests);
+	memset(m, 0, sizeof *m);
+	free(m);
+}
+
+/*
+ * Compare a block of data with the manifest.  The offset must be at a
+ * block boundary and the length must match the length of the block
+ * as recorded in the manifest.  Returns 1 if the digests match, 0 if
+ * they don't and -1 if the manifest does not cover the block.  If the
+ * block was compared, its digest is stored in the last argument.
+ */
+int
+copier_manifest_match(const struct copier_manifest *m, off_t off,
+    const void *buf, size_t len, uint8_t *digest)
+{
+	tsd_digest_ctx ctx;
+	size_t i;
+
+	if (off < 0 || off % m->bsize != 0 || off >= m->size)
+		return (-1);
+	i = off / m->bsize;
+	if (len != (m->size - off < (off_t)m->bsize ?
+	    (size_t)(m->size - off) : m->bsize))
+		return (-1);
+	tsd_digest_init(&ctx, m->alg);
+	tsd_digest_update(&ctx, buf, len);
+	tsd_digest_final(&ctx, digest);
+	return (memcmp(digest, m->digests + i * m->dlen, m->dlen) == 0);
+}
+
+/*
+ * Add data to the manifest, which may span any number of blocks.  A
+ * null pointer stands for a run of zeroes.
+ */
+void
+copier_manifest_update(struct copier_manifest *m, const void *buf,
+    size_t len)
+{
+	uint8_t digest[TSD_DIGEST_MAX_LEN];
+	const uint8_t *p;
+	size_t n, off;
+
+	p = buf;
+	while (len > 0) {
+		off = m->size % m->bsize;
+		if (off == 0 && len >= m->bsize && p == NULL) {
+			/* whole block of zeroes */
+			if (!m->havezero) {
+				tsd_digest_init(&m->ctx, m->alg);
+				copier_manifest_zeroes(&m->ctx, m->bsize);
+				tsd_digest_final(&m->ctx, m->zero);
+				m->havezero = 1;
+			}
+			copier_manifest_append(m, m->zero);
+			n = m->bsize;
+		} else {
+			if (off == 0)
+				tsd_digest_init(&m->ctx, m->alg);
+			n = m->bsize - off;
+			if (n > len)
+				n = len;
+			if (p == NULL)
+				copier_manifest_zeroes(&m->ctx, n);
+			else
+				tsd_digest_update(&m->ctx, p, n);
+			if (off + n == m->bsize) {
+				tsd_digest_final(&m->ctx, digest);
+				copier_manifest_append(m, digest);
+			}
+		}
+		m->size += n;
+		if (p != NULL)
+			p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Add a complete block whose digest has already been computed.
+ */
+void
+copier_manifest_add(struct copier_manifest *m, const uint8_t *digest)
+{
+
+	ASSERT(m->size % m->bsize == 0);
+	copier_manifest_append(m, digest);
+	m->size += m->bsize;
+}
+
+/*
+ * Copy the digests for the first len bytes of one manifest into
+ * another, empty one.  The length must be a multiple of the block size.
+ */
+int
+copier_manifest_copy(struct copier_manifest *dst,
+    const struct copier_manifest *src, off_t len)
+{
+	size_t nblocks;
+
+	if (dst->size != 0 || dst->alg != src->alg ||
+	    dst->bsize != src->bsize || len % dst->bsize != 0 ||
+	    len > src->size) {
+		errno = EINVAL;
+		return (-1);
+	}
+	nblocks = len / dst->bsize;
+	if (copier_manifest_grow(dst, nblocks) != 0)
+		return (-1);
+	memcpy(dst->digests, src->digests, nblocks * dst->dlen);
+	dst->nblocks = nblocks;
+	dst->size = len;
+	return (0);
+}
@@ -34,10 +34,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#undef HAVE_PTHREAD_CREATE
+#endif
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -48,28 +55,142 @@
 #include <tsd/ctype.h>
 #include <tsd/log.h>
 #include <tsd/sbuf.h>
+#include <tsd/stat.h>
 #include <tsd/strutil.h>
 #include <tsd/percent.h>
+#include <tsd/uring.h>
 
 static long maxfiles = 80000;
 
+/* number of threads to scan with, and upper limit */
+#define MAX_THREADS	64
+static unsigned int nthreads = 1;
+
+/* how to stat entries whose type the directory does not tell us */
+static int statflags = TSD_STAT_NOFOLLOW;
+
+/*
+ * print metadata along with each file and directory, which means
+ * stat'ing them even when the directory tells us their type
+ */
+static int metadata;
+#define METADATA_MASK	(TSD_STAT_TYPE | TSD_STAT_MODE | TSD_STAT_OWNER | \
+			 TSD_STAT_SIZE | TSD_STAT_ATIME | TSD_STAT_MTIME | \
+			 TSD_STAT_INO)
+static unsigned int statmask = TSD_STAT_TYPE;
+
+/* how much to ask getdents64() for at a time */
+#define DENTS_BUFSIZE	(256*1024)
+
+/* io_uring queue depth for each thread, or 0 for plain system calls */
+#define MAX_QDEPTH	64
+static unsigned int qdepth;
+
+/* how many directories may be held open while waiting to be scanned */
+#define MAX_PREOPEN	256
+
+#if !HAVE_STRUCT_DIRENT_D_TYPE
+#undef HAVE_GETDENTS64
+#define DT_UNKNOWN	0
+#endif
+
 struct scan_entry {
 	struct sbuf *path;
-	struct scan_entry *next;
+	int fd;				/* opened ahead of time, or -1 */
+	struct scan_entry *prev, *next;
+};
+
+/*
+ * An entry read from a directory.  Entries are processed in batches,
+ * one for every buffer full of directory entries: first we stat the
+ * ones whose type we don't know, then, when using io_uring, we open the
+ * subdirectories, and finally we print them.  With io_uring, the stat
+ * and open calls for a batch are in flight at the same time instead of
+ * being issued one at a time.
+ */
+struct scan_dent {
+	const char *name;
+	unsigned long ino;
+	int type;			/* DT_* from the directory */
+	int err;			/* errno from stat, or 0 */
+	int fd;				/* subdirectory, or -1 */
+	struct stat st;
+#if HAVE_STATX
+	struct statx stx;
+#endif
+};
+
+struct scanpath;
+
+/*
+ * Each thread has its own worklist.  It appends the directories it finds
+ * to the end and takes the next one to scan from the front, and when it
+ * runs out, it steals one from the end of another thread's worklist.
+ * With a single thread, this is a plain breadth-first traversal.
+ */
+struct scanworker {
+	struct scanpath *sp;
+	struct scan_entry *todo, *tail;
+	struct scan_dent *dent;
+	size_t ndent, dentsz;
+	int full;
+	int ret;
+#if HAVE_GETDENTS64
+	char *dents;
+#endif
+#if HAVE_STATX
+	struct tsd_uring *ur;
+#endif
+#if HAVE_PTHREAD_CREATE
+	int running;
+	pthread_t thr;
+	pthread_mutex_t mtx;
+#endif
 };
 
 struct scanpath {
 	/*
-	 * Worklist
+	 * Worklists
 	 */
-	struct scan_entry *todo, *tail;
+	struct scanworker *worker;
+	unsigned int nworkers;
+
+	/*
+	 * Directories waiting in the worklists, and those plus the ones
+	 * being scanned.  We are done when the latter reaches zero.
+	 */
+	unsigned long nqueued, pending;
 
 	/*
 	 * Track number of entries found and when to stop.
 	 */
 	long processed;
+	int stop;
+
+	/*
+	 * Directories which were opened ahead of time and are waiting in
+	 * the worklists.
+	 */
+	unsigned int nopen;
+
+#if HAVE_PTHREAD_CREATE
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+#endif
 };
 
+#if HAVE_PTHREAD_CREATE
+#define SCAN_LOCK(o)	pthread_mutex_lock(&(o)->mtx)
+#define SCAN_UNLOCK(o)	pthread_mutex_unlock(&(o)->mtx)
+#define SCAN_WAIT(sp)	pthread_cond_wait(&(sp)->cond, &(sp)->mtx)
+#define SCAN_WAKE(sp)	pthread_cond_broadcast(&(sp)->cond)
+#else
+#define SCAN_LOCK(o)	((void)0)
+#define SCAN_UNLOCK(o)	((void)0)
+#define SCAN_WAIT(sp)	((void)0)
+#define SCAN_WAKE(sp)	((void)0)
+#endif
+
 /*
  * Free a worklist entry.  Save and restore errno to facilitate use in
  * error handling code.
@@ -83,29 +204,49 @@ tsdfx_scan_free(struct scan_entry *se)
 		serrno = errno;
 		if (se->path != NULL)
 			sbuf_delete(se->path);
+		if (se->fd >= 0)
+			close(se->fd);
 		free(se);
 		errno = serrno;
 	}
 }
 
 /*
- * Append a directory to the worklist.
+ * Append a directory to a thread's worklist, along with a descriptor
+ * for it if it has already been opened.  The entry takes ownership of
+ * the descriptor only if we succeed.
  */
 static struct scan_entry *
-tsdfx_scan_append(struct scanpath *sp, const struct sbuf *path)
+tsdfx_scan_append(struct scanworker *sw, const struct sbuf *path, int fd)
 {
+	struct scanpath *sp = sw->sp;
 	struct scan_entry *se;
 
 	if ((se = calloc(1, sizeof *se)) == NULL)
 		return (NULL);
+	se->fd = -1;
 	if ((se->path = sbuf_new_auto()) == NULL ||
 	    sbuf_cpy(se->path, sbuf_data(path)) == -1 ||
 	    sbuf_finish(se->path) == -1)
 		goto fail;
-	if (sp->todo == NULL)
-		sp->todo = sp->tail = se;
+	se->fd = fd;
+	/*
+	 * Count the entry before anyone can see it, since another thread
+	 * may take it and be done with it before we get any further.
+	 */
+	SCAN_LOCK(sp);
+	sp->nqueued++;
+	sp->pending++;
+	SCAN_UNLOCK(sp);
+	SCAN_LOCK(sw);
+	if ((se->prev = sw->tail) == NULL)
+		sw->todo = sw->tail = se;
 	else
-		sp->tail = sp->tail->next = se;
+		sw->tail = sw->tail->next = se;
+	SCAN_UNLOCK(sw);
+	SCAN_LOCK(sp);
+	SCAN_WAKE(sp);
+	SCAN_UNLOCK(sp);
 	return (se);
 fail:
 	tsdfx_scan_free(se);
@@ -113,93 +254,249 @@ fail:
 }
 
 /*
- * Remove and return the next entry from the worklist.
+ * Remove and return the first or last entry from a thread's worklist.
  */
 static struct scan_entry *
-tsdfx_scan_next(struct scanpath *sp)
+tsdfx_scan_take(struct scanworker *sw, int last)
 {
 	struct scan_entry *se;
 
-	if ((se = sp->todo) != NULL) {
-		if ((sp->todo = se->next) == NULL) {
-			ASSERT(sp->tail == se);
-			sp->tail = NULL;
-		}
+	SCAN_LOCK(sw);
+	if ((se = last ? sw->tail : sw->todo) != NULL) {
+		if (se->prev != NULL)
+			se->prev->next = se->next;
+		else
+			sw->todo = se->next;
+		if (se->next != NULL)
+			se->next->prev = se->prev;
+		else
+			sw->tail = se->prev;
+		se->prev = se->next = NULL;
 	}
+	SCAN_UNLOCK(sw);
 	return (se);
 }
 
 /*
- * Initialize the worklist and file list.
+ * Return the next directory for a thread to scan: the first one on its
+ * own worklist, or failing that, the last one on another's.  If there
+ * are none, wait until there are, or until there is nothing left to
+ * scan or we have been told to stop, in which case, return NULL.
  */
-static struct scanpath *
-tsdfx_scan_init(const char *root)
+static struct scan_entry *
+tsdfx_scan_next(struct scanworker *sw)
 {
+	struct scanpath *sp = sw->sp;
 	struct scan_entry *se;
-	struct scanpath *sp;
+	unsigned int i, self;
 
-	if ((sp = calloc(1, sizeof *sp)) == NULL)
-		return (NULL);
-	if ((se = calloc(1, sizeof *se)) == NULL)
-		goto fail;
-	if ((se->path = sbuf_new_auto()) == NULL ||
-	    sbuf_cpy(se->path, root) != 0 ||
-	    sbuf_finish(se->path) != 0)
-		goto fail;
-	sp->todo = sp->tail = se;
-	sp->processed = 0;
-	return (sp);
-fail:
-	tsdfx_scan_free(se);
-	se = NULL;
-	free(sp);
-	sp = NULL;
-	return (NULL);
+	self = sw - sp->worker;
+	for (;;) {
+		se = tsdfx_scan_take(sw, 0);
+		for (i = 1; se == NULL && i < sp->nworkers; ++i)
+			se = tsdfx_scan_take(&sp->worker[(self + i) %
+			    sp->nworkers], 1);
+		SCAN_LOCK(sp);
+		if (se != NULL) {
+			sp->nqueued--;
+			SCAN_UNLOCK(sp);
+			return (se);
+		}
+		if (sp->stop || sp->pending == 0) {
+			SCAN_UNLOCK(sp);
+			return (NULL);
+		}
+		if (sp->nqueued == 0)
+			SCAN_WAIT(sp);
+		SCAN_UNLOCK(sp);
+	}
 }
 
 /*
- * Empty the worklist and file list.
+ * A thread is done with a directory it took from a worklist.
+ */
+static void
+tsdfx_scan_done(struct scanpath *sp)
+{
+
+	SCAN_LOCK(sp);
+	if (--sp->pending == 0)
+		SCAN_WAKE(sp);
+	SCAN_UNLOCK(sp);
+}
+
+/*
+ * Tell all threads to stop.
+ */
+static void
+tsdfx_scan_abort(struct scanpath *sp)
+{
+
+	SCAN_LOCK(sp);
+	sp->stop = 1;
+	SCAN_WAKE(sp);
+	SCAN_UNLOCK(sp);
+}
+
+/*
+ * Count an entry before processing it.  Returns the number of entries
+ * counted so far, including this one, or -1 if we have been told to
+ * stop.  Once the limit is reached, the other threads are told to stop,
+ * so no more than maxfiles entries are ever processed.
+ */
+static long
+tsdfx_scan_count(struct scanpath *sp)
+{
+	long n;
+
+	SCAN_LOCK(sp);
+	if (sp->stop) {
+		n = -1;
+	} else {
+		n = ++sp->processed;
+		if (maxfiles != 0 && n >= maxfiles) {
+			sp->stop = 1;
+			SCAN_WAKE(sp);
+		}
+	}
+	SCAN_UNLOCK(sp);
+	return (n);
+}
+
+/*
+ * Release a directory which was opened ahead of time, once it has been
+ * closed.
+ */
+static void
+tsdfx_scan_release(struct scanpath *sp)
+{
+
+	SCAN_LOCK(sp);
+	sp->nopen--;
+	SCAN_UNLOCK(sp);
+}
+
+/*
+ * Empty the worklists and release everything.
  */
 static void
 tsdfx_scan_cleanup(struct scanpath *sp)
 {
 	struct scan_entry *se;
+	unsigned int i;
 
-	while ((se = tsdfx_scan_next(sp)) != NULL)
-		tsdfx_scan_free(se);
+	for (i = 0; i < sp->nworkers; ++i) {
+		while ((se = tsdfx_scan_take(&sp->worker[i], 0)) != NULL)
+			tsdfx_scan_free(se);
+#if HAVE_STATX
+		/* must go before the entries its requests point into */
+		tsd_uring_destroy(sp->worker[i].ur);
+#endif
+		free(sp->worker[i].dent);
+#if HAVE_GETDENTS64
+		free(sp->worker[i].dents);
+#endif
+#if HAVE_PTHREAD_CREATE
+		pthread_mutex_destroy(&sp->worker[i].mtx);
+#endif
+	}
+#if HAVE_PTHREAD_CREATE
+	pthread_cond_destroy(&sp->cond);
+	pthread_mutex_destroy(&sp->mtx);
+#endif
+	free(sp->worker);
 	free(sp);
-	sp = NULL;
 }
 
 /*
- * Process a directory entry.
+ * Initialize the worklists, with the root in the first one.
+ */
+static struct scanpath *
+tsdfx_scan_init(const char *root, unsigned int n)
+{
+	struct scanpath *sp;
+	struct sbuf *path;
+	unsigned int i;
+
+	if ((sp = calloc(1, sizeof *sp)) == NULL)
+		return (NULL);
+	if ((sp->worker = calloc(n, sizeof *sp->worker)) == NULL) {
+		free(sp);
+		return (NULL);
+	}
+#if HAVE_PTHREAD_CREATE
+	pthread_mutex_init(&sp->mtx, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	for (i = 0; i < n; ++i)
+		pthread_mutex_init(&sp->worker[i].mtx, NULL);
+#endif
+	for (i = 0; i < n; ++i)
+		sp->worker[i].sp = sp;
+	sp->nworkers = n;
+	sp->processed = 0;
+	if ((path = sbuf_new_auto()) == NULL ||
+	    sbuf_cpy(path, root) != 0 ||
+	    sbuf_finish(path) != 0 ||
+	    tsdfx_scan_append(&sp->worker[0], path, -1) == NULL) {
+		sbuf_delete(path);
+		tsdfx_scan_cleanup(sp);
+		return (NULL);
+	}
+	sbuf_delete(path);
+	return (sp);
+}
+
+/*
+ * Filter and count an entry read from a directory, and add it to the
+ * current batch.  Returns -1 if we should stop reading.
  */
 static int
-tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
-		     int dd, const struct dirent *de)
+tsdfx_scan_dirent(struct scanworker *sw, const struct sbuf *path,
+    const char *name, unsigned long ino, int type)
 {
+	struct scan_dent *d;
 	const char *p;
-	struct sbuf *path;
-	struct stat st;
-	int ret, serrno;
+	size_t sz;
+	long n;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return (0);
+	/* ignore all entries that start with a period */
+	if (name[0] == '.') {
+		size_t len = strlen(name);
+		size_t olen = percent_enclen(len);
+		char *encpath = calloc(1, olen);
+		if (0 == percent_encode(name, len, encpath, &olen)) {
+			USERERROR("ignoring dot file '%s/%s' [inode %lu]",
+			    sbuf_data(path), encpath, ino);
+		} else {
+			USERERROR("ignoring dot file '%s/[inode %lu]'",
+			    sbuf_data(path), ino);
+		}
+		free(encpath);
+		return (0);
+	}
+	if ((n = tsdfx_scan_count(sw->sp)) < 0)
+		return (-1);
+	if (0 != maxfiles && n >= maxfiles)
+		sw->full = 1;
 
 	/* validate file name */
-	for (p = de->d_name; *p; ++p) {
+	for (p = name; *p; ++p) {
 		if (!is_pfcs(*p) && *p != ' ') { /* XXX allow spaces for now */
 			/* soft error */
-			size_t len = strlen(de->d_name);
+			size_t len = strlen(name);
 			size_t olen = percent_enclen(len);
 			char *encpath = calloc(1, olen);
-			if (0 == percent_encode(de->d_name, len, encpath, &olen)) {
+			if (0 == percent_encode(name, len, encpath, &olen)) {
 				USERERROR("invalid character in file '%s/%s' [inode %lu]",
-				       sbuf_data(parent), encpath,
-				       (unsigned long)de->d_ino);
+				       sbuf_data(path), encpath, ino);
 			} else {
 				USERERROR("invalid character in file '%s/[inode %lu]'",
-				       sbuf_data(parent), (unsigned long)de->d_ino);
+				       sbuf_data(path), ino);
 			}
 			free(encpath);
-			return (0);
+			return (sw->full ? -1 : 0);
 		}
 	}
 	/*
@@ -207,26 +504,243 @@ tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
 	 * start or end with a space
 	 */
 
+	/* add to batch */
+	if (sw->ndent == sw->dentsz) {
+		sz = sw->dentsz ? sw->dentsz * 2 : 64;
+		if ((d = realloc(sw->dent, sz * sizeof *d)) == NULL) {
+			ERROR("%s: %s", sbuf_data(path), strerror(errno));
+			return (-1);
+		}
+		sw->dent = d;
+		sw->dentsz = sz;
+	}
+	d = &sw->dent[sw->ndent++];
+	d->name = name;
+	d->ino = ino;
+	d->type = type;
+	d->err = 0;
+	d->fd = -1;
+	return (sw->full ? -1 : 0);
+}
+
+#if HAVE_STRUCT_DIRENT_D_TYPE
+/*
+ * Whether we must stat an entry of known type to print its metadata.
+ * Only files and directories are printed, so the rest can be skipped.
+ */
+static int
+dent_wants_metadata(const struct scan_dent *d)
+{
+
+	return (metadata && (d->type == DT_REG || d->type == DT_DIR));
+}
+#endif
+
+#if HAVE_STATX
+/*
+ * Stat the entries in the current batch whose type we don't know, with
+ * up to qdepth requests in flight at a time.  On failure, there may be
+ * requests left in the ring, which the caller must drain before reusing
+ * the batch, and the scan must be aborted.
+ */
+static int
+tsdfx_scan_uring_stat(struct scanworker *sw, int dd)
+{
+	struct scan_dent *d;
+	uint64_t ud;
+	size_t i;
+	unsigned int inflight, mask;
+	int flags, res;
+
+	flags = tsd_statx_flags(statflags);
+	mask = tsd_statx_mask(statmask);
+	inflight = 0;
+	for (i = 0; ; ) {
+		/* queue as many as the ring will take */
+		for (; i < sw->ndent; ++i) {
+			d = &sw->dent[i];
+#if HAVE_STRUCT_DIRENT_D_TYPE
+			if (d->type != DT_UNKNOWN && !dent_wants_metadata(d)) {
+				d->st.st_mode = DTTOIF(d->type);
+				continue;
+			}
+#endif
+			if (tsd_uring_statx(sw->ur, dd, d->name, flags, mask,
+			    &d->stx, i) != 0)
+				break;
+			inflight++;
+		}
+		if (inflight == 0) {
+			if (i == sw->ndent)
+				break;
+			ERROR("io_uring: %s", strerror(errno));
+			return (-1);
+		}
+		if (tsd_uring_submit(sw->ur, 1) < 0) {
+			ERROR("io_uring_enter(): %s", strerror(errno));
+			return (-1);
+		}
+		while (tsd_uring_reap(sw->ur, &ud, &res) == 1) {
+			d = &sw->dent[ud];
+			if (res < 0)
+				d->err = -res;
+			else
+				tsd_statx_to_stat(&d->stx, &d->st);
+			inflight--;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Open the subdirectories in the current batch, with up to qdepth
+ * requests in flight at a time, instead of opening each of them when it
+ * comes up for scanning.  To avoid running out of file descriptors,
+ * only MAX_PREOPEN directories may be held open at any one time; any
+ * others are left for later.  If an open fails, we leave it to be
+ * retried, and the error reported, when the directory comes up.
+ */
+static int
+tsdfx_scan_uring_open(struct scanworker *sw, int dd)
+{
+	struct scanpath *sp = sw->sp;
+	struct scan_dent *d;
+	uint64_t ud;
+	size_t i;
+	unsigned int avail, inflight;
+	int res;
+
+	if (!tsd_uring_supported(sw->ur, TSD_URING_OPENAT))
+		return (0);
+	for (avail = 0, i = 0; i < sw->ndent; ++i)
+		if (sw->dent[i].err == 0 && S_ISDIR(sw->dent[i].st.st_mode))
+			avail++;
+	if (avail == 0)
+		return (0);
+	SCAN_LOCK(sp);
+	if (avail > MAX_PREOPEN - sp->nopen)
+		avail = MAX_PREOPEN - sp->nopen;
+	sp->nopen += avail;
+	SCAN_UNLOCK(sp);
+	inflight = 0;
+	for (i = 0; ; ) {
+		for (; i < sw->ndent && avail > inflight; ++i) {
+			d = &sw->dent[i];
+			if (d->err != 0 || !S_ISDIR(d->st.st_mode))
+				continue;
+			if (tsd_uring_openat(sw->ur, dd, d->name,
+			    O_RDONLY | O_DIRECTORY, 0, i) != 0)
+				break;
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
+		if (tsd_uring_submit(sw->ur, 1) < 0) {
+			ERROR("io_uring_enter(): %s", strerror(errno));
+			return (-1);
+		}
+		while (tsd_uring_reap(sw->ur, &ud, &res) == 1) {
+			if (res >= 0)
+				sw->dent[ud].fd = res;
+			inflight--;
+			avail--;
+			if (res >= 0)
+				continue;
+			/* give back the slot */
+			tsdfx_scan_release(sp);
+		}
+	}
+	/* give back what we did not use */
+	SCAN_LOCK(sp);
+	sp->nopen -= avail;
+	SCAN_UNLOCK(sp);
+	return (0);
+}
+#endif
+
+/*
+ * Stat the entries in the current batch whose type we don't know.
+ */
+static int
+tsdfx_scan_stat(struct scanworker *sw, int dd)
+{
+	struct scan_dent *d;
+	size_t i;
+
+#if HAVE_STATX
+	if (sw->ur != NULL)
+		return (tsdfx_scan_uring_stat(sw, dd));
+#endif
+	for (i = 0; i < sw->ndent; ++i) {
+		d = &sw->dent[i];
+#if HAVE_STRUCT_DIRENT_D_TYPE
+		if (d->type != DT_UNKNOWN && !dent_wants_metadata(d)) {
+			d->st.st_mode = DTTOIF(d->type);
+			continue;
+		}
+#endif
+		if (tsd_stat(dd, d->name, statflags, statmask, &d->st) != 0)
+			d->err = errno;
+	}
+	return (0);
+}
+
+/*
+ * Print an entry, preceded, if requested, by its mode in octal, owner,
+ * group, inode number, size, and access and modification times, each
+ * in seconds and nanoseconds separated by a period.
+ */
+static void
+tsdfx_scan_print(const char *path, const char *suffix, const struct stat *st)
+{
+
+	if (metadata) {
+		printf("%o %lu %lu %ju %jd %jd.%09ld %jd.%09ld %s%s\n",
+		    (unsigned int)st->st_mode, (unsigned long)st->st_uid,
+		    (unsigned long)st->st_gid, (uintmax_t)st->st_ino,
+		    (intmax_t)st->st_size,
+		    (intmax_t)st->st_atim.tv_sec, (long)st->st_atim.tv_nsec,
+		    (intmax_t)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+		    path, suffix);
+	} else {
+		printf("%s%s\n", path, suffix);
+	}
+}
+
+/*
+ * Process a directory entry once we know its type.
+ */
+static int
+tsdfx_process_dirent(struct scanworker *sw, const struct sbuf *parent,
+    struct scan_dent *d)
+{
+	const char *p;
+	struct sbuf *path;
+	mode_t mode;
+	int ret, serrno;
+
 	/* check file type */
-	if (fstatat(dd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
-		if (errno == EACCES || errno == EPERM) {
+	if (d->err != 0) {
+		if (d->err == EACCES || d->err == EPERM) {
 			USERERROR("%s/%s inaccessible", sbuf_data(parent),
-			    de->d_name);
+			    d->name);
 			return (0);
-		} else if (errno == ENOENT) {
+		} else if (d->err == ENOENT) {
 			VERBOSE("%s/%s disappeared", sbuf_data(parent),
-			    de->d_name);
+			    d->name);
 			return (0);
 		}
 		/* hard error */
-		ERROR("fstat(%s/%s): %s", sbuf_data(parent), de->d_name,
-		    strerror(errno));
+		ERROR("stat(%s/%s): %s", sbuf_data(parent), d->name,
+		    strerror(d->err));
+		errno = d->err;
 		return (-1);
 	}
+	mode = d->st.st_mode;
 
 	/* full path */
 	if ((path = sbuf_new_auto()) == NULL ||
-	    sbuf_printf(path, "%s/%s", sbuf_data(parent), de->d_name) != 0 ||
+	    sbuf_printf(path, "%s/%s", sbuf_data(parent), d->name) != 0 ||
 	    sbuf_finish(path) != 0) {
 		serrno = errno;
 		sbuf_delete(path);
@@ -238,17 +752,19 @@ tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
 	p = sbuf_data(path);
 	if ((p[0] == '.' || p[0] == '/') && p[1] == '/')
 		++p;
-	switch (st.st_mode & S_IFMT) {
+	switch (mode & S_IFMT) {
 	case S_IFDIR:
-		printf("%s/\n", p);
-		if (tsdfx_scan_append(sp, path) == NULL) {
+		tsdfx_scan_print(p, "/", &d->st);
+		if (tsdfx_scan_append(sw, path, d->fd) == NULL) {
 			/* hard error */
 			ERROR("failed to append %s to scan list", p);
 			ret = -1;
+		} else {
+			d->fd = -1;
 		}
 		break;
 	case S_IFREG:
-		printf("%s\n", p);
+		tsdfx_scan_print(p, "", &d->st);
 		break;
 	case S_IFLNK:
 		/* soft error */
@@ -257,25 +773,68 @@ tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
 	default:
 		/* soft error */
 		USERERROR("found strange file: %s (%#o)", p,
-		    st.st_mode & S_IFMT);
+		    mode & S_IFMT);
 		break;
 	}
 	sbuf_delete(path);
 	return (ret);
 }
 
+/*
+ * Process the current batch of directory entries.
+ */
+static int
+tsdfx_scan_flush(struct scanworker *sw, const struct sbuf *path, int dd)
+{
+	size_t i;
+	int ret;
+
+	ret = tsdfx_scan_stat(sw, dd);
+#if HAVE_STATX
+	if (ret == 0 && sw->ur != NULL)
+		ret = tsdfx_scan_uring_open(sw, dd);
+	/* requests left in flight point into the batch we are about to reuse */
+	if (ret != 0 && sw->ur != NULL)
+		(void)tsd_uring_drain(sw->ur);
+#endif
+	for (i = 0; ret == 0 && i < sw->ndent; ++i)
+		ret = tsdfx_process_dirent(sw, path, &sw->dent[i]);
+	/* close any directories we opened but did not get to */
+	for (i = 0; i < sw->ndent; ++i) {
+		if (sw->dent[i].fd >= 0) {
+			close(sw->dent[i].fd);
+			tsdfx_scan_release(sw->sp);
+		}
+	}
+	sw->ndent = 0;
+	return (ret);
+}
+
 /*
  * Process a single worklist entry (directory).
+ *
+ * Where possible, we read the directory with getdents64() directly into
+ * a large buffer, which saves a lot of round trips on network file
+ * systems compared to the modest buffer readdir() uses.
  */
 static int
-tsdfx_scan_process_directory(struct scanpath *sp, const struct sbuf *path)
+tsdfx_scan_process_directory(struct scanworker *sw, struct scan_entry *se)
 {
+	const struct sbuf *path = se->path;
+#if HAVE_GETDENTS64
+	struct dirent64 *de;
+	ssize_t len, off;
+#else
 	DIR *dir;
 	struct dirent *de;
-	int dd, ret, serrno;
+#endif
+	int dd, opened, ret, serrno;
 
 	ret = 0;
-	if ((dd = open(sbuf_data(path), O_RDONLY)) < 0) {
+	if ((opened = (se->fd >= 0))) {
+		dd = se->fd;
+		se->fd = -1;
+	} else if ((dd = open(sbuf_data(path), O_RDONLY | O_DIRECTORY)) < 0) {
 		if (errno == ENOENT) {
 			VERBOSE("%s disappeared", sbuf_data(path));
 			return (0);
@@ -286,46 +845,113 @@ tsdfx_scan_process_directory(struct scanpath *sp, const struct sbuf *path)
 		ERROR("%s: %s", sbuf_data(path), strerror(errno));
 		return (-1);
 	}
+#if HAVE_GETDENTS64
+	if (sw->dents == NULL && (sw->dents = malloc(DENTS_BUFSIZE)) == NULL) {
+		ERROR("%s: %s", sbuf_data(path), strerror(errno));
+		ret = -1;
+		len = 0;
+	}
+	while (ret == 0 &&
+	    (len = getdents64(dd, sw->dents, DENTS_BUFSIZE)) > 0) {
+		for (off = 0; ret == 0 && off < len; off += de->d_reclen) {
+			de = (struct dirent64 *)(void *)(sw->dents + off);
+			ret = tsdfx_scan_dirent(sw, path, de->d_name,
+			    (unsigned long)de->d_ino, de->d_type);
+		}
+		/* the names point into the buffer */
+		if (sw->ndent > 0 && tsdfx_scan_flush(sw, path, dd) != 0)
+			ret = -1;
+	}
+	if (ret == 0 && len < 0) {
+		ERROR("%s: %s", sbuf_data(path), strerror(errno));
+		ret = -1;
+	}
+	serrno = errno;
+	close(dd);
+	errno = serrno;
+#else
 	if ((dir = fdopendir(dd)) == NULL) {
 		ERROR("%s: %s", sbuf_data(path), strerror(errno));
+		close(dd);
+		if (opened)
+			tsdfx_scan_release(sw->sp);
 		return (-1);
 	}
 	while (ret == 0 && (de = readdir(dir)) != NULL) {
-		if (strcmp(de->d_name, ".") == 0 ||
-		    strcmp(de->d_name, "..") == 0)
-			continue;
-		/* ignore all entries that start with a period */
-		if (de->d_name[0] == '.') {
-			size_t len = strlen(de->d_name);
-			size_t olen = percent_enclen(len);
-			char *encpath = calloc(1, olen);
-			if (0 == percent_encode(de->d_name, len, encpath, &olen)) {
-				USERERROR("ignoring dot file '%s/%s' [inode %lu]",
-				    sbuf_data(path), encpath,
-				       (unsigned long)de->d_ino);
-			} else {
-				USERERROR("ignoring dot file '%s/[inode %lu]'",
-				       sbuf_data(path), (unsigned long)de->d_ino);
-			}
-			free(encpath);
-			continue;
-		}
-		if (tsdfx_process_dirent(sp, path, dd, de) != 0)
+#if HAVE_STRUCT_DIRENT_D_TYPE
+		ret = tsdfx_scan_dirent(sw, path, de->d_name,
+		    (unsigned long)de->d_ino, de->d_type);
+#else
+		ret = tsdfx_scan_dirent(sw, path, de->d_name,
+		    (unsigned long)de->d_ino, DT_UNKNOWN);
+#endif
+		/* the name is only valid until the next readdir() */
+		if (sw->ndent > 0 && tsdfx_scan_flush(sw, path, dd) != 0)
 			ret = -1;
-		else {
-			sp->processed++;
-			if (0 != maxfiles && sp->processed >= maxfiles) {
-				USERERROR("too many files in source, please reduce file count using zip/tar.");
-				ret = -1;
-			}
-		}
 	}
 	serrno = errno;
 	closedir(dir);
 	errno = serrno;
+#endif
+	if (opened)
+		tsdfx_scan_release(sw->sp);
+	if (sw->full) {
+		USERERROR("too many files in source, please reduce file count using zip/tar.");
+		ret = -1;
+	}
 	return (ret);
 }
 
+/*
+ * Scan directories until there are none left or we are told to stop.
+ * The first thread is the main thread; the others start here.
+ */
+static void *
+tsdfx_scan_worker(void *arg)
+{
+	struct scanworker *sw = arg;
+	struct scan_entry *se;
+
+	while ((se = tsdfx_scan_next(sw)) != NULL) {
+		if (tsdfx_scan_process_directory(sw, se) != 0) {
+			VERBOSE("FAILED scanning directory '%s'",
+			    sbuf_data(se->path));
+			sw->ret = -1;
+			tsdfx_scan_abort(sw->sp);
+		}
+		tsdfx_scan_free(se);
+		tsdfx_scan_done(sw->sp);
+	}
+	return (NULL);
+}
+
+#if HAVE_STATX
+/*
+ * Give each thread its own ring.  If that does not work out, we fall
+ * back to plain system calls.
+ */
+static void
+tsdfx_scan_uring_init(struct scanpath *sp)
+{
+	struct tsd_uring *ur;
+	unsigned int i;
+
+	for (i = 0; i < sp->nworkers; ++i) {
+		if ((ur = tsd_uring_create(qdepth)) == NULL) {
+			VERBOSE("io_uring unavailable: %s", strerror(errno));
+			return;
+		}
+		if (!tsd_uring_supported(ur, TSD_URING_STATX)) {
+			VERBOSE("io_uring lacks statx support");
+			tsd_uring_destroy(ur);
+			return;
+		}
+		sp->worker[i].ur = ur;
+	}
+	VERBOSE("using io_uring with queue depth %u", qdepth);
+}
+#endif
+
 /*
  * Entry point for the directory scanner child process.
  *
@@ -333,36 +959,63 @@ tsdfx_scan_process_directory(struct scanpath *sp, const struct sbuf *path)
  * subdirectories and prints the name of every regular file it finds.  It
  * ignores symlinks and files or directories whose names contain
  * characters outside the POSIX portable filename character set.
+ *
+ * With more than one thread, the order in which entries are printed is
+ * unpredictable, except that a directory is always printed before its
+ * contents.  Each line is printed with a single call to printf(), which
+ * locks the stream, so lines are never mixed up.
  */
 int
 tsdfx_scanner(const char *path)
 {
-	struct scan_entry *se;
 	struct scanpath *sp;
-	int serrno;
+	unsigned int i;
+	int ret;
 	struct timespec timer_end, timer_start;
 
-	if ((sp = tsdfx_scan_init(path)) == NULL)
+	if ((sp = tsdfx_scan_init(path, nthreads)) == NULL)
 		return (-1);
+#if HAVE_STATX
+	if (qdepth > 0)
+		tsdfx_scan_uring_init(sp);
+#endif
 
 #define ELAPSED(start, end) ((double)(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)/(double)1e9))
 	clock_gettime(CLOCK_MONOTONIC, &timer_start);
 
-	while ((se = tsdfx_scan_next(sp)) != NULL) {
-		if (tsdfx_scan_process_directory(sp, se->path) != 0) {
-			serrno = errno;
-			tsdfx_scan_free(se);
-			tsdfx_scan_cleanup(sp);
-			errno = serrno;
-			clock_gettime(CLOCK_MONOTONIC, &timer_end);
-			VERBOSE("FAILED scanning directory '%s', measured time: %.3lf s", se->path, ELAPSED(timer_start, timer_end));
-			return (-1);
-		}
+#if HAVE_PTHREAD_CREATE
+	/*
+	 * If a thread fails to start, its worklist stays empty and the
+	 * others get on with it.
+	 */
+	for (i = 1; i < sp->nworkers; ++i) {
+		if (pthread_create(&sp->worker[i].thr, NULL, tsdfx_scan_worker,
+		    &sp->worker[i]) == 0)
+			sp->worker[i].running = 1;
+		else
+			WARNING("failed to start scanner thread");
+	}
+#endif
+	tsdfx_scan_worker(&sp->worker[0]);
+	ret = sp->worker[0].ret;
+	for (i = 1; i < sp->nworkers; ++i) {
+#if HAVE_PTHREAD_CREATE
+		if (sp->worker[i].running)
+			pthread_join(sp->worker[i].thr, NULL);
+#endif
+		if (sp->worker[i].ret != 0)
+			ret = -1;
 	}
 	clock_gettime(CLOCK_MONOTONIC, &timer_end);
-	ASSERT(sp->todo == NULL && sp->tail == NULL);
-	VERBOSE("found %li dir entries, measured time: %.3lf s",
-	       sp->processed, path, ELAPSED(timer_start, timer_end));
+	if (ret != 0) {
+		VERBOSE("FAILED scanning %s, measured time: %.3lf s", path,
+		    ELAPSED(timer_start, timer_end));
+		tsdfx_scan_cleanup(sp);
+		return (-1);
+	}
+	ASSERT(sp->nqueued == 0 && sp->pending == 0 && sp->nopen == 0);
+	VERBOSE("found %li dir entries in %u threads, measured time: %.3lf s",
+	       sp->processed, sp->nworkers, ELAPSED(timer_start, timer_end));
 	tsdfx_scan_cleanup(sp);
 	sp = NULL;
 	return (0);
@@ -372,7 +1025,8 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx-scanner [-v] [-l logname] [-M maxfiles] path\n");
+	fprintf(stderr, "usage: tsdfx-scanner [-Amv] [-l logname] [-M maxfiles] "
+	    "[-t nthreads] [-u qdepth] path\n");
 	exit(1);
 }
 
@@ -381,17 +1035,25 @@ main(int argc, char *argv[])
 {
 	char *end;
 	const char *logfile, *userlog;
+	unsigned long n;
 	int opt;
 
 	logfile = userlog = NULL;
-	while ((opt = getopt(argc, argv, "hl:M:v")) != -1)
+	while ((opt = getopt(argc, argv, "Ahl:mM:t:u:v")) != -1)
 		switch (opt) {
+		case 'A':
+			statflags |= TSD_STAT_CACHED;
+			break;
 		case 'l':
 			if (strncmp(optarg, ":user=", 6) == 0)
 				userlog = optarg + 6;
 			else
 				logfile = optarg;
 			break;
+		case 'm':
+			metadata = 1;
+			statmask = METADATA_MASK;
+			break;
 		case 'M':
 			maxfiles = strtol(optarg, &end, 10);
 			if (end == optarg || *end != '\0' || maxfiles < 0) {
@@ -399,6 +1061,23 @@ main(int argc, char *argv[])
 				usage();
 			}
 			break;
+		case 't':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n < 1 ||
+			    n > MAX_THREADS) {
+				fprintf(stderr, "-t: invalid number of threads\n");
+				usage();
+			}
+			nthreads = n;
+			break;
+		case 'u':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n > MAX_QDEPTH) {
+				fprintf(stderr, "-u: invalid queue depth\n");
+				usage();
+			}
+			qdepth = n;
+			break;
 		case 'v':
 			++tsd_log_verbose;
 			break;
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Verify that the copier can copy a list of files in one run and
+# report on each of them, and that the daemon hands batches of small
+# files to a single copier when there are more than it can run at once.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+nfiles=40
+
+for i in $(seq ${nfiles}) ; do
+	echo "file ${i}" > "${srcdir}/f${i}"
+done
+
+# copier batch mode, with a missing source in the middle
+printf '%s\0' "${srcdir}/f1" "${dstdir}/f1" \
+    "${srcdir}/missing" "${dstdir}/missing" \
+    "${srcdir}/f2" "${dstdir}/f2" > "${tstdir}/list"
+if $copier -l "${logfile}" -B - < "${tstdir}/list" > "${tstdir}/results" \
+    2>/dev/null ; then
+	fail_test "copier did not report failure"
+fi
+if [ "$(echo $(cat "${tstdir}/results"))" != "0 1 0" ] ; then
+	fail_test "unexpected results: $(echo $(cat "${tstdir}/results"))"
+fi
+for file in f1 f2 ; do
+	if ! cmp -s "${srcdir}/${file}" "${dstdir}/${file}" ; then
+		fail_test "incorrect: ${dstdir}/${file}"
+	fi
+	rm "${dstdir}/${file}"
+done
+
+# the daemon batches small files
+run_daemon -1
+
+for i in $(seq ${nfiles}) ; do
+	if ! cmp -s "${srcdir}/f${i}" "${dstdir}/f${i}" ; then
+		fail_test "incorrect: ${dstdir}/f${i}"
+	fi
+done
+if ! grep -q "batch of [0-9]* files" "${logfile}" ; then
+	fail_test "files were not copied in batches"
+fi
+if grep -q "copy task failed" "${logfile}" ; then
+	fail_test "some copy tasks failed"
+fi
+
+cleanup_test
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Verify that the copier produces correct copies regardless of block
+# size, both from scratch and when updating an existing destination,
+# and rejects block sizes it cannot use.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=5001 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+
+for bs in 4k 64k 1m 4m 8192 ; do
+	for opts in "" "-u 8" ; do
+		rm -f "${dstdir}/file"
+		for pass in new update ; do
+			if ! $copier ${opts} -b ${bs} -l "${logfile}" \
+			    "${srcdir}/file" "${dstdir}/file" ; then
+				fail_test "copier returned failure with -b ${bs} ${opts} (${pass})"
+			fi
+			if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+				fail_test "incorrect with -b ${bs} ${opts} (${pass})"
+			fi
+			logged=$(logged_sha1 "${dstdir}/file")
+			if [ "${logged}" != "${expected}" ] ; then
+				fail_test "-b ${bs} ${opts}: logged digest ${logged} != ${expected}"
+			fi
+			# damage the copy so the update has work to do
+			printf 'x' | dd of="${dstdir}/file" bs=1 seek=3000000 \
+			    conv=notrunc >/dev/null 2>&1
+		done
+	done
+done
+
+for bs in 0 1000 4k1 128m bogus ; do
+	if $copier -b ${bs} "${srcdir}/file" "${dstdir}/file" 2>/dev/null ; then
+		fail_test "copier accepted block size ${bs}"
+	fi
+done
+
+cleanup_test
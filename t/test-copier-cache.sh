@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Verify that the copier produces correct copies with every page cache
+# policy, with and without direct I/O, and rejects policies it does not
+# know.  The file size is deliberately not a multiple of the page size.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=5001 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+
+for policy in none sequential dontneed readahead \
+    sequential,dontneed,readahead ; do
+	for opts in "" "-u 8" "-D" "-D -u 8" ; do
+		rm -f "${dstdir}/file"
+		if ! $copier ${opts} -P ${policy} -l "${logfile}" \
+		    "${srcdir}/file" "${dstdir}/file" ; then
+			fail_test "copier returned failure with ${policy} ${opts}"
+		fi
+		if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+			fail_test "incorrect with ${policy} ${opts}"
+		fi
+		logged=$(logged_sha1 "${dstdir}/file")
+		if [ "${logged}" != "${expected}" ] ; then
+			fail_test "${policy} ${opts}: logged digest ${logged} != ${expected}"
+		fi
+	done
+done
+
+for policy in bogus dontneed,bogus dontneed, ; do
+	if $copier -P ${policy} "${srcdir}/file" "${dstdir}/file" 2>/dev/null ; then
+		fail_test "copier accepted cache policy ${policy}"
+	fi
+done
+
+cleanup_test
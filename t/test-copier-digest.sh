@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Verify that the copier logs the digest algorithm selected with -H,
+# and that the digest is correct where we have an independent way of
+# computing it, with and without read-back verification.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=2500 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+
+for alg in sha1 sha256 blake3 ; do
+	rm -f "${dstdir}/file"
+	if ! $copier -H ${alg} -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+		fail_test "copier returned failure with ${alg}"
+	fi
+	if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+		fail_test "incorrect: ${dstdir}/file with ${alg}"
+	fi
+	logged=$(logged_digest ${alg} "${dstdir}/file")
+	case ${alg} in
+	blake3)
+		# no independent implementation; check the length
+		[ ${#logged} -eq 64 ] || fail_test "${alg}: logged ${logged}"
+		;;
+	*)
+		expected=$(openssl ${alg} -r "${srcdir}/file" | cut -d' ' -f1)
+		if [ "${logged}" != "${expected}" ] ; then
+			fail_test "${alg}: logged digest ${logged} != ${expected}"
+		fi
+		;;
+	esac
+done
+
+# check mode: read back and verify the destination
+rm -f "${dstdir}/file"
+if ! $copier -c -H sha256 -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure in check mode"
+fi
+expected=$(openssl sha256 -r "${srcdir}/file" | cut -d' ' -f1)
+logged=$(logged_digest sha256 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "check mode: logged digest ${logged} != ${expected}"
+fi
+
+if $copier -H md5 "${srcdir}/file" "${dstdir}/file" 2>/dev/null ; then
+	fail_test "copier accepted an unknown digest algorithm"
+fi
+
+cleanup_test
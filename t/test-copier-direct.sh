@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Verify that direct I/O produces an identical file and logs the
+# correct digest, including for files whose size is not a multiple of
+# the direct I/O alignment, for a destination which already holds part
+# of the file, and with buffers from the reserved huge page pool.  The
+# copier falls back to the page cache where direct I/O or huge pages
+# are unavailable, so this passes either way.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=3072 if=/dev/urandom of="${srcdir}/aligned" >/dev/null 2>&1
+dd bs=1234 count=2551 if=/dev/urandom of="${srcdir}/tail" >/dev/null 2>&1
+dd bs=100 count=1 if=/dev/urandom of="${srcdir}/tiny" >/dev/null 2>&1
+cp "${srcdir}/tail" "${srcdir}/resumed"
+dd bs=1k count=1000 if="${srcdir}/resumed" of="${dstdir}/resumed" \
+    >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}"/*
+
+for opts in "-D" "-D -b 4k" "-D -G" ; do
+	for f in aligned tail tiny resumed ; do
+		rm -f "${dstdir}/${f}.copy"
+		[ "${f}" = resumed ] && cp "${dstdir}/${f}" "${dstdir}/${f}.copy"
+		if ! $copier ${opts} -l "${logfile}" "${srcdir}/${f}" \
+		    "${dstdir}/${f}.copy" ; then
+			fail_test "copier ${opts} returned failure for ${f}"
+		fi
+		if ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}.copy" ; then
+			fail_test "incorrect with ${opts}: ${dstdir}/${f}.copy"
+		fi
+		expected=$(sha1sum "${srcdir}/${f}")
+		logged=$(logged_sha1 "${dstdir}/${f}.copy")
+		if [ "${logged}" != "${expected}" ] ; then
+			fail_test "${f} ${opts}: logged digest ${logged} != ${expected}"
+		fi
+	done
+done
+
+cleanup_test
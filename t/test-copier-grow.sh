@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Verify that the copier waits for a file which is still being written,
+# and that it finishes promptly once the writer closes it rather than
+# waiting for the file to age.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=1000 if=/dev/urandom of="${srcdir}/data" >/dev/null 2>&1
+
+# write the first half, pause, then write the rest and close
+{
+	head -c 600000 "${srcdir}/data"
+	sleep 2
+	tail -c +600001 "${srcdir}/data"
+} >"${srcdir}/file" &
+writer=$!
+sleep 1
+
+start=$(date +%s)
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure"
+fi
+elapsed=$(($(date +%s) - start))
+wait ${writer}
+
+if ! cmp -s "${srcdir}/data" "${dstdir}/file" ; then
+	fail_test "copy is incomplete or incorrect"
+fi
+# the file would not have aged enough until about six seconds after
+# the writer finished
+if [ ${elapsed} -ge 5 ] ; then
+	fail_test "copier took ${elapsed} seconds"
+fi
+
+cleanup_test
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Verify that an interrupted copy leaves a journal which the next
+# attempt resumes from, and that a stale journal is ignored, whether the
+# source or the destination has changed.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+journal="${dstdir}/.file.tsdfx-journal"
+
+dd bs=1k count=5000 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+
+# interrupt the copy and check that we get a journal
+$copier -m 1 "${srcdir}/file" "${dstdir}/file" 2>/dev/null
+if [ ! -f "${journal}" ] ; then
+	fail_test "no journal after interrupted copy"
+fi
+
+# resume from it
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure when resuming"
+fi
+if ! grep -q "from journal" "${logfile}" ; then
+	fail_test "copier did not resume from the journal"
+fi
+if [ -f "${journal}" ] ; then
+	fail_test "journal left behind after complete copy"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect: ${dstdir}/file"
+fi
+logged=$(logged_sha1 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "logged digest ${logged} != ${expected}"
+fi
+
+# a journal for a source which has since changed must be ignored
+rm -f "${dstdir}/file"
+$copier -m 1 "${srcdir}/file" "${dstdir}/file" 2>/dev/null
+dd bs=1k count=1 conv=notrunc if=/dev/urandom of="${srcdir}/file" \
+    >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+rm -f "${logfile}"
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure with stale journal"
+fi
+if grep -q "from journal" "${logfile}" ; then
+	fail_test "copier resumed from a stale journal"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect after stale journal: ${dstdir}/file"
+fi
+logged=$(logged_sha1 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "stale journal: logged digest ${logged} != ${expected}"
+fi
+
+# as must one for a destination which has been modified since, even if
+# its size and mtime are unchanged
+rm -f "${dstdir}/file"
+$copier -m 1 "${srcdir}/file" "${dstdir}/file" 2>/dev/null
+touch -r "${dstdir}/file" "${tstdir}/mtime"
+dd bs=1k count=1 conv=notrunc if=/dev/urandom of="${dstdir}/file" \
+    >/dev/null 2>&1
+touch -r "${tstdir}/mtime" "${dstdir}/file"
+rm -f "${logfile}"
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure with modified destination"
+fi
+if grep -q "from journal" "${logfile}" ; then
+	fail_test "copier resumed over a modified destination"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect after modified destination: ${dstdir}/file"
+fi
+
+cleanup_test
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Verify that kernel copy mode produces an identical file and logs the
+# same digest as the regular copy path, both for a fresh copy and when
+# resuming an interrupted one, and that a file which fails to copy in
+# the middle of a batch does not affect the files after it.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=3500 if=/dev/urandom of="${srcdir}/fresh" >/dev/null 2>&1
+cp "${srcdir}/fresh" "${srcdir}/resumed"
+dd bs=1k count=1500 if="${srcdir}/resumed" of="${dstdir}/resumed" \
+    >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/fresh" "${srcdir}/resumed"
+
+for f in fresh resumed ; do
+	if ! $copier -k -l "${logfile}" "${srcdir}/${f}" "${dstdir}/${f}" ; then
+		fail_test "copier returned failure in kernel copy mode"
+	fi
+	if ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}" ; then
+		fail_test "incorrect: ${dstdir}/${f}"
+	fi
+	expected=$(sha1sum "${srcdir}/${f}")
+	logged=$(logged_sha1 "${dstdir}/${f}")
+	if [ "${logged}" != "${expected}" ] ; then
+		fail_test "${f}: logged digest ${logged} != ${expected}"
+	fi
+done
+
+# in batch mode, let the first file fail part of the way through by
+# running into the file size limit
+dd bs=1k count=8192 if=/dev/urandom of="${srcdir}/big" >/dev/null 2>&1
+for f in one two ; do
+	dd bs=1k count=1500 if=/dev/urandom of="${srcdir}/${f}" \
+	    >/dev/null 2>&1
+done
+touch -d "1 hour ago" "${srcdir}/big" "${srcdir}/one" "${srcdir}/two"
+printf '%s\0' "${srcdir}/big" "${dstdir}/big" \
+    "${srcdir}/one" "${dstdir}/one" \
+    "${srcdir}/two" "${dstdir}/two" > "${tstdir}/list"
+if (
+	trap '' XFSZ
+	ulimit -f 4096
+	exec $copier -k -l "${logfile}" -B - < "${tstdir}/list" \
+	    > "${tstdir}/results" 2>/dev/null
+) ; then
+	fail_test "copier did not report failure"
+fi
+if [ "$(echo $(cat "${tstdir}/results"))" != "1 0 0" ] ; then
+	fail_test "unexpected results: $(echo $(cat "${tstdir}/results"))"
+fi
+for f in one two ; do
+	if ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}" ; then
+		fail_test "incorrect after failed file in batch: ${dstdir}/${f}"
+	fi
+	expected=$(sha1sum "${srcdir}/${f}")
+	logged=$(logged_sha1 "${dstdir}/${f}")
+	if [ "${logged}" != "${expected}" ] ; then
+		fail_test "${f}: logged digest ${logged} != ${expected}"
+	fi
+done
+
+cleanup_test
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Verify that the copier keeps a block manifest for large files, uses
+# it when the source is modified, and ignores it when the destination
+# has changed behind its back.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+manifest="${dstdir}/.file.tsdfx-manifest"
+
+dd bs=1k count=20000 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "3 hours ago" "${srcdir}/file"
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure"
+fi
+if [ ! -f "${manifest}" ] ; then
+	fail_test "no manifest after copy"
+fi
+
+# modify the source in place; the manifest should be used
+dd bs=1k seek=5000 count=3 conv=notrunc if=/dev/urandom \
+    of="${srcdir}/file" >/dev/null 2>&1
+touch -d "2 hours ago" "${srcdir}/file"
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+rm -f "${logfile}"
+if ! $copier -v -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure with manifest"
+fi
+if ! grep -q "using block manifest" "${logfile}" ; then
+	fail_test "manifest was not used"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect with manifest: ${dstdir}/file"
+fi
+logged=$(logged_sha1 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "logged digest ${logged} != ${expected}"
+fi
+
+# modify the destination; the manifest must not be trusted
+dd bs=1k seek=7000 count=3 conv=notrunc if=/dev/urandom \
+    of="${dstdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+rm -f "${logfile}"
+if ! $copier -v -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure with stale manifest"
+fi
+if grep -q "using block manifest" "${logfile}" ; then
+	fail_test "stale manifest was used"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect with stale manifest: ${dstdir}/file"
+fi
+
+# small files don't get one
+dd bs=1k count=100 if=/dev/urandom of="${srcdir}/small" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/small"
+$copier "${srcdir}/small" "${dstdir}/small" 2>/dev/null
+if [ -f "${dstdir}/.small.tsdfx-manifest" ] ; then
+	fail_test "manifest created for small file"
+fi
+
+cleanup_test
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Verify that preallocating the destination does not change its size:
+# an interrupted copy leaves a destination of the size copied so far
+# with no space allocated beyond it, so it resumes from the right
+# place, and a sparse source still yields a sparse destination.
+
+. $(dirname $0)/testsuite-common.sh
+
+# space allocated to a file, in bytes
+allocated() {
+	echo $(($(stat -c "%b * %B" "$1")))
+}
+
+setup_test
+
+dd bs=1M count=8 if=/dev/urandom of="${srcdir}/dense" >/dev/null 2>&1
+dd bs=1M count=2 seek=4 if=/dev/urandom of="${srcdir}/sparse" \
+    >/dev/null 2>&1
+truncate -s 16M "${srcdir}/sparse"
+touch -d "1 hour ago" "${srcdir}"/*
+
+# interrupted after the first block
+$copier -v -m 1048576 -l "${logfile}" "${srcdir}/dense" "${dstdir}/dense" ||
+    fail_test "copier returned failure for the first part"
+if ! grep -q "preallocated 8388608 bytes" "${logfile}" ; then
+	notice "preallocation not supported here"
+fi
+size=$(stat -c %s "${dstdir}/dense")
+if [ "${size}" -le 0 ] || [ "${size}" -ge 8388608 ] ; then
+	fail_test "interrupted copy has size ${size}"
+fi
+if [ $(allocated "${dstdir}/dense") -gt $((size + 65536)) ] ; then
+	fail_test "preallocated space not released after interruption"
+fi
+
+# resumed and completed
+$copier -v -l "${logfile}" "${srcdir}/dense" "${dstdir}/dense" ||
+    fail_test "copier returned failure for the rest"
+if ! cmp -s "${srcdir}/dense" "${dstdir}/dense" ; then
+	fail_test "incorrect: ${dstdir}/dense"
+fi
+if [ $(allocated "${dstdir}/dense") -gt $((8388608 + 65536)) ] ; then
+	fail_test "too much space allocated to ${dstdir}/dense"
+fi
+
+# sparse files are not preallocated, so they stay sparse
+$copier -v -l "${logfile}" "${srcdir}/sparse" "${dstdir}/sparse" ||
+    fail_test "copier returned failure for the sparse file"
+if ! cmp -s "${srcdir}/sparse" "${dstdir}/sparse" ; then
+	fail_test "incorrect: ${dstdir}/sparse"
+fi
+if [ $(stat -c %s "${dstdir}/sparse") -ne 16777216 ] ; then
+	fail_test "${dstdir}/sparse has the wrong size"
+fi
+if [ $(allocated "${dstdir}/sparse") -ge 16777216 ] ; then
+	fail_test "${dstdir}/sparse is not sparse"
+fi
+
+cleanup_test
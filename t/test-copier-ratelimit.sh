@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Verify that the copier honors rate limits, that a window which does
+# not cover the current time does not apply, and that the master hands
+# each copier its share of the limits.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=3072 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+
+# time a copy in whole seconds
+timed_copy() {
+	local start
+	rm -f "${dstdir}/file"
+	start=$(date +%s)
+	if ! $copier -b 256k "$@" -l "${logfile}" \
+	    "${srcdir}/file" "${dstdir}/file" ; then
+		fail_test "copier returned failure with $@"
+	fi
+	if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+		fail_test "incorrect with $@"
+	fi
+	echo $(($(date +%s) - start))
+}
+
+# the first second's worth is free, the remaining 2 MB take 2 seconds
+elapsed=$(timed_copy -L 1m)
+if [ "${elapsed}" -lt 2 ] ; then
+	fail_test "copy at 1 MB/s took ${elapsed} seconds"
+fi
+
+# the strictest of several limits applies
+elapsed=$(timed_copy -L 100m -L 1m)
+if [ "${elapsed}" -lt 2 ] ; then
+	fail_test "copy at 1 MB/s took ${elapsed} seconds with two limits"
+fi
+
+# a window which ended an hour ago
+start=$(date -d "2 hours ago" +%H:%M)
+end=$(date -d "1 hour ago" +%H:%M)
+elapsed=$(timed_copy -L "${start}-${end}=1k,0")
+if [ "${elapsed}" -gt 1 ] ; then
+	fail_test "inactive limit applied"
+fi
+
+if $copier -L 1x "${srcdir}/file" "${dstdir}/file" 2>/dev/null ; then
+	fail_test "copier accepted an invalid rate limit"
+fi
+
+# the master divides the limits between the copiers
+run_daemon -1 -L 12m -L large=08:00-17:00=2m,4m
+if ! grep -q "rate limit for each small file copier: 1048576 $" \
+    "${logfile}" ; then
+	fail_test "global limit not divided"
+fi
+if ! grep -q "rate limit for each large file copier: 1048576 08:00-17:00=524288,1048576" \
+    "${logfile}" ; then
+	fail_test "queue limit not divided"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect: ${dstdir}/file"
+fi
+
+cleanup_test
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Verify that the copier preserves holes in sparse files, that the
+# digest matches that of the equivalent dense file, and that holes are
+# punched in a destination which already has data in their place.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+# allocated size in kB
+allocated() {
+	du -k "$1" | cut -f1
+}
+
+# 8 MB hole, 1 MB data, 8 MB hole, 1 MB data, 4 MB hole
+dd bs=1M seek=8 count=1 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+dd bs=1M seek=17 count=1 conv=notrunc if=/dev/urandom \
+    of="${srcdir}/file" >/dev/null 2>&1
+truncate -s 22M "${srcdir}/file"
+touch -d "1 hour ago" "${srcdir}/file"
+if [ $(allocated "${srcdir}/file") -ge 8192 ] ; then
+	echo "filesystem does not support sparse files"
+	cleanup_test
+	exit 77
+fi
+expected=$(openssl sha1 -r "${srcdir}/file" | cut -d' ' -f1)
+
+# fresh copy
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect: ${dstdir}/file"
+fi
+if [ $(allocated "${dstdir}/file") -ge 8192 ] ; then
+	fail_test "destination is not sparse"
+fi
+logged=$(logged_sha1 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "logged digest ${logged} != ${expected}"
+fi
+
+# copy over a dense destination
+dd bs=1M count=22 if=/dev/urandom of="${dstdir}/file" >/dev/null 2>&1
+if ! $copier -l "${logfile}" "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure over dense destination"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect over dense destination: ${dstdir}/file"
+fi
+logged=$(logged_sha1 "${dstdir}/file")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "dense destination: logged digest ${logged} != ${expected}"
+fi
+
+cleanup_test
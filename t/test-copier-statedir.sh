@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Verify that journals and manifests are kept in the state directory
+# rather than next to the destination, and are still used from there.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+statedir="${tstdir}/state"
+mkdir "${statedir}"
+chmod 1777 "${statedir}"
+userdir="${statedir}/$(id -u)"
+
+dd bs=1k count=17408 if=/dev/urandom of="${srcdir}/file" >/dev/null 2>&1
+touch -d "3 hours ago" "${srcdir}/file"
+
+# interrupt the copy and check where the journal went
+$copier -s "${statedir}" -m 1 "${srcdir}/file" "${dstdir}/file" 2>/dev/null
+if ! ls "${userdir}"/*.tsdfx-journal >/dev/null 2>&1 ; then
+	fail_test "no journal in ${userdir} after interrupted copy"
+fi
+if ls -A "${dstdir}" | grep -q '^\.' ; then
+	fail_test "hidden files left in ${dstdir}"
+fi
+
+# resume from it
+if ! $copier -s "${statedir}" -l "${logfile}" \
+    "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure when resuming"
+fi
+if ! grep -q "from journal" "${logfile}" ; then
+	fail_test "copier did not resume from the journal"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect: ${dstdir}/file"
+fi
+if ! ls "${userdir}"/*.tsdfx-manifest >/dev/null 2>&1 ; then
+	fail_test "no manifest in ${userdir}"
+fi
+if ls -A "${dstdir}" | grep -q '^\.' ; then
+	fail_test "hidden files left in ${dstdir}"
+fi
+
+# modify the source and check that the manifest is used
+dd bs=1k count=1 seek=8192 conv=notrunc if=/dev/urandom \
+    of="${srcdir}/file" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/file"
+rm -f "${logfile}"
+if ! $copier -s "${statedir}" -v -l "${logfile}" \
+    "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "copier returned failure with manifest"
+fi
+if ! grep -q "blocks against the manifest" "${logfile}" ; then
+	fail_test "copier did not use the manifest"
+fi
+if ! cmp -s "${srcdir}/file" "${dstdir}/file" ; then
+	fail_test "incorrect after modification: ${dstdir}/file"
+fi
+
+cleanup_test
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Verify that the io_uring backend produces an identical file and logs
+# the correct digest, both for a fresh copy and when resuming an
+# interrupted one.  The copier falls back to regular system calls if
+# the kernel lacks io_uring, so this passes either way.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+dd bs=1k count=5500 if=/dev/urandom of="${srcdir}/fresh" >/dev/null 2>&1
+cp "${srcdir}/fresh" "${srcdir}/resumed"
+dd bs=1k count=2500 if="${srcdir}/resumed" of="${dstdir}/resumed" \
+    >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/fresh" "${srcdir}/resumed"
+
+for f in fresh resumed ; do
+	if ! $copier -u 8 -l "${logfile}" "${srcdir}/${f}" "${dstdir}/${f}" ; then
+		fail_test "copier returned failure with io_uring"
+	fi
+	if ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}" ; then
+		fail_test "incorrect: ${dstdir}/${f}"
+	fi
+	expected=$(sha1sum "${srcdir}/${f}")
+	logged=$(logged_sha1 "${dstdir}/${f}")
+	if [ "${logged}" != "${expected}" ] ; then
+		fail_test "${f}: logged digest ${logged} != ${expected}"
+	fi
+done
+
+# a changed source is compared with the destination's block manifest,
+# with many small blocks read ahead
+dd bs=1M count=17 if=/dev/urandom of="${srcdir}/manifest" >/dev/null 2>&1
+touch -d "2 hours ago" "${srcdir}/manifest"
+$copier -u 8 -b 64k "${srcdir}/manifest" "${dstdir}/manifest"
+dd bs=1k count=3 seek=9000 conv=notrunc if=/dev/urandom \
+    of="${srcdir}/manifest" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/manifest"
+rm -f "${logfile}"
+if ! $copier -v -u 8 -b 64k -l "${logfile}" "${srcdir}/manifest" \
+    "${dstdir}/manifest" ; then
+	fail_test "copier returned failure with io_uring and a manifest"
+fi
+if ! cmp -s "${srcdir}/manifest" "${dstdir}/manifest" ; then
+	fail_test "incorrect: ${dstdir}/manifest"
+fi
+if grep -q "io_uring" "${logfile}" ; then
+	notice "io_uring unavailable, manifest not checked"
+elif ! grep -q "blocks against the manifest" "${logfile}" ; then
+	fail_test "the block manifest was not used with io_uring"
+fi
+
+cleanup_test
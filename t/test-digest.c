@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Known-answer tests for the digest algorithms available through the
+ * tsd_digest interface.  The BLAKE3 vectors are from the official test
+ * suite, which uses an input consisting of the repeating sequence 0,
+ * 1, ..., 250.  They are run with each BLAKE3 implementation supported
+ * by the CPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tsd/blake3.h>
+#include <tsd/digest.h>
+
+static const char *blake3_impls[] = { "avx2", "generic" };
+
+static const struct {
+	const char	*alg;
+	const char	*msg;		/* NULL for the counting pattern */
+	size_t		 len;
+	const char	*digest;
+} vectors[] = {
+	{ "sha1", "abc", 3,
+	  "a9993e364706816aba3e25717850c26c9cd0d89d" },
+	{ "sha256", "", 0,
+	  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "sha256", "abc", 3,
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "sha256", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56,
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "blake3", NULL, 0,
+	  "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+	{ "blake3", NULL, 1,
+	  "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+	{ "blake3", NULL, 1023,
+	  "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+	{ "blake3", NULL, 1024,
+	  "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+	{ "blake3", NULL, 1025,
+	  "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+	{ "blake3", NULL, 2048,
+	  "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+	{ "blake3", NULL, 3073,
+	  "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+	{ "blake3", NULL, 8192,
+	  "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+	{ "blake3", NULL, 8193,
+	  "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+	{ "blake3", NULL, 16384,
+	  "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+	{ "blake3", NULL, 31744,
+	  "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+	{ "blake3", NULL, 102400,
+	  "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+};
+
+static uint8_t buf[102400];
+
+/*
+ * Hash the message in pieces of the given size and compare.  If
+ * requested, save and restore the state between pieces.
+ */
+static int
+test_vector(unsigned int i, size_t piece, int restore)
+{
+	const struct tsd_digest_alg *alg;
+	tsd_digest_ctx ctx;
+	uint8_t state[TSD_DIGEST_MAX_STATE_LEN];
+	size_t statelen;
+	uint8_t digest[TSD_DIGEST_MAX_LEN];
+	char str[TSD_DIGEST_MAX_LEN * 2 + 1];
+	const uint8_t *msg;
+	size_t off, len;
+
+	if ((alg = tsd_digest_lookup(vectors[i].alg)) == NULL) {
+		printf("%s: not found\n", vectors[i].alg);
+		return (1);
+	}
+	msg = vectors[i].msg ? (const uint8_t *)vectors[i].msg : buf;
+	tsd_digest_init(&ctx, alg);
+	for (off = 0; off < vectors[i].len; off += len) {
+		len = vectors[i].len - off;
+		if (len > piece)
+			len = piece;
+		tsd_digest_update(&ctx, msg + off, len);
+		if (restore) {
+			statelen = tsd_digest_save(&ctx, state, sizeof state);
+			memset(&ctx, 0xff, sizeof ctx);
+			if (tsd_digest_restore(&ctx, alg, state, statelen) != 0) {
+				printf("%s: failed to restore state\n",
+				    vectors[i].alg);
+				return (1);
+			}
+		}
+	}
+	tsd_digest_final(&ctx, digest);
+	for (off = 0; off < tsd_digest_len(alg); ++off)
+		snprintf(str + off * 2, 3, "%02x", digest[off]);
+	if (strcmp(str, vectors[i].digest) != 0) {
+		printf("%s: length %zu in pieces of %zu%s: "
+		    "expected %s, got %s\n", vectors[i].alg, vectors[i].len,
+		    piece, restore ? " with restore" : "",
+		    vectors[i].digest, str);
+		return (1);
+	}
+	return (0);
+}
+
+int
+main(void)
+{
+	static const size_t pieces[] = { 1, 63, 64, 65, 1000, 9000, SIZE_MAX };
+	unsigned int i, j, k;
+	int ret;
+
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = i % 251;
+	ret = 0;
+	for (i = 0; i < sizeof vectors / sizeof vectors[0]; ++i)
+		for (j = 0; j < sizeof pieces / sizeof pieces[0]; ++j)
+			ret |= test_vector(i, pieces[j], 0) |
+			    test_vector(i, pieces[j], 1);
+	for (k = 0; k < sizeof blake3_impls / sizeof blake3_impls[0]; ++k) {
+		if (blake3_select(blake3_impls[k]) != 0) {
+			if (errno != ENOTSUP && errno != ENOENT) {
+				printf("blake3 %s: %s\n", blake3_impls[k],
+				    strerror(errno));
+				ret = 1;
+			}
+			continue;
+		}
+		printf("blake3: using %s\n", blake3_implementation());
+		for (i = 0; i < sizeof vectors / sizeof vectors[0]; ++i) {
+			if (strcmp(vectors[i].alg, "blake3") != 0)
+				continue;
+			for (j = 0; j < sizeof pieces / sizeof pieces[0]; ++j)
+				ret |= test_vector(i, pieces[j], 0);
+		}
+	}
+	if (tsd_digest_lookup("md5") != NULL) {
+		printf("md5: unexpectedly found\n");
+		ret = 1;
+	}
+	printf("%s\n", ret ? "FAIL" : "ok");
+	return (ret);
+}
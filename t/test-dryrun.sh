@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Verify that a dry run compares files without creating or changing
+# anything, and reports how much it would have copied.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+# new file, identical contents but different times, different contents
+dd if=/dev/urandom of="${srcdir}/new" bs=1000 count=100 2>/dev/null
+dd if=/dev/urandom of="${srcdir}/same" bs=1000 count=100 2>/dev/null
+cp "${srcdir}/same" "${dstdir}/same"
+touch -d "2001-01-01 00:00:00" "${dstdir}/same"
+dd if=/dev/urandom of="${srcdir}/changed" bs=1000 count=100 2>/dev/null
+dd if=/dev/urandom of="${dstdir}/changed" bs=1000 count=100 2>/dev/null
+cp -p "${dstdir}/changed" "${tstdir}/changed"
+
+# the copier reports what it would copy
+set -- $($copier -n -l "${logfile}" "${srcdir}/new" "${dstdir}/new")
+if [ "$1" != 0 ] || [ "$2" != 100000 ] || [ "$3" != 100000 ] ; then
+	fail_test "unexpected result: $*"
+fi
+set -- $($copier -n -l "${logfile}" "${srcdir}/same" "${dstdir}/same")
+if [ "$1" != 0 ] || [ "$2" != 0 ] || [ "$3" != 100000 ] ; then
+	fail_test "unexpected result: $*"
+fi
+
+# the daemon adds it up
+run_daemon -1 -n
+
+if [ -e "${dstdir}/new" ] ; then
+	fail_test "dry run created ${dstdir}/new"
+fi
+if ! cmp -s "${dstdir}/changed" "${tstdir}/changed" ||
+    [ "${dstdir}/changed" -nt "${tstdir}/changed" ] ||
+    [ "${dstdir}/changed" -ot "${tstdir}/changed" ] ; then
+	fail_test "dry run modified ${dstdir}/changed"
+fi
+if [ "${dstdir}/same" -nt "${srcdir}/same" ] ; then
+	fail_test "dry run modified ${dstdir}/same"
+fi
+if ! grep -q "dry run checked 3 files, 0 failed, would copy 200000 of 300000 bytes" \
+    "${logfile}" ; then
+	fail_test "dry run totals missing or incorrect"
+fi
+
+cleanup_test
@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for parsing, formatting, dividing and looking up rate limits.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tsd/ratelimit.h>
+
+static const struct {
+	const char	*spec;
+	unsigned int	 scale;
+	const char	*expect;	/* NULL if invalid */
+} vectors[] = {
+	{ "1000", 1, "1000" },
+	{ "1k", 1, "1024" },
+	{ "20m", 4, "5242880" },
+	{ "1G", 1, "1073741824" },
+	{ "3", 2, "1" },
+	{ "0", 8, "0" },
+	{ "08:00-17:00=20m,200m", 1, "08:00-17:00=20971520,209715200" },
+	{ "22:30-06:00=0,1m", 2, "22:30-06:00=0,524288" },
+	{ "08:00-12:00=1k,12:00-17:00=2k", 1,
+	  "08:00-12:00=1024,12:00-17:00=2048,0" },
+	{ "", 1, NULL },
+	{ "fast", 1, NULL },
+	{ "-1", 1, NULL },
+	{ "1x", 1, NULL },
+	{ "1m,2m", 1, NULL },
+	{ "1m,", 1, NULL },
+	{ "24:00-01:00=1m", 1, NULL },
+	{ "08:0-17:00=1m", 1, NULL },
+	{ "08:00=1m", 1, NULL },
+	{ "08:00-17:00", 1, NULL },
+};
+
+/*
+ * Return the given local time of day today.
+ */
+static time_t
+at(int hour, int min)
+{
+	struct tm tm;
+	time_t now;
+
+	time(&now);
+	localtime_r(&now, &tm);
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 30;
+	tm.tm_isdst = -1;
+	return (mktime(&tm));
+}
+
+static const struct {
+	const char	*spec;
+	int		 hour, min;
+	uint64_t	 rate;
+} lookups[] = {
+	{ "08:00-17:00=20,200", 7, 59, 200 },
+	{ "08:00-17:00=20,200", 8, 0, 20 },
+	{ "08:00-17:00=20,200", 16, 59, 20 },
+	{ "08:00-17:00=20,200", 17, 0, 200 },
+	{ "22:00-06:00=50,10", 23, 0, 50 },
+	{ "22:00-06:00=50,10", 3, 0, 50 },
+	{ "22:00-06:00=50,10", 12, 0, 10 },
+	{ "00:00-12:00=1,06:00-18:00=2", 7, 0, 1 },
+	{ "00:00-12:00=1,06:00-18:00=2", 13, 0, 2 },
+	{ "00:00-12:00=1,06:00-18:00=2", 19, 0, 0 },
+};
+
+int
+main(void)
+{
+	struct tsd_ratelimit rl;
+	char buf[256];
+	unsigned int i;
+	uint64_t rate;
+	int ret;
+
+	ret = 0;
+	for (i = 0; i < sizeof vectors / sizeof vectors[0]; ++i) {
+		if (tsd_ratelimit_parse(&rl, vectors[i].spec) != 0) {
+			if (vectors[i].expect != NULL) {
+				printf("\"%s\": failed to parse\n",
+				    vectors[i].spec);
+				ret = 1;
+			}
+			continue;
+		}
+		if (vectors[i].expect == NULL) {
+			printf("\"%s\": unexpectedly parsed\n",
+			    vectors[i].spec);
+			ret = 1;
+			continue;
+		}
+		tsd_ratelimit_scale(&rl, vectors[i].scale);
+		if (tsd_ratelimit_format(&rl, buf, sizeof buf) != 0 ||
+		    strcmp(buf, vectors[i].expect) != 0) {
+			printf("\"%s\" / %u: expected \"%s\", got \"%s\"\n",
+			    vectors[i].spec, vectors[i].scale,
+			    vectors[i].expect, buf);
+			ret = 1;
+			continue;
+		}
+		/* what we format, we must be able to parse */
+		if (tsd_ratelimit_parse(&rl, buf) != 0) {
+			printf("\"%s\": failed to parse\n", buf);
+			ret = 1;
+		}
+	}
+	for (i = 0; i < sizeof lookups / sizeof lookups[0]; ++i) {
+		if (tsd_ratelimit_parse(&rl, lookups[i].spec) != 0) {
+			printf("\"%s\": failed to parse\n", lookups[i].spec);
+			ret = 1;
+			continue;
+		}
+		rate = tsd_ratelimit_rate(&rl, at(lookups[i].hour,
+		    lookups[i].min));
+		if (rate != lookups[i].rate) {
+			printf("\"%s\" at %02d:%02d: expected %ju, got %ju\n",
+			    lookups[i].spec, lookups[i].hour, lookups[i].min,
+			    (uintmax_t)lookups[i].rate, (uintmax_t)rate);
+			ret = 1;
+		}
+	}
+	printf("%s\n", ret ? "FAIL" : "ok");
+	return (ret);
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Verify that the scanner reports correct metadata when asked to, and
+# that the daemon rejects metadata which does not agree with the path.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir -p "${srcdir}/d/e"
+echo "hello" > "${srcdir}/x"
+echo "world" > "${srcdir}/d/y"
+echo "again" > "${srcdir}/d/e/z"
+chmod 0604 "${srcdir}/d/y"
+touch -d "2001-02-03 04:05:06.789" "${srcdir}/d/e/z"
+
+# the paths are the same with and without metadata
+(cd "${srcdir}" && $scanner -l "${logfile}" .) | sort > "${tstdir}/plain"
+(cd "${srcdir}" && $scanner -l "${logfile}" -m .) > "${tstdir}/meta"
+sed 's|^[^/]* /|/|' "${tstdir}/meta" | sort > "${tstdir}/paths"
+if ! cmp -s "${tstdir}/plain" "${tstdir}/paths" ; then
+	fail_test "paths differ with metadata"
+fi
+
+# the metadata matches what stat(1) says
+for f in x d/y d/e/z ; do
+	expected=$(printf "%o %s" 0x$(stat -c "%f" "${srcdir}/${f}") \
+	    "$(stat -c "%u %g %i %s %.9X %.9Y" "${srcdir}/${f}")")
+	reported=$(sed -n "s| /${f}\$||p" "${tstdir}/meta")
+	if [ "${reported}" != "${expected}" ] ; then
+		fail_test "${f}: reported [${reported}], expected [${expected}]"
+	fi
+done
+
+# and is the same with threads and io_uring, apart from directory atimes
+for opts in "-t 4" "-u 8" ; do
+	(cd "${srcdir}" && $scanner -l "${logfile}" -m ${opts} .) |
+	    awk '{ $6 = ""; print }' | sort > "${tstdir}/other"
+	awk '{ $6 = ""; print }' "${tstdir}/meta" | sort > "${tstdir}/expected"
+	if ! cmp -s "${tstdir}/expected" "${tstdir}/other" ; then
+		fail_test "metadata differs with ${opts}"
+	fi
+done
+
+# the daemon ignores entries whose metadata makes no sense
+cat > "${tstdir}/scanner" <<EOT
+#!/bin/sh
+echo "40755 0 0 1 0 0.000000000 0.000000000 /x"
+exec "${scanner}" "\$@"
+EOT
+chmod 0755 "${tstdir}/scanner"
+rm -rf "${srcdir}/d"
+touch -d "1 hour ago" "${srcdir}/x"
+run_daemon -1 -S "${tstdir}/scanner"
+if ! grep -q "invalid metadata" "${logfile}" ; then
+	fail_test "daemon accepted invalid metadata"
+fi
+if ! cmp -s "${srcdir}/x" "${dstdir}/x" ; then
+	fail_test "daemon did not copy a valid entry"
+fi
+
+cleanup_test
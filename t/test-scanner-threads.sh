@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Verify that a multi-threaded scanner finds the same entries as a
+# single-threaded one, that it stops at exactly the file limit, and
+# that the daemon can tell it to use threads.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+for i in $(seq 10) ; do
+	mkdir -p "${srcdir}/d${i}/e/f"
+	for j in $(seq 10) ; do
+		echo "${i} ${j}" > "${srcdir}/d${i}/x${j}"
+		echo "${i} ${j}" > "${srcdir}/d${i}/e/f/y${j}"
+	done
+done
+nentries=$(find "${srcdir}" -mindepth 1 | wc -l)
+
+(cd "${srcdir}" && $scanner -l "${logfile}" -M 0 .) | sort > "${tstdir}/one"
+(cd "${srcdir}" && $scanner -l "${logfile}" -M 0 -t 8 .) | sort > "${tstdir}/many"
+if [ $(wc -l < "${tstdir}/one") -ne ${nentries} ] ; then
+	fail_test "expected ${nentries} entries"
+fi
+if ! cmp -s "${tstdir}/one" "${tstdir}/many" ; then
+	fail_test "threaded scanner output differs"
+fi
+
+# the limit is exact
+maxfiles=$((nentries / 2))
+if (cd "${srcdir}" && $scanner -l "${logfile}" -M ${maxfiles} -t 8 .) \
+    > "${tstdir}/limited" 2>/dev/null ; then
+	fail_test "scanner did not report too many files"
+fi
+if [ $(wc -l < "${tstdir}/limited") -ne ${maxfiles} ] ; then
+	fail_test "expected ${maxfiles} entries, got $(wc -l < "${tstdir}/limited")"
+fi
+
+run_daemon -1 -T 4
+
+if ! grep -q "found ${nentries} dir entries in 4 threads" "${logfile}" ; then
+	fail_test "daemon did not run a threaded scanner"
+fi
+
+cleanup_test
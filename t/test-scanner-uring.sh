@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Verify that the scanner finds the same entries with io_uring as
+# without, including when there are more subdirectories than it will
+# open ahead of time, and that it still stops at exactly the file
+# limit.  The scanner falls back to regular system calls if the kernel
+# lacks io_uring, so this passes either way.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+for i in $(seq 300) ; do
+	mkdir -p "${srcdir}/d${i}/e"
+	echo "${i}" > "${srcdir}/d${i}/x"
+	echo "${i}" > "${srcdir}/d${i}/e/y"
+done
+nentries=$(find "${srcdir}" -mindepth 1 | wc -l)
+
+(cd "${srcdir}" && $scanner -l "${logfile}" -M 0 .) | sort > "${tstdir}/plain"
+if [ $(wc -l < "${tstdir}/plain") -ne ${nentries} ] ; then
+	fail_test "expected ${nentries} entries"
+fi
+for opts in "-u 1" "-u 16" "-u 16 -t 4" ; do
+	(cd "${srcdir}" && $scanner -l "${logfile}" -M 0 ${opts} .) |
+	    sort > "${tstdir}/uring"
+	if ! cmp -s "${tstdir}/plain" "${tstdir}/uring" ; then
+		fail_test "scanner output differs with ${opts}"
+	fi
+done
+
+# the limit is exact
+maxfiles=$((nentries / 2))
+if (cd "${srcdir}" && $scanner -l "${logfile}" -M ${maxfiles} -u 16 -t 4 .) \
+    > "${tstdir}/limited" 2>/dev/null ; then
+	fail_test "scanner did not report too many files"
+fi
+if [ $(wc -l < "${tstdir}/limited") -ne ${maxfiles} ] ; then
+	fail_test "expected ${maxfiles} entries, got $(wc -l < "${tstdir}/limited")"
+fi
+
+cleanup_test
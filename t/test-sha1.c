@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Known-answer tests for every SHA-1 implementation the CPU supports,
+ * plus a comparison of each against the generic implementation over a
+ * range of lengths and update patterns.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tsd/sha1.h>
+
+static const char *impls[] = {
+	"sha-ni", "avx2", "ssse3", "armv8", "generic",
+};
+
+static const struct {
+	const char	*msg;
+	unsigned int	 repeat;
+	const char	*digest;
+} vectors[] = {
+	{ "", 1,
+	  "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+	{ "abc", 1,
+	  "a9993e364706816aba3e25717850c26c9cd0d89d" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	  "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+	  "a49b2446a02c645bf419f995b67091253a04a259" },
+	{ "a", 1000000,
+	  "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+	{ "01234567012345670123456701234567"
+	  "01234567012345670123456701234567", 10,
+	  "dea356a2cddd90c7a7ecedc5ebb563934f460452" },
+};
+
+static unsigned char buf[1048576 + 137];
+
+static void
+hex(const uint8_t *digest, char *str)
+{
+
+	for (int i = 0; i < SHA1_DIGEST_LEN; ++i)
+		snprintf(str + i * 2, 3, "%02x", digest[i]);
+}
+
+static int
+test_vectors(const char *impl)
+{
+	sha1_ctx ctx;
+	uint8_t digest[SHA1_DIGEST_LEN];
+	char str[SHA1_DIGEST_LEN * 2 + 1];
+	unsigned int i, j;
+	int ret;
+
+	ret = 0;
+	for (i = 0; i < sizeof vectors / sizeof vectors[0]; ++i) {
+		sha1_init(&ctx);
+		for (j = 0; j < vectors[i].repeat; ++j)
+			sha1_update(&ctx, vectors[i].msg,
+			    strlen(vectors[i].msg));
+		sha1_final(&ctx, digest);
+		hex(digest, str);
+		if (strcmp(str, vectors[i].digest) != 0) {
+			printf("%s: vector %u: expected %s, got %s\n", impl,
+			    i, vectors[i].digest, str);
+			ret = 1;
+		}
+	}
+	return (ret);
+}
+
+static int
+test_compare(const char *impl)
+{
+	static const size_t lens[] = {
+		0, 1, 55, 56, 63, 64, 65, 127, 128, 129, 191, 192, 193,
+		4095, 4096, 4097, sizeof buf,
+	};
+	uint8_t expected[SHA1_DIGEST_LEN], digest[SHA1_DIGEST_LEN];
+	sha1_ctx ctx;
+	size_t len, off, chunk;
+	unsigned int i;
+	int ret;
+
+	ret = 0;
+	for (i = 0; i < sizeof lens / sizeof lens[0]; ++i) {
+		len = lens[i];
+		sha1_select("generic");
+		sha1_complete(buf, len, expected);
+		sha1_select(impl);
+		/* all at once */
+		sha1_complete(buf, len, digest);
+		if (memcmp(digest, expected, sizeof digest) != 0) {
+			printf("%s: length %zu: mismatch\n", impl, len);
+			ret = 1;
+		}
+		/* in irregular pieces */
+		sha1_init(&ctx);
+		for (off = 0, chunk = 1; off < len; off += chunk, chunk *= 3) {
+			if (chunk > len - off)
+				chunk = len - off;
+			sha1_update(&ctx, buf + off, chunk);
+		}
+		sha1_final(&ctx, digest);
+		if (memcmp(digest, expected, sizeof digest) != 0) {
+			printf("%s: length %zu in pieces: mismatch\n",
+			    impl, len);
+			ret = 1;
+		}
+	}
+	return (ret);
+}
+
+int
+main(void)
+{
+	unsigned int i, tested;
+	int ret;
+
+	for (i = 0; i < sizeof buf; ++i)
+		buf[i] = (unsigned char)(i * 2654435761U >> 13);
+	ret = 0;
+	tested = 0;
+	for (i = 0; i < sizeof impls / sizeof impls[0]; ++i) {
+		if (sha1_select(impls[i]) != 0) {
+			if (errno != ENOTSUP && errno != ENOENT) {
+				printf("%s: %s\n", impls[i], strerror(errno));
+				ret = 1;
+			}
+			continue;
+		}
+		if (strcmp(sha1_implementation(), impls[i]) != 0) {
+			printf("%s: selected %s instead\n", impls[i],
+			    sha1_implementation());
+			ret = 1;
+		}
+		ret |= test_vectors(impls[i]);
+		ret |= test_compare(impls[i]);
+		printf("%s: %s\n", impls[i], ret ? "FAIL" : "ok");
+		++tested;
+	}
+	if (tested == 0) {
+		printf("no implementation available\n");
+		ret = 1;
+	}
+	return (ret);
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Verify that large files are copied in parallel ranges, that the
+# result is correct, and that the combined digest is the digest of the
+# concatenated digests of the ranges.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+rangesize=1048576
+
+# print the combined digest of a file split into ranges
+ranges_sha1() {
+	local i size
+	size=$(stat -c%s "$1")
+	i=0
+	while [ $((i * rangesize)) -lt ${size} ] ; do
+		dd if="$1" bs=${rangesize} skip=${i} count=1 2>/dev/null |
+		    openssl sha1 -binary
+		i=$((i + 1))
+	done | openssl sha1 -r | cut -d' ' -f1
+}
+
+echo small > "${srcdir}/small"
+dd bs=1k count=5001 if=/dev/urandom of="${srcdir}/large" >/dev/null 2>&1
+touch -d "1 hour ago" "${srcdir}/large"
+expected=$(ranges_sha1 "${srcdir}/large")
+
+run_daemon -1 -r 1m
+
+for file in small large ; do
+	if ! cmp -s "${srcdir}/${file}" "${dstdir}/${file}" ; then
+		fail_test "incorrect: ${dstdir}/${file}"
+	fi
+done
+if ! grep -q "copying ${srcdir}/large in 5 ranges" "${logfile}" ; then
+	fail_test "large file was not split"
+fi
+logged=$(logged_digest "sha1/${rangesize}" "${dstdir}/large")
+if [ "${logged}" != "${expected}" ] ; then
+	fail_test "logged digest ${logged} != ${expected}"
+fi
+if [ -z "$(logged_sha1 "${dstdir}/small")" ] ; then
+	fail_test "small file was not copied whole"
+fi
+if [ "$(stat -c%Y "${srcdir}/large")" != "$(stat -c%Y "${dstdir}/large")" ] ; then
+	fail_test "mtime was not copied"
+fi
+if ls -a "${dstdir}" | grep -q tsdfx-range ; then
+	fail_test "range records left behind"
+fi
+
+# a range copied from a different version of the source is rejected
+rm "${dstdir}/large"
+$copier -l "${logfile}" -r 0:${rangesize} "${srcdir}/large" "${dstdir}/large"
+touch -d "2 hours ago" "${srcdir}/large"
+for offset in 1 2 3 4 ; do
+	$copier -l "${logfile}" -r $((offset * rangesize)):${rangesize} \
+	    "${srcdir}/large" "${dstdir}/large"
+done
+if $copier -l "${logfile}" -R ${rangesize} "${srcdir}/large" \
+    "${dstdir}/large" 2>/dev/null ; then
+	fail_test "copier combined a stale range"
+fi
+if ls -a "${dstdir}" | grep -q tsdfx-range ; then
+	fail_test "stale range records left behind"
+fi
+
+cleanup_test
@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for retrieving selected file attributes.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tsd/stat.h>
+
+#define ALL (TSD_STAT_TYPE | TSD_STAT_MODE | TSD_STAT_OWNER | \
+    TSD_STAT_SIZE | TSD_STAT_ATIME | TSD_STAT_MTIME | TSD_STAT_INO)
+
+static int
+compare(const char *name, int flags, const struct stat *ref)
+{
+	struct stat st;
+
+	if (tsd_stat(AT_FDCWD, name, flags, ALL, &st) != 0) {
+		printf("not ok - %s: %s\n", name, strerror(errno));
+		return (1);
+	}
+	if (st.st_dev != ref->st_dev || st.st_ino != ref->st_ino ||
+	    st.st_mode != ref->st_mode || st.st_uid != ref->st_uid ||
+	    st.st_gid != ref->st_gid || st.st_size != ref->st_size ||
+	    st.st_mtim.tv_sec != ref->st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != ref->st_mtim.tv_nsec) {
+		printf("not ok - %s: attributes differ\n", name);
+		return (1);
+	}
+	return (0);
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/test-stat.XXXXXX";
+	char file[sizeof dir + 8], link[sizeof dir + 8];
+	struct stat st, ref;
+	int fd, ret;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp()");
+		exit(1);
+	}
+	snprintf(file, sizeof file, "%s/file", dir);
+	snprintf(link, sizeof link, "%s/link", dir);
+	if ((fd = open(file, O_WRONLY | O_CREAT, 0640)) < 0 ||
+	    write(fd, "hello\n", 6) != 6 || close(fd) != 0 ||
+	    symlink("file", link) != 0) {
+		perror(file);
+		exit(1);
+	}
+	ret = 0;
+
+	/* files, with and without cached attributes */
+	if (lstat(file, &ref) != 0)
+		exit(1);
+	ret |= compare(file, 0, &ref);
+	ret |= compare(file, TSD_STAT_CACHED, &ref);
+
+	/* directories */
+	if (lstat(dir, &ref) != 0)
+		exit(1);
+	ret |= compare(dir, TSD_STAT_NOFOLLOW, &ref);
+
+	/* symbolic links, followed or not */
+	if (lstat(link, &ref) != 0)
+		exit(1);
+	ret |= compare(link, TSD_STAT_NOFOLLOW, &ref);
+	if (stat(link, &ref) != 0)
+		exit(1);
+	ret |= compare(link, 0, &ref);
+
+	/* only the type */
+	if (tsd_stat(AT_FDCWD, link, TSD_STAT_NOFOLLOW, TSD_STAT_TYPE,
+	    &st) != 0 || !S_ISLNK(st.st_mode)) {
+		printf("not ok - %s: not a symbolic link\n", link);
+		ret = 1;
+	}
+
+	/* relative to a directory, and missing files */
+	if ((fd = open(dir, O_RDONLY)) < 0 ||
+	    tsd_stat(fd, "file", 0, TSD_STAT_SIZE, &st) != 0 ||
+	    st.st_size != 6) {
+		printf("not ok - %s relative to %s\n", "file", dir);
+		ret = 1;
+	}
+	if (tsd_stat(fd, "missing", 0, TSD_STAT_TYPE, &st) == 0 ||
+	    errno != ENOENT) {
+		printf("not ok - missing file found\n");
+		ret = 1;
+	}
+	close(fd);
+
+	unlink(link);
+	unlink(file);
+	rmdir(dir);
+	exit(ret);
+}
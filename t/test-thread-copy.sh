@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Verify that small files which have stopped changing are copied by
+# worker threads in the master, and that everything else is still left
+# to the copier.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+for i in 1 2 3 4 5 6 7 8 ; do
+	echo "file ${i}" > "${srcdir}/f${i}"
+done
+: > "${srcdir}/empty"
+chmod 0640 "${srcdir}/f1"
+dd bs=1k count=100 if=/dev/urandom of="${srcdir}/large" >/dev/null 2>&1
+touch -d "1 minute ago" "${srcdir}"/*
+echo "fresh" > "${srcdir}/fresh"
+
+run_daemon -1 -t 4
+
+for file in f1 f2 f3 f4 f5 f6 f7 f8 empty large fresh ; do
+	if ! cmp -s "${srcdir}/${file}" "${dstdir}/${file}" ; then
+		fail_test "incorrect: ${dstdir}/${file}"
+	fi
+done
+for file in f1 f2 f3 f4 f5 f6 f7 f8 empty ; do
+	if ! grep -q "tsdfx_worker_copy() copied ${srcdir}/${file} " \
+	    "${logfile}" ; then
+		fail_test "${file} was not copied by a worker thread"
+	fi
+	if [ "$(stat -c%Y "${srcdir}/${file}")" != \
+	    "$(stat -c%Y "${dstdir}/${file}")" ] ; then
+		fail_test "mtime of ${file} was not copied"
+	fi
+done
+if [ "$(mode "${dstdir}/f1")" != "0640" ] ; then
+	fail_test "mode of f1 was not copied"
+fi
+for file in large fresh ; do
+	if grep -q "tsdfx_worker_copy() copied ${srcdir}/${file} " \
+	    "${logfile}" ; then
+		fail_test "${file} should have been left to the copier"
+	fi
+done
+expected=$(openssl sha1 -r "${srcdir}/f2" | cut -d' ' -f1)
+if [ "$(logged_sha1 "${dstdir}/f2")" != "${expected}" ] ; then
+	fail_test "wrong digest logged for f2"
+fi
+
+cleanup_test